@@ -0,0 +1,10 @@
+; Benchmark kernel: tight compare and branch loop, like loop.asm
+mov 0 r1
+loop:
+    add 1 r1
+    cmp 100 r1
+    jeq reset
+    jmp loop
+reset:
+    mov 0 r1
+    jmp loop
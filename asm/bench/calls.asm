@@ -0,0 +1,20 @@
+; Benchmark kernel: call/ret heavy code, nested like functions.asm
+mov 4000000 sp
+loop:
+    call outer
+    jmp loop
+
+outer:
+    add 1 r1
+    call inner
+    call inner
+    ret
+
+inner:
+    add 2 r2
+    call leaf
+    ret
+
+leaf:
+    mov r2 r3
+    ret
@@ -0,0 +1,20 @@
+; Benchmark kernel: ldr/str streaming through a block of RAM. Only direct
+; addresses exist, so the stream is unrolled over eight words.
+loop:
+    ldr $4000000 r1
+    str r1 $5000000
+    ldr $4000008 r1
+    str r1 $5000008
+    ldr $4000016 r1
+    str r1 $5000016
+    ldr $4000024 r1
+    str r1 $5000024
+    ldr $4000032 r1
+    str r1 $5000032
+    ldr $4000040 r1
+    str r1 $5000040
+    ldr $4000048 r1
+    str r1 $5000048
+    ldr $4000056 r1
+    str r1 $5000056
+    jmp loop
@@ -0,0 +1,15 @@
+; Benchmark kernel: MMIO output through the fileout device, like console.asm
+.EQU control_register $0x01100000
+.EQU data_register $0x01100008
+
+mov 4000000 sp
+loop:
+    mov 0x48 r1
+    call write_char
+    jmp loop
+
+write_char:
+    str r1 data_register
+    mov 1 r1
+    str r1 control_register ; enable write
+    ret
@@ -0,0 +1,16 @@
+; Benchmark kernel: push/pop stack churn
+mov 4000000 sp
+mov 1 r1
+mov 2 r2
+mov 3 r3
+mov 4 r4
+loop:
+    push r1
+    push r2
+    push r3
+    push r4
+    pop r1
+    pop r2
+    pop r3
+    pop r4
+    jmp loop
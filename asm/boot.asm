@@ -1,5 +1,7 @@
 .EQU reset_vector $8
 .EQU nmi_vector $16
+.EQU con_vector $32 ; line 3, console input
+.EQU pty_vector $40 ; line 4, PTY input
 .EQU initial_sp 0x8000
 
 boot:
@@ -9,22 +11,25 @@ boot:
     mov start r1 ;
     str r1 reset_vector ; 
     
-    mov nmi_handler r1 
+    mov input_handler r1 
     str r1 nmi_vector ; 
+    str r1 con_vector ;
+    str r1 pty_vector ;
     
     mov r0 r1 ; clean up the registers
     jmp init_data
 
-nmi_handler:
+input_handler:
     mov 0x48 r1
     call write_char
+    iret
 
 init_data:
 mov 0x49 r1
 str r1 $byte0
 
 start:
-nop
+wfi ; sleep until an interrupt
 ldr $byte0 r3
 jmp start
 
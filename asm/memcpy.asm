@@ -1,4 +1,35 @@
-.org 420
-mov 23 $69
-.org $69 
-mov 1 $1
\ No newline at end of file
+; Copies a buffer from a data segment to 0x2000 with the DMA controller,
+; then clears its last word with a fill. r1 ends up as 23, r2 as 0.
+.EQU dma_source $0x01100700
+.EQU dma_destination $0x01100708
+.EQU dma_length $0x01100710
+.EQU dma_fill $0x01100718
+.EQU dma_control $0x01100720
+
+    mov src r1
+    str r1 dma_source
+    mov 0x2000 r1
+    str r1 dma_destination
+    mov 32 r1
+    str r1 dma_length
+    mov 1 r1
+    str r1 dma_control
+
+    mov 0x2018 r1
+    str r1 dma_destination
+    mov 8 r1
+    str r1 dma_length
+    str r0 dma_fill
+    mov 2 r1
+    str r1 dma_control
+
+    ldr $0x2000 r1
+    ldr $0x2018 r2
+    hlt
+
+.data 0x1000
+src:
+.dw 23
+.dw 24
+.dw 25
+.dw 26
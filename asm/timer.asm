@@ -0,0 +1,38 @@
+; Periodic timer: the PIT raises an interrupt every 100000 cycles, the
+; handler writes a '.' through the fileout device and the CPU waits in wfi
+; in between. Halts after ten ticks.
+.EQU irq_vector $24 ; line 2, INT_PIT
+.EQU pit_control $0x01100300 ; enable = 1, periodic = 2
+.EQU pit_period $0x01100308
+.EQU control_register $0x01100000 ; fileout device
+.EQU data_register $0x01100008 ; fileout device
+
+; the interrupt vector overlaps the first instructions, so it is set last
+    mov 0x8000 sp
+    mov 100000 r1
+    str r1 pit_period
+    mov 3 r1
+    str r1 pit_control
+    mov tick r1
+    str r1 irq_vector
+
+idle:
+    wfi
+    jmp idle
+
+tick:
+    add 1 r5
+    mov 0x2E r1
+    call write_char
+    cmp 10 r5
+    jeq done
+    iret
+
+done:
+    hlt
+
+write_char:
+    str r1 data_register
+    mov 1 r1
+    str r1 control_register ; enable write
+    ret
@@ -7,6 +7,21 @@ import logging
 # Define the width of an instruction in bytes
 INSTRUCTION_WIDTH = 1 + 1 + 1 + 8 + 8
 
+# Start of an image in the compact encoding (see Instruction.encode_compact)
+COMPACT_MAGIC = b"TISCCMPT"
+
+# Images with segments, see the emulator's core/image.h
+IMAGE_MAGIC = b"TISCIMG1"
+IMAGE_ALIGN = 4096
+IMAGE_HEADER_SIZE = 40
+IMAGE_SEGMENT_SIZE = 40
+IMAGE_COMPACT = 1  # header flag
+SEGMENT_READ = 1
+SEGMENT_WRITE = 2
+SEGMENT_EXEC = 4
+
+RAM_LOW_SIZE = 16 * 1024 * 1024  # RAM at address 0, the rest of RAM is at 4 GB
+
 # Define the available opcodes as an enumeration
 @dataclass
 class Opcode:
@@ -30,8 +45,12 @@ class Opcode:
     JEQ: int = 17
     CALL: int = 200
     RET: int = 201
+    IRET: int = 202
     LDR: int = 210
     STR: int = 211
+    CAS: int = 230
+    FADD: int = 231
+    FENCE: int = 232
     LD8: int = 240
     LD16: int = 241
     LD32: int = 242
@@ -40,6 +59,7 @@ class Opcode:
     ST16: int = 245
     ST32: int = 246
     ST64: int = 247
+    WFI: int = 253
     RST: int = 254
     HLT: int = 255
 
@@ -151,6 +171,36 @@ class Instruction:
         ba.extend(int(destOperand).to_bytes(8, byteorder="little"))
         return ba
 
+    # Encode the instruction into the compact variable length format:
+    # opcode, srcMode | destMode << 4, a byte with the log2 sizes of the
+    # value operands (only if there are any), then the operands. Registers
+    # take one byte, also as the address of an indirect operand, absent
+    # operands none, values 1, 2, 4 or 8 bytes.
+    @staticmethod
+    def encode_compact(opcode, srcMode, destMode, srcOperand, destOperand):
+        ba = bytearray()
+        ba.extend(int(opcode).to_bytes(1, byteorder="little"))
+        ba.extend((int(srcMode) | int(destMode) << 4).to_bytes(1, byteorder="little"))
+
+        operands = bytearray()
+        sizes = 0
+        has_value = False
+        for shift, mode, operand in ((0, srcMode, srcOperand), (2, destMode, destOperand)):
+            if mode == AddressingMode.NONE:
+                continue
+            if mode == AddressingMode.REGISTER or mode == AddressingMode.INDIRECT:
+                operands.extend(int(operand).to_bytes(1, byteorder="little"))
+                continue
+            has_value = True
+            size_code = next(code for code in range(4) if int(operand) < 1 << (8 << code))
+            sizes |= size_code << shift
+            operands.extend(int(operand).to_bytes(1 << size_code, byteorder="little"))
+
+        if has_value:
+            ba.extend(sizes.to_bytes(1, byteorder="little"))
+        ba.extend(operands)
+        return ba
+
     # Decode a bytearray into an Instruction object
     @staticmethod
     def decode(ba: bytearray):
@@ -203,13 +253,32 @@ InstructionSet = {
     "SUB": Instruction(Opcode.SUB, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
     "MUL": Instruction(Opcode.MUL, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
     "DIV": Instruction(Opcode.DIV, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
+    "AND": Instruction(Opcode.AND, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
+    "OR": Instruction(Opcode.OR, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
+    "XOR": Instruction(Opcode.XOR, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
+    "NOT": Instruction(Opcode.NOT, AddressingMode.NONE, AddressingMode.REGISTER, Operand.NONE, Operand),
+    "LSH": Instruction(Opcode.LSH, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
+    "RSH": Instruction(Opcode.RSH, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.REGISTER, Operand, Operand),
     "JMP": Instruction(Opcode.JMP, AddressingMode.NONE, AddressingMode.IMMEDIATE, Operand.NONE, Operand),
     "CMP": Instruction(Opcode.CMP, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, AddressingMode.IMMEDIATE | AddressingMode.REGISTER, Operand, Operand),
     "JEQ": Instruction(Opcode.JEQ, AddressingMode.NONE, AddressingMode.IMMEDIATE, Operand.NONE, Operand),
     "CALL": Instruction(Opcode.CALL, AddressingMode.NONE, AddressingMode.IMMEDIATE, Operand.NONE, Operand),
     "RET": Instruction(Opcode.RET, AddressingMode.NONE, AddressingMode.NONE, Operand.NONE, Operand),
+    "WFI": Instruction(Opcode.WFI, AddressingMode.NONE, AddressingMode.NONE, Operand.NONE, Operand),
+    "IRET": Instruction(Opcode.IRET, AddressingMode.NONE, AddressingMode.NONE, Operand.NONE, Operand),
     "RST": Instruction(Opcode.RST, AddressingMode.NONE, AddressingMode.NONE, Operand.NONE, Operand),
     "HLT": Instruction(Opcode.HLT, AddressingMode.NONE, AddressingMode.NONE, Operand.NONE, Operand),
     "LDR": Instruction(Opcode.LDR, AddressingMode.DIRECT, AddressingMode.REGISTER, Operand, Operand),
     "STR": Instruction(Opcode.STR, AddressingMode.REGISTER, AddressingMode.DIRECT, Operand, Operand),
+    "LD8": Instruction(Opcode.LD8, AddressingMode.DIRECT | AddressingMode.INDIRECT, AddressingMode.REGISTER, Operand, Operand),
+    "LD16": Instruction(Opcode.LD16, AddressingMode.DIRECT | AddressingMode.INDIRECT, AddressingMode.REGISTER, Operand, Operand),
+    "LD32": Instruction(Opcode.LD32, AddressingMode.DIRECT | AddressingMode.INDIRECT, AddressingMode.REGISTER, Operand, Operand),
+    "LD64": Instruction(Opcode.LD64, AddressingMode.DIRECT | AddressingMode.INDIRECT, AddressingMode.REGISTER, Operand, Operand),
+    "ST8": Instruction(Opcode.ST8, AddressingMode.REGISTER, AddressingMode.DIRECT | AddressingMode.INDIRECT, Operand, Operand),
+    "ST16": Instruction(Opcode.ST16, AddressingMode.REGISTER, AddressingMode.DIRECT | AddressingMode.INDIRECT, Operand, Operand),
+    "ST32": Instruction(Opcode.ST32, AddressingMode.REGISTER, AddressingMode.DIRECT | AddressingMode.INDIRECT, Operand, Operand),
+    "ST64": Instruction(Opcode.ST64, AddressingMode.REGISTER, AddressingMode.DIRECT | AddressingMode.INDIRECT, Operand, Operand),
+    "CAS": Instruction(Opcode.CAS, AddressingMode.REGISTER, AddressingMode.DIRECT | AddressingMode.INDIRECT, Operand, Operand),
+    "FADD": Instruction(Opcode.FADD, AddressingMode.REGISTER, AddressingMode.DIRECT | AddressingMode.INDIRECT, Operand, Operand),
+    "FENCE": Instruction(Opcode.FENCE, AddressingMode.NONE, AddressingMode.NONE, Operand.NONE, Operand),
 }
\ No newline at end of file
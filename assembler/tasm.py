@@ -1,6 +1,8 @@
 #!/usr/bin/env python3
 import isa
 import argparse
+import struct
+from dataclasses import dataclass, field
 
 # tasm - the tiny assembler
 
@@ -34,9 +36,37 @@ def parse_directive(line):
     # Add more elif conditions here for other directives
 
 
-def parse_file(filename):
-    offset = 0
+# A segment is a run of instructions and words at consecutive addresses.
+# Without any segment directive the whole program is one readable,
+# writable and executable segment at 0.
+@dataclass
+class Segment:
+    address: int
+    flags: int
+    items: list = field(default_factory=list)  # (mnemonic, operands), ".DW" for words
 
+
+# Bytes an item takes; sizes holds the size of every item for the
+# compact encoding, without it every instruction is INSTRUCTION_WIDTH bytes
+def item_size(item, index, sizes):
+    if item[0] == ".DW":
+        return 8
+    if sizes is None:
+        return isa.INSTRUCTION_WIDTH
+    return sizes[index]
+
+
+def align(value):
+    return (value + isa.IMAGE_ALIGN - 1) & ~(isa.IMAGE_ALIGN - 1)
+
+
+# Returns the segments, with label and constant operands resolved, and
+# the entry point. .TEXT and .DATA start a read-only code segment and a
+# writable data segment, at the given address or at the next IMAGE_ALIGN
+# boundary; .ORG starts another segment like the current one at an
+# address. The trailing HLT goes at the end of the first segment that
+# has anything in it.
+def parse_file(filename, symbols=None, sizes=None):
     assembly_code = filename.read()
     # Split the code into lines
     lines = assembly_code.strip().split("\n")
@@ -50,18 +80,41 @@ def parse_file(filename):
     # uppercase all lines
     lines = [line.upper() for line in lines]
 
-    # Data structure to hold parsed instructions and labels
-    instructions = []
+    # Data structure to hold parsed segments and labels
+    segments = [Segment(0, isa.SEGMENT_READ | isa.SEGMENT_WRITE | isa.SEGMENT_EXEC)]
     labels = {}
     constants = {}
-    data = []
-
-    # State variable to track whether we're parsing instructions or data
-    parsing_data = False
+    entry = None
+    index = 0  # of the next item, across segments
+    size = 0  # of the current segment so far
 
     # fixed constants
     constants["SP"] = "R65"
 
+    halted = False  # the trailing HLT is in
+
+    def add_item(item):
+        nonlocal index, size
+        segments[-1].items.append(item)
+        size += item_size(item, index, sizes)
+        index += 1
+
+    def end_segment():
+        nonlocal halted
+        if segments[-1].items and not halted:
+            add_item(("HLT", []))
+            halted = True
+
+    def start_segment(address, flags):
+        nonlocal size
+        end_segment()
+        if address is None:
+            address = align(segments[-1].address + size)
+        if not segments[-1].items:
+            segments.pop()
+        segments.append(Segment(address, flags))
+        size = 0
+
     # Parse each line
     for i, line in enumerate(lines):
         if not line:
@@ -72,9 +125,15 @@ def parse_file(filename):
             parts = line.split()
             directive = parts[0]
             if directive == ".ORG":
-                # print ("DIRECTIVE:", directive)
-                offset = isa.Operand.to_int(parts[1])
-                # print("OFFSET:", offset)
+                start_segment(isa.Operand.to_int(parts[1]), segments[-1].flags)
+                continue
+            elif directive in (".TEXT", ".DATA"):
+                address = isa.Operand.to_int(parts[1]) if len(parts) > 1 else None
+                if directive == ".TEXT":
+                    start_segment(address, isa.SEGMENT_READ | isa.SEGMENT_EXEC)
+                else:
+                    start_segment(address, isa.SEGMENT_READ | isa.SEGMENT_WRITE)
+                print(f"SEGMENT: {directive} at {segments[-1].address:#x}")
                 continue
             elif directive == ".EQU":
                 # Extract the constant name and value
@@ -87,10 +146,11 @@ def parse_file(filename):
                     f"DIRECTIVE: {directive}, Name: {constant_name}, Value: {constant_value}"
                 )
                 continue
-            elif directive == ".DATA":
-                print("DATA PARSING")
-                parsing_data = True
-
+            elif directive == ".ENTRY":
+                entry = parts[1]
+                continue
+            elif directive == ".DW":
+                add_item((".DW", parts[1:2]))
                 continue
             if directive == ".END":
                 # print ("Encountered directive .END, ending assembly")
@@ -105,59 +165,57 @@ def parse_file(filename):
                 print("Error: Label already defined")
                 return None
 
-            labels[label_name] = len(instructions * isa.INSTRUCTION_WIDTH)
+            labels[label_name] = segments[-1].address + size
         else:
             # Split the line into components (instruction and operands)
             parts = line.split()
-            instruction = parts[0]
-            operands = parts[1:]
-            instructions.append((instruction, operands, offset))
+            add_item((parts[0], parts[1:]))
+
+    end_segment()
+    segments = [segment for segment in segments if segment.items]
 
-    # Now you have a list of instructions and a dictionary of labels with their associated instruction indices
-    print("Instructions:", instructions)
+    # Now you have the segments and a dictionary of labels with their addresses
+    print("Segments:", segments)
     print("Labels:", labels)
     print("Constants:", constants)
 
-    parsed_instructions = []
-
-    for instr, ops, offset in instructions:
-        mnemonic = instr
-        operands = []
-
-        # Check if any operand is a label
-        for op in ops:
-            if op in labels:
-                operands.append(str(labels[op]))
-            elif op.startswith("$") and op[1:] in labels:
-                # This is a byte address label
-                byte_address = labels[
-                    op[1:]
-                ]  # Look up the rest of the label in the labels dictionary
-                operands.append("$" + str(byte_address))
-            elif op in constants:
-                operands.append(str(constants[op]))
-            else:
-                operands.append(op)
-
-        # Print the instruction and operands
-        print(
-            f"Instruction: {mnemonic}, Operands: {', '.join(operands)}, Offset: {offset}"
-        )
-        parsed_instructions.append((mnemonic, operands, offset))
+    if symbols is not None:
+        symbols.update(labels)
+
+    def resolve(op):
+        # Check if the operand is a label
+        if op in labels:
+            return str(labels[op])
+        elif op.startswith("$") and op[1:] in labels:
+            # This is a byte address label
+            byte_address = labels[
+                op[1:]
+            ]  # Look up the rest of the label in the labels dictionary
+            return "$" + str(byte_address)
+        elif op in constants:
+            return str(constants[op])
+        return op
+
+    for segment in segments:
+        segment.items = [(mnemonic, [resolve(op) for op in ops]) for mnemonic, ops in segment.items]
+
+    if entry is not None:
+        entry = int(resolve(entry), 0)
+    else:
+        entry = segments[0].address
 
     # Find DB and store the value in memory
-    # Find DW and store the value in memory
     # Find DS and reserve space in memory
     # Find INCLUDE and include the file
     # Find MACRO and define a macro
     # Find ENDM and end the macro
     # Find IF and check the condition
 
-    return parsed_instructions
+    return segments, entry
 
 
 def assemble_instruction(asm):
-    mnemonic, args, offset = asm
+    mnemonic, args = asm
     if not hasattr(isa.Opcode, mnemonic):
         print("Error: Invalid mnemonic ")
         return
@@ -182,45 +240,113 @@ def assemble_instruction(asm):
         srcOperand: isa.Operand = isa.Operand.to_int(args[0])
         destOperand: isa.Operand = isa.Operand.to_int(args[1])
 
-    print("OFFSET:", offset)
-    if srcMode == isa.AddressingMode.DIRECT:
-        srcOperand += offset
-    if destMode == isa.AddressingMode.DIRECT:
-        destOperand += offset
-
     print("assemble:", opcode, srcMode, destMode, srcOperand, destOperand)
 
     return (opcode, srcMode, destMode, srcOperand, destOperand)
 
 
+# The size of a compact instruction depends on its operands, which may be
+# labels, which depend on the sizes of the instructions before them. Start
+# from the fixed width layout and shrink until nothing changes; sizes only
+# ever get smaller, so this terminates.
+def layout_compact(input_file):
+    sizes = None
+    while True:
+        input_file.seek(0)
+        segments, entry = parse_file(input_file, None, sizes)
+        new_sizes = [
+            8 if item[0] == ".DW" else len(isa.Instruction.encode_compact(*assemble_instruction(item)))
+            for segment in segments
+            for item in segment.items
+        ]
+        if new_sizes == sizes:
+            return sizes
+        sizes = new_sizes
+
+
+def encode_segment(segment, encode):
+    contents = bytearray()
+    for item in segment.items:
+        if item[0] == ".DW":
+            contents.extend(isa.Operand.to_int(item[1][0]).to_bytes(8, byteorder="little"))
+            continue
+        opcode, am1, am2, op1, op2 = assemble_instruction(item)
+        contents.extend(encode(opcode, am1, am2, op1, op2))
+        print(encode(opcode, am1, am2, op1, op2))
+    return contents
+
+
+# Flat memory image from address 0, as the emulator loads it into RAM
+def write_raw(output_file, segments, entry, compact):
+    if entry != 0:
+        print("Error: a raw image starts at 0, use -i for another entry point")
+        return False
+    image = bytearray()
+    for segment, contents in segments:
+        if segment.address + len(contents) > isa.RAM_LOW_SIZE:
+            print(f"Error: segment at {segment.address:#x} is outside low RAM, use -i")
+            return False
+        if len(image) < segment.address:
+            image.extend(bytes(segment.address - len(image)))
+        image[segment.address : segment.address + len(contents)] = contents
+    if compact:
+        output_file.write(isa.COMPACT_MAGIC)
+    output_file.write(image)
+    return True
+
+
+# Header, segment table, the contents of every segment at an IMAGE_ALIGN
+# file offset so the emulator can map them, then the symbol table. See
+# the emulator's core/image.h.
+def write_image(output_file, segments, entry, compact, labels):
+    symbols = "".join(f"{address:016x} {name}\n" for name, address in sorted(labels.items(), key=lambda label: label[1])).encode()
+    offset = align(isa.IMAGE_HEADER_SIZE + isa.IMAGE_SEGMENT_SIZE * len(segments))
+    table = bytearray()
+    for segment, contents in segments:
+        table.extend(struct.pack("<QQQQII", segment.address, offset, len(contents), len(contents), segment.flags, 0))
+        offset = align(offset + len(contents))
+
+    flags = isa.IMAGE_COMPACT if compact else 0
+    output_file.write(struct.pack("<8sIIQQQ", isa.IMAGE_MAGIC, flags, len(segments), entry, offset, len(symbols)))
+    output_file.write(table)
+    for segment, contents in segments:
+        output_file.seek(align(output_file.tell()))
+        output_file.write(contents)
+    output_file.seek(offset)
+    output_file.write(symbols)
+    return True
+
+
 def main():
     # Read filename from cmd line argument
 
     input_file = open(args.input, "r")
-    output_file = open(args.output, "wb")
-
-    # Write initial NOP
-    # output_file.write(isa.Instruction.encode(isa.Opcode.NOP, isa.AddressingMode.NONE, isa.AddressingMode.NONE, isa.Operand.NONE, isa.Operand.NONE))
-
-    for instruction in parse_file(input_file):
-        opcode, am1, am2, op1, op2 = assemble_instruction(instruction)
-        output_file.write(isa.Instruction.encode(opcode, am1, am2, op1, op2))
-        print(isa.Instruction.encode(opcode, am1, am2, op1, op2))
-
-    # Write trailing HLT
-    output_file.write(
-        isa.Instruction.encode(
-            isa.Opcode.HLT,
-            isa.AddressingMode.NONE,
-            isa.AddressingMode.NONE,
-            isa.Operand.NONE,
-            isa.Operand.NONE,
-        )
-    )
 
-    # Close files
+    encode = isa.Instruction.encode
+    sizes = None
+    if args.compact:
+        encode = isa.Instruction.encode_compact
+        sizes = layout_compact(input_file)
+        input_file.seek(0)
+
+    labels = {}
+    segments, entry = parse_file(input_file, labels, sizes)
+    segments = [(segment, encode_segment(segment, encode)) for segment in segments]
     input_file.close()
-    output_file.close()
+
+    with open(args.output, "wb") as output_file:
+        if args.image:
+            ok = write_image(output_file, segments, entry, args.compact, labels)
+        else:
+            ok = write_raw(output_file, segments, entry, args.compact)
+    if not ok:
+        exit(1)
+
+    # Label addresses for the emulator's profiler, one "<hex address> <label>" per line
+    if args.symbols:
+        with open(args.symbols, "w") as symbol_file:
+            for name, address in sorted(labels.items(), key=lambda label: label[1]):
+                symbol_file.write(f"{address:016x} {name}\n")
 
 
 if __name__ == "__main__":
@@ -228,6 +354,19 @@ if __name__ == "__main__":
         description="Assembler script to process assembly files."
     )
     parser.add_argument("-o", "--output", help="Output binary file", default="test.bin")
+    parser.add_argument("-s", "--symbols", help="Write label addresses to this file")
+    parser.add_argument(
+        "-c",
+        "--compact",
+        action="store_true",
+        help="Use the compact variable length encoding",
+    )
+    parser.add_argument(
+        "-i",
+        "--image",
+        action="store_true",
+        help="Write an image with segments, entry point and symbols instead of a flat binary",
+    )
     parser.add_argument("input", help="Input assembly file", default="test.asm")
     args = parser.parse_args()
     main()
@@ -1,5 +1,54 @@
-gcc -std=c11 -pedantic-errors -Werror -Wall -pedantic -g -o tisc-emu src/core/*.c src/memory/*.c src/devices/*.c src/main.c
+# Usage: sh build.sh [debug|release] [bench]
+#   debug    -g, debug logging compiled in and filtered at runtime with
+#            TISC_LOG=cpu,bus,ram,device (default: all)
+#   release  -O3 -DNDEBUG, debug logging compiled out
+#   bench    build tisc-bench instead, assemble the kernels in ../asm/bench
+#            and run them against bench/baseline-$CORE.txt
+BUILD=${1:-debug}
+TARGET=${2:-emu}
+if [ "$BUILD" = "release" ]; then
+    BUILD_FLAGS="-O3 -DNDEBUG"
+elif [ "$BUILD" = "debug" ]; then
+    BUILD_FLAGS="-g"
+else
+    echo "unknown build type: $BUILD" >&2
+    exit 1
+fi
+
+# CPU core: "interp" (instructionHandlers table, default), "threaded" (computed goto)
+# or "jit" (x86-64 translation of hot blocks on top of the interpreter)
+CORE=${CORE:-interp}
+CORE_FLAGS=""
+if [ "$CORE" = "threaded" ]; then
+    CORE_FLAGS="-DCPU_THREADED"
+elif [ "$CORE" = "jit" ]; then
+    CORE_FLAGS="-DCPU_JIT"
+fi
+
+# PROFILE=1 builds the guest profiler in (see core/profile.c). The JIT core
+# then interprets everything so that every instruction is counted.
+PROFILE_FLAGS=""
+if [ "${PROFILE:-0}" != "0" ]; then
+    PROFILE_FLAGS="-DPROFILE"
+fi
+
+CFLAGS="-std=c11 -pedantic-errors -Werror -Wall -pedantic $BUILD_FLAGS $CORE_FLAGS $PROFILE_FLAGS"
+SOURCES="src/common/*.c src/core/*.c src/memory/*.c src/devices/*.c"
+
+if [ "$TARGET" = "bench" ]; then
+    gcc $CFLAGS -o tisc-bench $SOURCES src/bench.c -pthread || exit 1
+    for kernel in ../asm/bench/*.asm; do
+        name=$(basename "$kernel" .asm)
+        python3 ../assembler/tasm.py -o "bench/$name.bin" "$kernel" > /dev/null || exit 1
+    done
+    ./tisc-bench -b "bench/baseline-$CORE.txt" bench/*.bin
+    exit
+elif [ "$TARGET" != "emu" ]; then
+    echo "unknown target: $TARGET" >&2
+    exit 1
+fi
+
+gcc $CFLAGS -o tisc-emu $SOURCES src/main.c -pthread
 #../assembler/tasm.py -o test.bin asm/test.asm > /dev/null
-#gcc -std=c11 -pedantic-errors -Werror -Wall -pedantic -O3 -o tisc-emu cpu.c video.c bus.c rom.c clock.c main.c
 
 #gcc -std=c11 -pedantic-errors -Werror -Wall -pedantic -g -o tisc-emu-gui cpu.c video.c bus.c rom.c gui.c -lSDL2 -lSDL2_ttf
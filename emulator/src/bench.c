@@ -0,0 +1,300 @@
+#define _GNU_SOURCE // syscall()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common/common.h"
+#include "core/machine.h"
+
+// Benchmark runner
+//
+// Runs each benchmark kernel (asm/bench) on a fresh machine for a fixed
+// number of instructions, flat out, and reports the emulation speed of
+// the fastest of a few runs. Host cache and branch misses are counted
+// with perf events when the kernel lets us open them. Results can be
+// checked against and written to a baseline file of "<kernel> <MIPS>"
+// lines.
+
+#define BENCH_DEFAULT_CYCLES 20000000
+#define BENCH_DEFAULT_REPEATS 5
+#define BENCH_DEFAULT_TOLERANCE 10 // percent slower than the baseline that counts as a regression
+#define BENCH_MAX_KERNELS 64
+#define BENCH_NAME_LENGTH 32
+
+// Host counters, opened as one group so they cover the same instructions
+enum
+{
+    BENCH_HOST_INSTRUCTIONS,
+    BENCH_CACHE_MISSES,
+    BENCH_BRANCH_MISSES,
+    BENCH_COUNTERS
+};
+
+static const uint64_t counterConfigs[BENCH_COUNTERS] = {
+    [BENCH_HOST_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [BENCH_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    [BENCH_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+typedef struct
+{
+    char name[BENCH_NAME_LENGTH];
+    double mips;
+} BenchResult;
+
+static int counterFds[BENCH_COUNTERS];
+static bool haveCounters;
+
+// Count user space events of the calling thread. Containers and
+// perf_event_paranoid often forbid this; the runner then just does without.
+static void BENCH_OpenCounters()
+{
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = counterConfigs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        counterFds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : counterFds[0], 0);
+        if (counterFds[i] < 0)
+        {
+            for (int j = 0; j < i; j++)
+                close(counterFds[j]);
+            fprintf(stderr, "perf events unavailable, host counters not reported\n");
+            return;
+        }
+    }
+    haveCounters = true;
+}
+
+static void BENCH_StartCounters()
+{
+    if (!haveCounters)
+        return;
+    ioctl(counterFds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counterFds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static bool BENCH_StopCounters(uint64_t *values)
+{
+    if (!haveCounters)
+        return false;
+    ioctl(counterFds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t group[1 + BENCH_COUNTERS]; // number of counters, then the counters
+    if (read(counterFds[0], group, sizeof(group)) != sizeof(group))
+        return false;
+    memcpy(values, &group[1], sizeof(uint64_t) * BENCH_COUNTERS);
+    return true;
+}
+
+static double BENCH_Seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// "bench/calls.bin" -> "calls"
+static void BENCH_KernelName(const char *path, char *name)
+{
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t length = strcspn(base, ".");
+    if (length >= BENCH_NAME_LENGTH)
+        length = BENCH_NAME_LENGTH - 1;
+    memcpy(name, base, length);
+    name[length] = '\0';
+}
+
+// Returns the number of entries read, 0 if there is no baseline yet
+static int BENCH_ReadBaseline(const char *path, BenchResult *baseline)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    char line[128];
+    int count = 0;
+    while (count < BENCH_MAX_KERNELS && fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%31s %lf", baseline[count].name, &baseline[count].mips) == 2)
+            count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static void BENCH_WriteBaseline(const char *path, const BenchResult *results, int count)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        print_error("Can't write %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "# kernel MIPS, written by tisc-bench -u\n");
+    for (int i = 0; i < count; i++)
+        fprintf(file, "%s %.1f\n", results[i].name, results[i].mips);
+    fclose(file);
+}
+
+static const BenchResult *BENCH_FindBaseline(const BenchResult *baseline, int count, const char *name)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(baseline[i].name, name) == 0)
+            return &baseline[i];
+    }
+    return NULL;
+}
+
+// Run one kernel: a warm-up tenth of the cycles, so the decode cache and
+// JIT are populated, then `repeats` timed runs of which the fastest
+// counts. Returns false if the kernel stopped before the end, kernels are
+// meant to loop forever.
+static bool BENCH_Run(const char *image, uint64_t cycles, int repeats, BenchResult *result)
+{
+    MachineConfig config = {.fileout = "/dev/null"};
+    Machine *m = MACHINE_Create(&config);
+    if (!MACHINE_Load(m, image))
+    {
+        MACHINE_Destroy(m);
+        return false;
+    }
+    BENCH_KernelName(image, result->name);
+
+    MachineStatus status = MACHINE_Run(m, cycles / 10);
+    double best = 0;
+    uint64_t bestRetired = 0;
+    uint64_t counters[BENCH_COUNTERS];
+    bool counted = false;
+    for (int i = 0; i < repeats && status == MACHINE_RUNNING; i++)
+    {
+        uint64_t start = SCHED_Now();
+        uint64_t values[BENCH_COUNTERS];
+
+        BENCH_StartCounters();
+        double begin = BENCH_Seconds();
+        status = MACHINE_Run(m, cycles);
+        double seconds = BENCH_Seconds() - begin;
+        bool read = BENCH_StopCounters(values);
+
+        uint64_t retired = SCHED_Now() - start;
+        if (best == 0 || seconds / retired < best / bestRetired)
+        {
+            best = seconds;
+            bestRetired = retired;
+            counted = read;
+            memcpy(counters, values, sizeof(counters));
+        }
+    }
+    MACHINE_Destroy(m);
+    if (status != MACHINE_RUNNING)
+    {
+        print_error("%s stopped before running %lu cycles\n", image, cycles);
+        return false;
+    }
+
+    result->mips = bestRetired / best / 1e6;
+    printf("%-12s %9.1f %9.2f", result->name, result->mips, best * 1e9 / bestRetired);
+    if (counted)
+    {
+        printf(" %9.1f %9.3f %9.3f", (double)counters[BENCH_HOST_INSTRUCTIONS] / bestRetired,
+               counters[BENCH_CACHE_MISSES] * 1000.0 / bestRetired, counters[BENCH_BRANCH_MISSES] * 1000.0 / bestRetired);
+    }
+    else
+        printf(" %9s %9s %9s", "-", "-", "-");
+    return true;
+}
+
+int main(int argc, char *args[])
+{
+    uint64_t cycles = BENCH_DEFAULT_CYCLES; // -n: instructions per timed run
+    int repeats = BENCH_DEFAULT_REPEATS;    // -r: timed runs per kernel
+    const char *baselinePath = NULL;        // -b: baseline to compare against
+    bool update = false;                    // -u: write the results to the baseline instead
+    double tolerance = BENCH_DEFAULT_TOLERANCE; // -t: allowed slowdown in percent
+    int option;
+
+    while ((option = getopt(argc, args, "n:r:b:ut:")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            cycles = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            repeats = strtol(optarg, NULL, 0);
+            break;
+        case 'b':
+            baselinePath = optarg;
+            break;
+        case 'u':
+            update = true;
+            break;
+        case 't':
+            tolerance = strtod(optarg, NULL);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n instructions] [-r repeats] [-b baseline [-u] [-t percent]] kernel.bin...\n", args[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    int count = argc - optind;
+    if (count <= 0 || count > BENCH_MAX_KERNELS || cycles == 0 || repeats <= 0)
+    {
+        fprintf(stderr, "usage: %s [-n instructions] [-r repeats] [-b baseline [-u] [-t percent]] kernel.bin...\n", args[0]);
+        return EXIT_FAILURE;
+    }
+
+    LOG_Init();
+    BENCH_OpenCounters();
+
+    static BenchResult baseline[BENCH_MAX_KERNELS];
+    static BenchResult results[BENCH_MAX_KERNELS];
+    int baselineCount = baselinePath && !update ? BENCH_ReadBaseline(baselinePath, baseline) : 0;
+
+    printf("%-12s %9s %9s %9s %9s %9s %9s\n", "kernel", "MIPS", "ns/insn", "host/insn", "cmiss/k", "bmiss/k", "baseline");
+    int regressions = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        BenchResult *result = &results[i - failed];
+        if (!BENCH_Run(args[optind + i], cycles, repeats, result))
+        {
+            failed++;
+            continue;
+        }
+
+        const BenchResult *expected = BENCH_FindBaseline(baseline, baselineCount, result->name);
+        if (!expected)
+        {
+            printf(" %9s\n", "-");
+            continue;
+        }
+        double change = (result->mips / expected->mips - 1) * 100;
+        bool regressed = change < -tolerance;
+        printf(" %9.1f %+6.1f%%%s\n", expected->mips, change, regressed ? " REGRESSION" : "");
+        regressions += regressed;
+    }
+
+    if (update && baselinePath)
+        BENCH_WriteBaseline(baselinePath, results, count - failed);
+    return failed || regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -4,30 +4,41 @@
 #include <stdio.h>
 #include <stdbool.h>
 
-extern bool debug;
+#include "log.h"
 
-#define print_debug(...)                                                   \
-    do                                                                     \
-    {                                                                      \
-        if (debug)                                                         \
-        {                                                                  \
-            fprintf(stderr, "%s:%d:%s(): ", __FILE__, __LINE__, __func__); \
-            fprintf(stderr, __VA_ARGS__);                                  \
-        }                                                                  \
+// Files pick their log category by defining LOG_CATEGORY before
+// including this header
+#ifndef LOG_CATEGORY
+#define LOG_CATEGORY LOG_GENERAL
+#endif
+
+// Debug output is compiled out entirely when LOG_LEVEL is below
+// LOG_LEVEL_DEBUG (release builds), and filtered by category otherwise
+#define print_debug(...)                                                                   \
+    do                                                                                     \
+    {                                                                                      \
+        if (LOG_LEVEL >= LOG_LEVEL_DEBUG && LOG_Enabled(LOG_CATEGORY))                     \
+        {                                                                                  \
+            LOG_Write(LOG_CATEGORY, LOG_LEVEL_DEBUG, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+        }                                                                                  \
     } while (0)
 
+// Errors bypass the ring so they are never lost before an exit()
 #define print_error(...)                                               \
     do                                                                 \
     {                                                                  \
+        LOG_Flush();                                                   \
         fprintf(stderr, "%s:%d:%s(): ", __FILE__, __LINE__, __func__); \
         fprintf(stderr, __VA_ARGS__);                                  \
     } while (0)
 
-#define print_info(...)                                                \
-    do                                                                 \
-    {                                                                  \
-        fprintf(stderr, "%s:%d:%s(): ", __FILE__, __LINE__, __func__); \
-        fprintf(stderr, __VA_ARGS__);                                  \
+#define print_info(...)                                                                   \
+    do                                                                                    \
+    {                                                                                     \
+        if (LOG_LEVEL >= LOG_LEVEL_INFO && LOG_Enabled(LOG_CATEGORY))                     \
+        {                                                                                 \
+            LOG_Write(LOG_CATEGORY, LOG_LEVEL_INFO, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+        }                                                                                 \
     } while (0)
 
-#endif // COMMON_H
\ No newline at end of file
+#endif // COMMON_H
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "isa.h"
+
+Instruction instructionSet[256] = {
+    [OP_NOP] = {.opcode = OP_NOP, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+    [OP_MOV] = {.opcode = OP_MOV, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_PUSH] = {.opcode = OP_PUSH, .srcMode = AM_NONE, .destMode = AM_REGISTER, .srcOperand = false, .destOperand = true},
+    [OP_POP] = {.opcode = OP_POP, .srcMode = AM_NONE, .destMode = AM_REGISTER, .srcOperand = false, .destOperand = true},
+    [OP_ADD] = {.opcode = OP_ADD, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_SUB] = {.opcode = OP_SUB, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_MUL] = {.opcode = OP_MUL, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_DIV] = {.opcode = OP_DIV, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_AND] = {.opcode = OP_AND, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_OR] = {.opcode = OP_OR, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_XOR] = {.opcode = OP_XOR, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_NOT] = {.opcode = OP_NOT, .srcMode = AM_NONE, .destMode = AM_REGISTER, .srcOperand = false, .destOperand = true},
+    [OP_LSH] = {.opcode = OP_LSH, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_RSH] = {.opcode = OP_RSH, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_CALL] = {.opcode = OP_CALL, .srcMode = AM_NONE, .destMode = AM_IMMEDIATE, .srcOperand = false, .destOperand = true},
+    [OP_JMP] = {.opcode = OP_JMP, .srcMode = AM_NONE, .destMode = AM_IMMEDIATE, .srcOperand = false, .destOperand = true},
+    [OP_JEQ] = {.opcode = OP_JEQ, .srcMode = AM_NONE, .destMode = AM_IMMEDIATE, .srcOperand = false, .destOperand = true},
+    [OP_CMP] = {.opcode = OP_CMP, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_IMMEDIATE | AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_RET] = {.opcode = OP_RET, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+    [OP_IRET] = {.opcode = OP_IRET, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+    [OP_WFI] = {.opcode = OP_WFI, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+    [OP_RST] = {.opcode = OP_RST, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+    [OP_HLT] = {.opcode = OP_HLT, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+    [OP_LDR] = {.opcode = OP_LDR, .srcMode = AM_DIRECT, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_STR] = {.opcode = OP_STR, .srcMode = AM_REGISTER, .destMode = AM_DIRECT, .srcOperand = true, .destOperand = true},
+    [OP_LD8] = {.opcode = OP_LD8, .srcMode = AM_DIRECT | AM_INDIRECT, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_LD16] = {.opcode = OP_LD16, .srcMode = AM_DIRECT | AM_INDIRECT, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_LD32] = {.opcode = OP_LD32, .srcMode = AM_DIRECT | AM_INDIRECT, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_LD64] = {.opcode = OP_LD64, .srcMode = AM_DIRECT | AM_INDIRECT, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
+    [OP_ST8] = {.opcode = OP_ST8, .srcMode = AM_REGISTER, .destMode = AM_DIRECT | AM_INDIRECT, .srcOperand = true, .destOperand = true},
+    [OP_ST16] = {.opcode = OP_ST16, .srcMode = AM_REGISTER, .destMode = AM_DIRECT | AM_INDIRECT, .srcOperand = true, .destOperand = true},
+    [OP_ST32] = {.opcode = OP_ST32, .srcMode = AM_REGISTER, .destMode = AM_DIRECT | AM_INDIRECT, .srcOperand = true, .destOperand = true},
+    [OP_ST64] = {.opcode = OP_ST64, .srcMode = AM_REGISTER, .destMode = AM_DIRECT | AM_INDIRECT, .srcOperand = true, .destOperand = true},
+    [OP_CAS] = {.opcode = OP_CAS, .srcMode = AM_REGISTER, .destMode = AM_DIRECT | AM_INDIRECT, .srcOperand = true, .destOperand = true},
+    [OP_FADD] = {.opcode = OP_FADD, .srcMode = AM_REGISTER, .destMode = AM_DIRECT | AM_INDIRECT, .srcOperand = true, .destOperand = true},
+    [OP_FENCE] = {.opcode = OP_FENCE, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
+
+};
+
+static uint64_t ISA_DecodeOperand(const uint8_t **bytes, uint8_t mode, uint8_t sizeCode)
+{
+    uint64_t operand = 0;
+    if (mode == AM_NONE)
+        return 0;
+    if (mode == AM_REGISTER || mode == AM_INDIRECT)
+        return *(*bytes)++;
+
+    size_t size = (size_t)1 << sizeCode;
+    memcpy(&operand, *bytes, size); // little endian host
+    *bytes += size;
+    return operand;
+}
+
+// Decode the instruction at `bytes`, which must have INSTRUCTION_WIDTH
+// readable bytes, and return its size. Nothing is validated.
+uint8_t ISA_Decode(const uint8_t *bytes, IsaEncoding encoding, Instruction *instruction)
+{
+    if (encoding == ISA_FIXED)
+    {
+        instruction->opcode = bytes[0];
+        instruction->srcMode = bytes[1];
+        instruction->destMode = bytes[2];
+        memcpy(&instruction->srcOperand, bytes + 3, sizeof(uint64_t));
+        memcpy(&instruction->destOperand, bytes + 11, sizeof(uint64_t));
+        return INSTRUCTION_WIDTH;
+    }
+
+    const uint8_t *p = bytes + 2;
+    instruction->opcode = bytes[0];
+    instruction->srcMode = bytes[1] & 0x0F;
+    instruction->destMode = bytes[1] >> 4;
+
+    uint8_t sizes = 0;
+    bool srcValue = instruction->srcMode != AM_NONE && instruction->srcMode != AM_REGISTER && instruction->srcMode != AM_INDIRECT;
+    bool destValue = instruction->destMode != AM_NONE && instruction->destMode != AM_REGISTER && instruction->destMode != AM_INDIRECT;
+    if (srcValue || destValue)
+        sizes = *p++;
+    instruction->srcOperand = ISA_DecodeOperand(&p, instruction->srcMode, sizes & 3);
+    instruction->destOperand = ISA_DecodeOperand(&p, instruction->destMode, sizes >> 2 & 3);
+    return (uint8_t)(p - bytes);
+}
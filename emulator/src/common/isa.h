@@ -2,6 +2,7 @@
 #define ISA_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define OPCODE_WIDTH 1
 #define AM_WIDTH 1
@@ -9,6 +10,25 @@
 
 #define INSTRUCTION_WIDTH (OPCODE_WIDTH + AM_WIDTH + AM_WIDTH + OPERAND_WIDTH + OPERAND_WIDTH)
 
+// Compact encoding, selected per image by ISA_COMPACT_MAGIC at its start:
+//   opcode (1 byte)
+//   srcMode | destMode << 4 (1 byte)
+//   operand sizes (1 byte), only if an operand is neither a register nor
+//     absent: log2 of the source operand's size in bits 0-1, of the
+//     destination's in bits 2-3
+//   source operand, then destination operand: nothing if the mode is
+//     AM_NONE, the register number (1 byte) for AM_REGISTER and
+//     AM_INDIRECT, otherwise a little endian value of 1, 2, 4 or 8 bytes
+// An instruction is at most INSTRUCTION_WIDTH bytes in either encoding.
+#define ISA_COMPACT_MAGIC "TISCCMPT"
+#define ISA_MAGIC_WIDTH 8
+
+typedef enum
+{
+    ISA_FIXED,   // every instruction INSTRUCTION_WIDTH bytes
+    ISA_COMPACT, // variable length, see above
+} IsaEncoding;
+
 typedef enum
 {
     OP_NONE,
@@ -20,15 +40,42 @@ typedef enum
     OP_SUB,
     OP_MUL,
     OP_DIV,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_NOT,
+    OP_LSH, // shifts go by the low 6 bits of the source
+    OP_RSH, // logical
     OP_JMP = 0x0F,
     OP_CMP = 0x10,
     OP_JEQ = 0x11,
     OP_CALL = 200,
 
     OP_RET = 201,
+    OP_IRET = 202,
 
     OP_LDR = 210,
     OP_STR = 211,
+
+    // Atomics on aligned words in RAM, sequentially consistent like fence.
+    // cas compares the word with the source register rN and, if equal,
+    // stores rN+1 into it and sets the zero flag; otherwise it loads the
+    // word into rN and clears the zero flag. fadd adds the source register
+    // to the word and loads what it held before into the register.
+    OP_CAS = 230,
+    OP_FADD = 231,
+    OP_FENCE = 232,
+
+    // Loads zero extend, stores write the low bytes of the register
+    OP_LD8 = 240,
+    OP_LD16 = 241,
+    OP_LD32 = 242,
+    OP_LD64 = 243,
+    OP_ST8 = 244,
+    OP_ST16 = 245,
+    OP_ST32 = 246,
+    OP_ST64 = 247,
+    OP_WFI = 253,
     OP_RST = 254,
     OP_HLT = 255,
 } Opcode;
@@ -39,6 +86,7 @@ typedef enum
     AM_IMMEDIATE = 1,
     AM_REGISTER = 2,
     AM_DIRECT = 4,
+    AM_INDIRECT = 8, // the operand is a register holding the address
 } AddressingMode;
 
 typedef struct {
@@ -49,25 +97,8 @@ typedef struct {
     uint64_t destOperand;
 } Instruction ;
 
-Instruction instructionSet[256] = {
-    [OP_NOP] = {.opcode = OP_NOP, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
-    [OP_MOV] = {.opcode = OP_MOV, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_PUSH] = {.opcode = OP_PUSH, .srcMode = AM_NONE, .destMode = AM_REGISTER, .srcOperand = false, .destOperand = true},
-    [OP_POP] = {.opcode = OP_POP, .srcMode = AM_NONE, .destMode = AM_REGISTER, .srcOperand = false, .destOperand = true},
-    [OP_ADD] = {.opcode = OP_ADD, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_SUB] = {.opcode = OP_SUB, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_MUL] = {.opcode = OP_MUL, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_DIV] = {.opcode = OP_DIV, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_CALL] = {.opcode = OP_CALL, .srcMode = AM_NONE, .destMode = AM_IMMEDIATE, .srcOperand = false, .destOperand = true},
-    [OP_JMP] = {.opcode = OP_JMP, .srcMode = AM_NONE, .destMode = AM_IMMEDIATE, .srcOperand = false, .destOperand = true},
-    [OP_JEQ] = {.opcode = OP_JEQ, .srcMode = AM_NONE, .destMode = AM_IMMEDIATE, .srcOperand = false, .destOperand = true},
-    [OP_CMP] = {.opcode = OP_CMP, .srcMode = AM_IMMEDIATE | AM_REGISTER, .destMode = AM_IMMEDIATE | AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_RET] = {.opcode = OP_RET, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
-    [OP_RST] = {.opcode = OP_RST, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
-    [OP_HLT] = {.opcode = OP_HLT, .srcMode = AM_NONE, .destMode = AM_NONE, .srcOperand = false, .destOperand = false},
-    [OP_LDR] = {.opcode = OP_LDR, .srcMode = AM_DIRECT, .destMode = AM_REGISTER, .srcOperand = true, .destOperand = true},
-    [OP_STR] = {.opcode = OP_STR, .srcMode = AM_REGISTER, .destMode = AM_DIRECT, .srcOperand = true, .destOperand = true},
+extern Instruction instructionSet[256];
 
-};
+uint8_t ISA_Decode(const uint8_t *bytes, IsaEncoding encoding, Instruction *instruction);
 
 #endif // ISA_H
\ No newline at end of file
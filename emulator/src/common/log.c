@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "log.h"
+
+// Asynchronous log writer
+//
+// Producers format their message into a slot of a bounded ring and move
+// on; a background thread drains the ring to stderr. The emulated CPU
+// never waits for the terminal. When the ring is full messages are
+// dropped and counted instead of blocking.
+//
+// The ring is a bounded multi-producer queue: every slot carries a
+// sequence number that tells producers and the consumer whose turn it is.
+// An idle writer sleeps on a condition variable; producers only take the
+// lock to wake it when they publish into the ring it found empty.
+
+#define LOG_RING_SIZE 4096 // slots, must be a power of two
+#define LOG_MESSAGE_SIZE 512 // bytes, room for a full register dump (see CPU_TraceRegisters)
+
+typedef struct
+{
+    atomic_uint_fast64_t sequence;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+uint32_t logCategories = (1u << LOG_CATEGORY_COUNT) - 1;
+
+static const char *categoryNames[LOG_CATEGORY_COUNT] = {
+    [LOG_GENERAL] = "general",
+    [LOG_CPU] = "cpu",
+    [LOG_BUS] = "bus",
+    [LOG_RAM] = "ram",
+    [LOG_DEVICE] = "device",
+};
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic_uint_fast64_t head; // next slot handed to a producer
+static atomic_uint_fast64_t tail; // next slot the writer prints
+static atomic_uint_fast64_t dropped;
+static atomic_bool running;
+static atomic_bool sleeping; // writer found the ring empty and waits for wake
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;    // ring no longer empty, or shutdown
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER; // writer went idle, see LOG_Flush
+static pthread_t writer;
+
+static bool LOG_Drain()
+{
+    bool any = false;
+    for (;;)
+    {
+        uint64_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        LogSlot *slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != pos + 1)
+            break;
+
+        fputs(slot->text, stderr);
+        atomic_store_explicit(&slot->sequence, pos + LOG_RING_SIZE, memory_order_release);
+        atomic_store_explicit(&tail, pos + 1, memory_order_release);
+        any = true;
+    }
+
+    uint64_t lost = atomic_exchange(&dropped, 0);
+    if (lost)
+        fprintf(stderr, "log: %lu messages dropped\n", (unsigned long)lost);
+    return any;
+}
+
+// Whether the writer has something to print
+static bool LOG_Pending()
+{
+    uint64_t pos = atomic_load(&tail);
+    return atomic_load(&ring[pos & (LOG_RING_SIZE - 1)].sequence) == pos + 1 || atomic_load(&dropped);
+}
+
+static void *LOG_Writer(void *arg)
+{
+    while (atomic_load(&running))
+    {
+        if (LOG_Drain())
+            continue;
+        fflush(stderr);
+
+        // Announce the sleep before checking the ring again, so a producer
+        // that published in between either is seen here or sees sleeping
+        pthread_mutex_lock(&lock);
+        atomic_store(&sleeping, true);
+        pthread_cond_broadcast(&drained);
+        while (atomic_load(&running) && !LOG_Pending())
+            pthread_cond_wait(&wake, &lock);
+        atomic_store(&sleeping, false);
+        pthread_mutex_unlock(&lock);
+    }
+    LOG_Drain();
+    fflush(stderr);
+    return NULL;
+}
+
+// Enable the categories in a comma separated list such as "cpu,bus".
+// "all" enables everything, an empty list disables everything.
+void LOG_SetCategories(const char *list)
+{
+    uint32_t mask = 0;
+    char buf[256];
+    strncpy(buf, list, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (char *name = strtok(buf, ","); name; name = strtok(NULL, ","))
+    {
+        if (strcmp(name, "all") == 0)
+        {
+            mask = (1u << LOG_CATEGORY_COUNT) - 1;
+            continue;
+        }
+        bool found = false;
+        for (int i = 0; i < LOG_CATEGORY_COUNT; i++)
+        {
+            if (strcmp(name, categoryNames[i]) == 0)
+            {
+                mask |= 1u << i;
+                found = true;
+            }
+        }
+        if (!found)
+            fprintf(stderr, "log: unknown category '%s'\n", name);
+    }
+    logCategories = mask;
+}
+
+void LOG_Write(LogCategory category, int level, const char *file, int line, const char *func, const char *format, ...)
+{
+    va_list args;
+
+    if (!atomic_load_explicit(&running, memory_order_relaxed))
+    {
+        // No writer thread (yet), print synchronously
+        fprintf(stderr, "%s:%d:%s(): ", file, line, func);
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+
+    uint64_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;)
+    {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (sequence < pos)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    int used = snprintf(slot->text, LOG_MESSAGE_SIZE, "%s:%d:%s(): ", file, line, func);
+    if (used < 0 || used >= LOG_MESSAGE_SIZE)
+        used = 0;
+    va_start(args, format);
+    vsnprintf(slot->text + used, LOG_MESSAGE_SIZE - used, format, args);
+    va_end(args);
+
+    atomic_store(&slot->sequence, pos + 1);
+    if (atomic_load(&sleeping))
+    {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+// Wait until everything logged so far has been written
+void LOG_Flush()
+{
+    if (!atomic_load(&running))
+        return;
+    pthread_mutex_lock(&lock);
+    while (atomic_load(&running) && atomic_load(&tail) != atomic_load(&head))
+        pthread_cond_wait(&drained, &lock);
+    pthread_mutex_unlock(&lock);
+    fflush(stderr);
+}
+
+void LOG_Shutdown()
+{
+    if (!atomic_exchange(&running, false))
+        return;
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&wake);
+    pthread_cond_broadcast(&drained);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+}
+
+void LOG_Init()
+{
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&ring[i].sequence, i);
+    atomic_init(&head, 0);
+    atomic_init(&tail, 0);
+    atomic_init(&dropped, 0);
+    atomic_init(&sleeping, false);
+
+    const char *categories = getenv("TISC_LOG");
+    if (categories)
+        LOG_SetCategories(categories);
+
+    atomic_store(&running, true);
+    if (pthread_create(&writer, NULL, LOG_Writer, NULL) != 0)
+    {
+        atomic_store(&running, false);
+        perror("pthread_create");
+        return;
+    }
+    atexit(LOG_Shutdown);
+}
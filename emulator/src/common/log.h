@@ -0,0 +1,45 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Log levels. Everything above LOG_LEVEL is compiled out.
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// Log categories, filtered at runtime
+typedef enum
+{
+    LOG_GENERAL,
+    LOG_CPU,
+    LOG_BUS,
+    LOG_RAM,
+    LOG_DEVICE,
+    LOG_CATEGORY_COUNT
+} LogCategory;
+
+extern uint32_t logCategories; // bitmask of enabled categories
+
+static inline bool LOG_Enabled(LogCategory category)
+{
+    return (logCategories >> category) & 1;
+}
+
+void LOG_Init();
+void LOG_SetCategories(const char *list);
+void LOG_Flush();
+void LOG_Shutdown();
+void LOG_Write(LogCategory category, int level, const char *file, int line, const char *func, const char *format, ...)
+    __attribute__((format(printf, 6, 7)));
+
+#endif // LOG_H
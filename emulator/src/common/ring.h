@@ -0,0 +1,98 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Lock-free single-producer/single-consumer byte ring
+//
+// Used to pass bytes between the CPU thread and the host I/O thread. Each
+// index is only ever written by one side: the producer owns head, the
+// consumer owns tail. Neither side blocks or makes a syscall.
+//
+// A consumer that sleeps while the ring is empty is woken by the producer
+// when RING_PushFirst reports the ring was empty. RING_PushFirst, and
+// the consumer's RING_Consume and RING_Empty, are
+// sequentially consistent so that one of the two always sees the other:
+// either the consumer's last RING_Empty sees the new byte, or the
+// producer sees that everything before it was consumed.
+
+#define RING_SIZE 4096 // bytes, must be a power of two
+
+typedef struct
+{
+    uint8_t data[RING_SIZE];
+    atomic_size_t head; // next byte written by the producer
+    atomic_size_t tail; // next byte read by the consumer
+} Ring;
+
+static inline void RING_Init(Ring *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+static inline bool RING_Empty(Ring *ring)
+{
+    return atomic_load(&ring->head) == atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+// Returns false and drops the byte if the ring is full
+static inline bool RING_Push(Ring *ring, uint8_t byte)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE)
+        return false;
+    ring->data[head & (RING_SIZE - 1)] = byte;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// RING_Push that also tells whether the ring was empty before, so that
+// the consumer may be waiting for this byte
+static inline bool RING_PushFirst(Ring *ring, uint8_t byte, bool *first)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE)
+    {
+        *first = false;
+        return false;
+    }
+    ring->data[head & (RING_SIZE - 1)] = byte;
+    atomic_store(&ring->head, head + 1);
+    *first = atomic_load(&ring->tail) == head;
+    return true;
+}
+
+// Returns false if the ring is empty
+static inline bool RING_Pop(Ring *ring, uint8_t *byte)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+        return false;
+    *byte = ring->data[tail & (RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Copy up to size bytes out of the ring without consuming them; used by
+// the I/O thread, which only commits what write() accepted
+static inline size_t RING_Peek(Ring *ring, uint8_t *buf, size_t size)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t count = atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+    if (count > size)
+        count = size;
+    for (size_t i = 0; i < count; i++)
+        buf[i] = ring->data[(tail + i) & (RING_SIZE - 1)];
+    return count;
+}
+
+static inline void RING_Consume(Ring *ring, size_t count)
+{
+    atomic_fetch_add(&ring->tail, count);
+}
+
+#endif // RING_H
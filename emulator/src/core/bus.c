@@ -1,106 +1,661 @@
+#define LOG_CATEGORY LOG_BUS
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 
 #include "../core/bus.h"
+#include "../core/cpu.h"
+#include "../core/gdb.h"
+#include "../core/interrupts.h"
+#include "../core/machine.h"
+#include "../core/smp.h"
 #include "../memory/rom.h"
 #include "../memory/ram.h"
 #include "../common/common.h"
 #include "../devices/console.h"
+#include "../devices/dma.h"
 #include "../devices/fileout.h"
+#include "../devices/pit.h"
+#include "../devices/pty.h"
+#include "../devices/video.h"
 
-extern uint8_t itr; // The CPUs interrupt register
+// The guest address space is split into 4 KB pages, looked up through a
+// two-level page table. Pages of RAM and ROM point straight at host
+// memory, so ordinary loads and stores are an indexed load plus a memcpy.
+// Everything else goes through the slow paths: MMIO to the device
+// callbacks, and writes to memory pages that trap them (e.g. because they
+// hold cached code) to a store of just the bytes written followed by code
+// invalidation. Pages with a
+// debugger's watchpoint on them trap reads and writes, and the slow paths
+// report accesses to them, see gdb.c.
+//
+// The CPUs of a machine share its bus. Second level tables are published
+// atomically and the write pointer of a page, which CPUs clear when they
+// cache code from it, is an atomic, so lookups don't lock; device
+// callbacks of MMIO run under the machine's lock, see smp.c.
+#define BUS_L2_BITS 10
+#define BUS_L1_BITS 14 // 36 bit guest address space
+#define BUS_MAX_DEVICES 32
 
-typedef enum
+typedef struct
 {
-    DEVICE_RAM,
-    DEVICE_ROM,
-    DEVICE_MMIO,
-    DEVICE_CONSOLE,
-    DEVICE_FILEOUT,
-    DEVICE_UNKNOWN // For error handling
-} DeviceType;
+    const char *name;
+    uint64_t start;
+    uint64_t end; // inclusive
+    BusReadFn read;
+    BusWriteFn write;
+    void *opaque;
+    uint8_t *host; // backing memory, NULL for MMIO
+    bool writable;
+    BusWrittenFn written; // told about writes that trap, see BUS_MapHost
+#ifdef PROFILE
+    uint64_t accesses;
+#endif
+} BusDevice;
 
+typedef struct
+{
+    uint8_t *read;     // host address of the page for direct reads, or NULL
+    uint8_t *_Atomic write; // host address of the page for direct writes, or NULL
+    BusDevice *device; // the device covering the page, NULL if unmapped or shared
+    bool shared;       // several devices live on this page, search them
+    bool readOnly;     // guest writes fault, see BUS_Protect
+    uint16_t watches;  // watchpoints on the page, see BUS_Watch
+} BusPage;
+
+// Per machine memory map, reached through machine->bus
+struct Bus
+{
+    BusDevice devices[BUS_MAX_DEVICES];
+    int deviceCount;
+    BusPage *_Atomic pageTable[1 << BUS_L1_BITS];
+    bool protection; // some page is write protected, see BUS_Protect
+};
 
 static bool is_in_range(uint64_t address, uint64_t start, uint64_t end)
 {
     return address >= start && address <= end;
 }
 
-uint64_t BUS_Map(uint64_t address)
+// Work out which devices cover the page at address and, if a single
+// host-backed device covers all of it, point the page at its memory
+static void BUS_FillPage(BusPage *page, uint64_t address)
 {
-    if (is_in_range(address, RAM_START, RAM_END))
+    Bus *bus = machine->bus;
+    *page = (BusPage){0};
+    for (int i = 0; i < bus->deviceCount; i++)
     {
-        return DEVICE_RAM;
+        BusDevice *device = &bus->devices[i];
+        if (device->end < address || device->start > address + BUS_PAGE_SIZE - 1)
+            continue;
+        if (page->device || page->shared)
+        {
+            page->device = NULL;
+            page->shared = true;
+        }
+        else
+        {
+            page->device = device;
+        }
     }
-    else if (is_in_range(address, ROM_START, ROM_END))
+
+    BusDevice *device = page->device;
+    if (device && device->host && device->start <= address && address + BUS_PAGE_SIZE - 1 <= device->end)
     {
-        return DEVICE_ROM;
+        page->read = device->host + (address - device->start);
+        page->write = device->writable && !device->written ? page->read : NULL;
     }
-    else if (is_in_range(address, FILEOUT_START, FILEOUT_END))
+}
+
+static bool BUS_Covered(uint64_t start, uint64_t end)
+{
+    Bus *bus = machine->bus;
+    for (int i = 0; i < bus->deviceCount; i++)
     {
-        return DEVICE_FILEOUT;
+        if (bus->devices[i].start <= end && start <= bus->devices[i].end)
+            return true;
     }
-    else if (is_in_range(address, CONSOLE_START, CONSOLE_END))
+    return false;
+}
+
+// Second level tables are only built when an address in their range is
+// first looked up with `create`, and only if a device lives there, so a
+// large RAM region costs page table memory as the guest touches it
+static BusPage *BUS_Page(uint64_t address, bool create)
+{
+    Bus *bus = machine->bus;
+    uint64_t index = address >> (BUS_PAGE_SHIFT + BUS_L2_BITS);
+    if (index >= (1 << BUS_L1_BITS))
+        return NULL;
+
+    BusPage *level2 = atomic_load_explicit(&bus->pageTable[index], memory_order_acquire);
+    if (!level2)
     {
-        return DEVICE_CONSOLE;
+        uint64_t first = index << (BUS_PAGE_SHIFT + BUS_L2_BITS);
+        if (!create || !BUS_Covered(first, first + (BUS_PAGE_SIZE << BUS_L2_BITS) - 1))
+            return NULL;
+
+        SMP_Lock(); // another CPU may be building the same table
+        level2 = atomic_load_explicit(&bus->pageTable[index], memory_order_acquire);
+        if (!level2)
+        {
+            level2 = calloc(1 << BUS_L2_BITS, sizeof(BusPage));
+            if (!level2)
+            {
+                print_error("Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < (1 << BUS_L2_BITS); i++)
+                BUS_FillPage(&level2[i], first + i * BUS_PAGE_SIZE);
+            atomic_store_explicit(&bus->pageTable[index], level2, memory_order_release);
+        }
+        SMP_Unlock();
     }
-    else
+    return &level2[(address >> BUS_PAGE_SHIFT) & ((1 << BUS_L2_BITS) - 1)];
+}
+
+// Refill the pages of [start, end] that already have table entries
+static void BUS_Refill(uint64_t start, uint64_t end)
+{
+    for (uint64_t address = start & ~(BUS_PAGE_SIZE - 1); address <= end; address += BUS_PAGE_SIZE)
     {
-        return DEVICE_UNKNOWN;
+        BusPage *page = BUS_Page(address, false);
+        if (page)
+            BUS_FillPage(page, address);
+        else
+            address |= (BUS_PAGE_SIZE << BUS_L2_BITS) - BUS_PAGE_SIZE; // skip the whole table
     }
 }
 
-uint64_t BUS_Read(uint64_t address)
+static BusDevice *BUS_FindDevice(uint64_t address)
 {
-    uint64_t device = BUS_Map(address);
-    switch (device)
+    Bus *bus = machine->bus;
+    BusPage *page = BUS_Page(address, true);
+    if (!page)
+        return NULL;
+    if (!page->shared)
+        return page->device && is_in_range(address, page->device->start, page->device->end) ? page->device : NULL;
+
+    for (int i = 0; i < bus->deviceCount; i++)
     {
-    case DEVICE_RAM:
-        return RAM_Read(address - RAM_START);
-        break;
-    case DEVICE_ROM:
-        return ROM_Read(address - ROM_START);
-        break;
-    case DEVICE_FILEOUT:
-        return FO_Read((address - FILEOUT_START));
-        break;
-    case DEVICE_CONSOLE:
-        return CON_Read((address - CONSOLE_START));
-        break;
-    default:
-        print_error("Unsupported address: 0x%lx\n", address);
+        if (is_in_range(address, bus->devices[i].start, bus->devices[i].end))
+            return &bus->devices[i];
+    }
+    return NULL;
+}
+
+void BUS_RegisterDevice(const char *name, uint64_t start, uint64_t end, BusReadFn read_fn, BusWriteFn write_fn, void *opaque)
+{
+    Bus *bus = machine->bus;
+    if (bus->deviceCount == BUS_MAX_DEVICES)
+    {
+        print_error("Too many bus devices\n");
+        exit(EXIT_FAILURE);
+    }
+    if (end >> (BUS_PAGE_SHIFT + BUS_L2_BITS + BUS_L1_BITS))
+    {
+        print_error("Device range 0x%lx-0x%lx outside the address space\n", start, end);
         exit(EXIT_FAILURE);
     }
+
+    BusDevice *device = &bus->devices[bus->deviceCount++];
+    *device = (BusDevice){.name = name, .start = start, .end = end, .read = read_fn, .write = write_fn, .opaque = opaque};
+    BUS_Refill(start, end);
+    print_debug("registered %s at 0x%lx-0x%lx\n", name, start, end);
 }
 
-uint64_t BUS_Write(uint64_t address, uint64_t data)
+// Back a registered device with host memory. Pages completely inside the
+// range are read (and, if writable, written) directly. With `written`, the
+// device's pages start out trapping writes, and it hears about those
+// writes; see BUS_AllowWrites.
+void BUS_MapHost(uint64_t start, uint64_t end, uint8_t *host, bool writable, BusWrittenFn written)
 {
-    uint64_t device = BUS_Map(address);
-    switch (device)
+    BusDevice *device = BUS_FindDevice(start);
+    if (!device || device->start != start || device->end != end)
     {
-    case DEVICE_RAM:
-        return RAM_Write(address - RAM_START, data);
-        break;
-    case DEVICE_ROM:
+        print_error("No device registered at 0x%lx-0x%lx\n", start, end);
         exit(EXIT_FAILURE);
+    }
+    device->host = host;
+    device->writable = writable;
+    device->written = written;
+    BUS_Refill(start, end);
+}
+
+// Host memory behind [address, address + size), for devices that copy
+// guest buffers in bulk. NULL if the range isn't inside a single
+// host-backed device.
+uint8_t *BUS_HostRange(uint64_t address, uint64_t size)
+{
+    BusDevice *device = BUS_FindDevice(address);
+    if (!device || !device->host || size == 0 || size - 1 > device->end - address)
+        return NULL;
+    return device->host + (address - device->start);
+}
+
+// Like BUS_HostRange, for devices that write guest memory in bulk: NULL
+// unless the device is writable without wanting to hear about writes and
+// no page of the range is write protected. Writes through it bypass the
+// bus, so the caller has to invalidate cached code itself, see
+// CPU_InvalidateCode.
+uint8_t *BUS_HostWritableRange(uint64_t address, uint64_t size)
+{
+    Bus *bus = machine->bus;
+    BusDevice *device = BUS_FindDevice(address);
+    if (!device || !device->host || !device->writable || device->written || size == 0 ||
+        size - 1 > device->end - address)
+        return NULL;
+
+    if (bus->protection)
+    {
+        for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+        {
+            BusPage *entry = BUS_Page(page << BUS_PAGE_SHIFT, false);
+            if (entry && entry->readOnly)
+                return NULL;
+        }
+    }
+    return device->host + (address - device->start);
+}
+
+// Route writes to the pages covering [address, address + size) through the
+// device's write callback from now on
+void BUS_TrapWrites(uint64_t address, uint64_t size)
+{
+    for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+    {
+        BusPage *entry = BUS_Page(page << BUS_PAGE_SHIFT, true);
+        if (entry)
+            atomic_store_explicit(&entry->write, NULL, memory_order_relaxed);
+    }
+}
+
+// Undo BUS_TrapWrites for the pages covering [address, address + size),
+// for devices mapped with a written callback that only want to hear about
+// the first write to a page, see video.c. Pages that are write protected
+// or watched keep trapping.
+void BUS_AllowWrites(uint64_t address, uint64_t size)
+{
+    for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+    {
+        BusPage *entry = BUS_Page(page << BUS_PAGE_SHIFT, false);
+        if (entry && entry->read && !entry->readOnly && entry->device && entry->device->written)
+            atomic_store_explicit(&entry->write, entry->read, memory_order_relaxed);
+    }
+}
+
+// Make guest writes to the pages covering [address, address + size)
+// fault, for image segments that aren't writable
+void BUS_Protect(uint64_t address, uint64_t size)
+{
+    for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+    {
+        BusPage *entry = BUS_Page(page << BUS_PAGE_SHIFT, true);
+        if (entry)
+        {
+            entry->write = NULL;
+            entry->readOnly = true;
+            machine->bus->protection = true;
+        }
+    }
+}
+
+// Send reads and writes of the pages covering [address, address + size)
+// through the slow paths, which tell the debugger about them
+void BUS_Watch(uint64_t address, uint64_t size)
+{
+    for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+    {
+        BusPage *entry = BUS_Page(page << BUS_PAGE_SHIFT, true);
+        if (entry)
+        {
+            entry->watches++;
+            entry->read = NULL;
+            atomic_store_explicit(&entry->write, NULL, memory_order_relaxed);
+        }
+    }
+}
+
+// Undo BUS_Watch. Reads of pages without watchpoints go straight to host
+// memory again; writes keep trapping, as they would for a page that held
+// code.
+void BUS_Unwatch(uint64_t address, uint64_t size)
+{
+    for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+    {
+        BusPage *entry = BUS_Page(page << BUS_PAGE_SHIFT, false);
+        if (entry && entry->watches && --entry->watches == 0)
+        {
+            BusPage fresh;
+            BUS_FillPage(&fresh, page << BUS_PAGE_SHIFT);
+            entry->read = fresh.read;
+        }
+    }
+}
+
+static bool BUS_Watched(uint64_t address, unsigned size)
+{
+    BusPage *first = BUS_Page(address, false);
+    BusPage *last = BUS_Page(address + size - 1, false);
+    return (first && first->watches) || (last && last->watches);
+}
+
+// Low `size` bytes of data
+static uint64_t BUS_Truncate(uint64_t data, unsigned size)
+{
+    return size == sizeof(uint64_t) ? data : data & (((uint64_t)1 << (8 * size)) - 1);
+}
+
+// Instruction fetches don't trip watchpoints
+static uint64_t BUS_ReadSlow(uint64_t address, unsigned size, bool fetch)
+{
+    if (machine->gdb && !fetch && BUS_Watched(address, size))
+        GDB_Access(address, size, false);
+
+    BusDevice *device = BUS_FindDevice(address);
+    if (device && device->host && address + size - 1 > device->end)
+        device = NULL; // would run off the end of the backing memory
+#ifdef PROFILE
+    if (device)
+        device->accesses++;
+#endif
+
+    // Memory is read straight from the host even if the device has a read
+    // callback, so narrow reads at the very end of it work too
+    if (device && device->host)
+    {
+        uint64_t data = 0;
+        memcpy(&data, device->host + (address - device->start), size);
+        return data;
+    }
+    if (device && device->read)
+    {
+        SMP_Lock();
+        uint64_t data = device->read(device->opaque, address - device->start);
+        SMP_Unlock();
+        return BUS_Truncate(data, size);
+    }
+
+    print_error("Unsupported address: 0x%lx\n", address);
+    MACHINE_Abort();
+}
+
+// Aligned stores are single accesses, so they don't tear
+static void BUS_StoreHost(uint8_t *host, uint64_t data, unsigned size, bool aligned)
+{
+    if (!aligned)
+    {
+        memcpy(host, &data, size); // little endian host
+        return;
+    }
+    switch (size)
+    {
+    case sizeof(uint8_t):
+        __atomic_store_n(host, (uint8_t)data, __ATOMIC_RELAXED);
         break;
-    case DEVICE_FILEOUT:
-        FO_Write((address - FILEOUT_START), data);
+    case sizeof(uint16_t):
+        __atomic_store_n((uint16_t *)host, (uint16_t)data, __ATOMIC_RELAXED);
         break;
-    case DEVICE_CONSOLE:
-        CON_Write((address - CONSOLE_START), data);
+    case sizeof(uint32_t):
+        __atomic_store_n((uint32_t *)host, (uint32_t)data, __ATOMIC_RELAXED);
         break;
     default:
-        print_error("Unsupported address: 0x%lx\n", address);
-        exit(EXIT_FAILURE);
+        __atomic_store_n((uint64_t *)host, data, __ATOMIC_RELAXED);
+        break;
     }
+}
+
+static void BUS_WriteSlow(uint64_t address, uint64_t data, unsigned size)
+{
+    BusPage *first = BUS_Page(address, false);
+    BusPage *last = BUS_Page(address + size - 1, false);
+    if ((first && first->readOnly) || (last && last->readOnly))
+    {
+        print_error("Write to read-only address: 0x%lx\n", address);
+        MACHINE_Abort();
+    }
+    if ((first && first->watches) || (last && last->watches))
+        GDB_Access(address, size, true);
+
+    BusDevice *device = BUS_FindDevice(address);
+    if (device && device->host && address + size - 1 > device->end)
+        device = NULL; // would run off the end of the backing memory
+#ifdef PROFILE
+    if (device)
+        device->accesses++;
+#endif
+
+    if (device && device->host && device->writable)
+    {
+        // Store the bytes written and nothing around them, which another
+        // CPU may be updating at the same time, e.g. with an atomic
+        BUS_StoreHost(device->host + (address - device->start), data, size, address % size == 0);
+        CPU_InvalidateCode(address, size);
+        if (device->written)
+            device->written(device->opaque, address - device->start, size);
+        return;
+    }
+    if (device && device->write)
+    {
+        SMP_Lock();
+        device->write(device->opaque, address - device->start, BUS_Truncate(data, size));
+        SMP_Unlock();
+        return;
+    }
+
+    print_error("Unsupported address: 0x%lx\n", address);
+    MACHINE_Abort();
+}
+
+// Accesses of `size` bytes go straight to host memory unless they cross
+// into the next page, which an aligned access never does. The data is
+// zero extended.
+static inline uint64_t BUS_ReadSized(uint64_t address, unsigned size, bool fetch)
+{
+    BusPage *page = BUS_Page(address, false);
+    uint64_t offset = address & (BUS_PAGE_SIZE - 1);
+
+    if (page && page->read && offset <= BUS_PAGE_SIZE - size)
+    {
+#ifdef PROFILE
+        if (page->device)
+            page->device->accesses++;
+#endif
+        uint64_t data = 0;
+        memcpy(&data, page->read + offset, size);
+        return data;
+    }
+    return BUS_ReadSlow(address, size, fetch);
+}
+
+static inline void BUS_WriteSized(uint64_t address, uint64_t data, unsigned size)
+{
+    BusPage *page = BUS_Page(address, false);
+    uint64_t offset = address & (BUS_PAGE_SIZE - 1);
+    uint8_t *write = page ? atomic_load_explicit(&page->write, memory_order_relaxed) : NULL;
+
+    if (write && offset <= BUS_PAGE_SIZE - size)
+    {
+#ifdef PROFILE
+        if (page->device)
+            page->device->accesses++;
+#endif
+        memcpy(write + offset, &data, size);
+        return;
+    }
+    BUS_WriteSlow(address, data, size);
+}
+
+uint64_t BUS_Read(uint64_t address)
+{
+    return BUS_ReadSized(address, sizeof(uint64_t), false);
+}
+
+// BUS_Read for instruction fetches
+uint64_t BUS_Fetch(uint64_t address)
+{
+    return BUS_ReadSized(address, sizeof(uint64_t), true);
+}
+
+uint64_t BUS_Read8(uint64_t address)
+{
+    return BUS_ReadSized(address, sizeof(uint8_t), false);
+}
+
+uint64_t BUS_Read16(uint64_t address)
+{
+    return BUS_ReadSized(address, sizeof(uint16_t), false);
+}
+
+uint64_t BUS_Read32(uint64_t address)
+{
+    return BUS_ReadSized(address, sizeof(uint32_t), false);
+}
+
+uint64_t BUS_Write(uint64_t address, uint64_t data)
+{
+    BUS_WriteSized(address, data, sizeof(uint64_t));
+    return data;
+}
+
+// The narrow writes store the low bytes of data
+uint64_t BUS_Write8(uint64_t address, uint64_t data)
+{
+    BUS_WriteSized(address, data, sizeof(uint8_t));
+    return data;
+}
+
+uint64_t BUS_Write16(uint64_t address, uint64_t data)
+{
+    BUS_WriteSized(address, data, sizeof(uint16_t));
+    return data;
+}
+
+uint64_t BUS_Write32(uint64_t address, uint64_t data)
+{
+    BUS_WriteSized(address, data, sizeof(uint32_t));
     return data;
 }
 
+// Host word behind an atomic access. Sets *code if the page may hold
+// cached code, so the caller has to invalidate it after writing.
+static uint64_t *BUS_AtomicWord(uint64_t address, bool *code)
+{
+    if (address % sizeof(uint64_t))
+    {
+        print_error("Misaligned atomic access: 0x%lx\n", address);
+        MACHINE_Abort();
+    }
+
+    BusPage *page = BUS_Page(address, true);
+    BusDevice *device = BUS_FindDevice(address);
+    if (!device || !device->host || !device->writable || device->written)
+    {
+        print_error("Atomic access outside RAM: 0x%lx\n", address);
+        MACHINE_Abort();
+    }
+    if (page->readOnly)
+    {
+        print_error("Write to read-only address: 0x%lx\n", address);
+        MACHINE_Abort();
+    }
+    if (page->watches)
+        GDB_Access(address, sizeof(uint64_t), true);
+#ifdef PROFILE
+    device->accesses++;
+#endif
+    *code = atomic_load_explicit(&page->write, memory_order_relaxed) == NULL;
+    return (uint64_t *)(device->host + (address - device->start));
+}
+
+// Compare and swap the aligned word at address, which has to be in RAM:
+// if it holds *expected it becomes desired, otherwise *expected gets what
+// it holds. Sequentially consistent, as is BUS_FetchAdd.
+bool BUS_CompareExchange(uint64_t address, uint64_t *expected, uint64_t desired)
+{
+    bool code;
+    uint64_t *word = BUS_AtomicWord(address, &code);
+    bool swapped = __atomic_compare_exchange_n(word, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (swapped && code)
+        CPU_InvalidateCode(address, sizeof(uint64_t));
+    return swapped;
+}
+
+// Add value to the aligned word at address, which has to be in RAM, and
+// return what it held before
+uint64_t BUS_FetchAdd(uint64_t address, uint64_t value)
+{
+    bool code;
+    uint64_t *word = BUS_AtomicWord(address, &code);
+    uint64_t previous = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+    if (code)
+        CPU_InvalidateCode(address, sizeof(uint64_t));
+    return previous;
+}
+
+#ifdef PROFILE
+// Accesses per device, for the profile report
+void BUS_WriteProfile(FILE *out)
+{
+    Bus *bus = machine->bus;
+    for (int i = 0; i < bus->deviceCount; i++)
+    {
+        BusDevice *device = &bus->devices[i];
+        fprintf(out, "%14lu  %-10s 0x%08lx-0x%08lx\n", device->accesses, device->name, device->start, device->end);
+    }
+}
+#endif
+
+// Safe to call from any thread
 uint64_t BUS_SendInterrupt(uint8_t interrupt)
 {
-    itr = interrupt;
+    INT_Raise(interrupt);
     return 0;
 }
+
+Bus *BUS_Create()
+{
+    Bus *bus = calloc(1, sizeof(Bus));
+    if (!bus)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return bus;
+}
+
+void BUS_Destroy(Bus *bus)
+{
+    for (int i = 0; i < (1 << BUS_L1_BITS); i++)
+        free(bus->pageTable[i]);
+    free(bus);
+}
+
+// Build the system memory map of the current machine
+void BUS_Init()
+{
+    uint64_t low = RAM_LowSize();
+    BUS_RegisterDevice("ram", RAM_START, RAM_START + low - 1, &RAM_Read, NULL, machine->ram);
+    BUS_MapHost(RAM_START, RAM_START + low - 1, machine->ram, true, NULL);
+    if (machine->ramSize > low)
+    {
+        uint64_t end = HIGH_RAM_START + (machine->ramSize - low) - 1;
+        BUS_RegisterDevice("highram", HIGH_RAM_START, end, &RAM_Read, NULL, machine->ram + low);
+        BUS_MapHost(HIGH_RAM_START, end, machine->ram + low, true, NULL);
+    }
+
+    BUS_RegisterDevice("rom", ROM_START, ROM_END, &ROM_Read, NULL, machine->rom);
+    BUS_MapHost(ROM_START, ROM_END, machine->rom, false, NULL);
+
+    BUS_RegisterDevice("fileout", FILEOUT_START, FILEOUT_END, &FO_Read, &FO_Write, machine->fileout);
+    BUS_RegisterDevice("pty", PTY_START, PTY_END, &PTY_Read, &PTY_Write, machine->pty);
+    BUS_RegisterDevice("console", CONSOLE_START, CONSOLE_END, &CON_Read, &CON_Write, machine->console);
+    BUS_RegisterDevice("pit", PIT_START, PIT_END, &PIT_Read, &PIT_Write, machine->pit);
+    BUS_RegisterDevice("intc", INTC_START, INTC_END, &INT_Read, &INT_Write, NULL); // banked per CPU
+    BUS_RegisterDevice("dma", DMA_START, DMA_END, &DMA_Read, &DMA_Write, machine->dma);
+    if (machine->video)
+        VID_Init(); // maps the registers and the framebuffer
+}
@@ -2,6 +2,8 @@
 #define BUS_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 // Memory Layout
 
@@ -12,6 +14,12 @@
 
 #define RAM_START 0x00000000
 #define RAM_END 0x00FFFFFF // 16 MB RAM
+#define RAM_LOW_SIZE (RAM_END - RAM_START + 1)
+
+// RAM beyond the first RAM_LOW_SIZE bytes continues here, up to the end
+// of the 36 bit address space
+#define HIGH_RAM_START 0x100000000
+#define HIGH_RAM_END 0xFFFFFFFFF
 
 #define ROM_START 0x01000000
 #define ROM_END 0x010FFFFF // 1 MB ROM
@@ -27,15 +35,99 @@
 #define FILEOUT_START 0x01100000
 #define FILEOUT_CONTROL_REGISTER FILEOUT_START
 #define FILEOUT_DATA_REGISTER (FILEOUT_CONTROL_REGISTER + 8)
-#define FILEOUT_END FILEOUT_DATA_REGISTER
+#define FILEOUT_DMA_ADDRESS_REGISTER (FILEOUT_CONTROL_REGISTER + 16)
+#define FILEOUT_DMA_LENGTH_REGISTER (FILEOUT_CONTROL_REGISTER + 24)
+#define FILEOUT_END FILEOUT_DMA_LENGTH_REGISTER
 
-#define PTY_START 0x01100010
+#define PTY_START 0x01100100
 #define PTY_END (PTY_START + 256)
 
+#define PIT_START 0x01100300
+#define PIT_CONTROL_REGISTER PIT_START
+#define PIT_PERIOD_REGISTER (PIT_CONTROL_REGISTER + 8)
+#define PIT_EXPIRED_REGISTER (PIT_CONTROL_REGISTER + 16)
+#define PIT_END PIT_EXPIRED_REGISTER
+
+#define INTC_START 0x01100400
+#define INTC_PENDING_REGISTER INTC_START
+#define INTC_CLEAR_REGISTER (INTC_START + 8)
+#define INTC_MASK_REGISTER (INTC_START + 16)
+#define INTC_VECTOR_BASE_REGISTER (INTC_START + 24)
+#define INTC_LEVEL_REGISTER (INTC_START + 32)
+#define INTC_IPI_REGISTER (INTC_START + 40)
+#define INTC_CPU_REGISTER (INTC_START + 48)
+#define INTC_CPU_COUNT_REGISTER (INTC_START + 56)
+#define INTC_PRIORITY_REGISTERS (INTC_START + 64) // one per line
+#define INTC_END (INTC_PRIORITY_REGISTERS + 8 * 64 - 1)
+
+#define DMA_START 0x01100700
+#define DMA_SOURCE_REGISTER DMA_START
+#define DMA_DESTINATION_REGISTER (DMA_START + 8)
+#define DMA_LENGTH_REGISTER (DMA_START + 16)
+#define DMA_FILL_REGISTER (DMA_START + 24)
+#define DMA_CONTROL_REGISTER (DMA_START + 32)
+#define DMA_END DMA_CONTROL_REGISTER
+
+#define VIDEO_START 0x01100800
+#define VIDEO_CONTROL_REGISTER VIDEO_START
+#define VIDEO_WIDTH_REGISTER (VIDEO_START + 8)
+#define VIDEO_HEIGHT_REGISTER (VIDEO_START + 16)
+#define VIDEO_FORMAT_REGISTER (VIDEO_START + 24)
+#define VIDEO_STRIDE_REGISTER (VIDEO_START + 32)
+#define VIDEO_ADDRESS_REGISTER (VIDEO_START + 40)
+#define VIDEO_FRAMES_REGISTER (VIDEO_START + 48)
+#define VIDEO_END VIDEO_FRAMES_REGISTER
+
+#define FRAMEBUFFER_START 0x02000000
+#define FRAMEBUFFER_END 0x02FFFFFF // 16 MB at most, as much as the resolution needs is mapped
+#define FRAMEBUFFER_MAX_SIZE (FRAMEBUFFER_END - FRAMEBUFFER_START + 1)
+
+// Granularity of the bus's page table: host memory is read and written
+// directly, or trapped, a page at a time
+#define BUS_PAGE_SHIFT 12
+#define BUS_PAGE_SIZE ((uint64_t)1 << BUS_PAGE_SHIFT)
+
+
+// Device callbacks get the offset of the access from the start of the
+// device's range and the opaque pointer it was registered with
+typedef uint64_t (*BusReadFn)(void *opaque, uint64_t offset);
+typedef void (*BusWriteFn)(void *opaque, uint64_t offset, uint64_t data);
+
+// Memory backed by the host is written by the bus itself. A device that
+// wants to hear about it passes this to BUS_MapHost: it gets the offset
+// and size of each write to a page that traps writes, after the fact.
+typedef void (*BusWrittenFn)(void *opaque, uint64_t offset, uint64_t size);
+
+typedef struct Bus Bus;
+
+Bus *BUS_Create();
+void BUS_Destroy(Bus *bus);
+void BUS_Init();
+void BUS_RegisterDevice(const char *name, uint64_t start, uint64_t end, BusReadFn read_fn, BusWriteFn write_fn, void *opaque);
+void BUS_MapHost(uint64_t start, uint64_t end, uint8_t *host, bool writable, BusWrittenFn written);
+void BUS_TrapWrites(uint64_t address, uint64_t size);
+void BUS_AllowWrites(uint64_t address, uint64_t size);
+void BUS_Protect(uint64_t address, uint64_t size);
+void BUS_Watch(uint64_t address, uint64_t size);
+void BUS_Unwatch(uint64_t address, uint64_t size);
+uint8_t *BUS_HostRange(uint64_t address, uint64_t size);
+uint8_t *BUS_HostWritableRange(uint64_t address, uint64_t size);
 
 uint64_t BUS_Read(uint64_t address);
-uint64_t BUS_Write(uint64_t buf, uint64_t address);
+uint64_t BUS_Fetch(uint64_t address);
+uint64_t BUS_Write(uint64_t address, uint64_t data);
+uint64_t BUS_Read8(uint64_t address);
+uint64_t BUS_Read16(uint64_t address);
+uint64_t BUS_Read32(uint64_t address);
+uint64_t BUS_Write8(uint64_t address, uint64_t data);
+uint64_t BUS_Write16(uint64_t address, uint64_t data);
+uint64_t BUS_Write32(uint64_t address, uint64_t data);
+bool BUS_CompareExchange(uint64_t address, uint64_t *expected, uint64_t desired);
+uint64_t BUS_FetchAdd(uint64_t address, uint64_t value);
 uint64_t BUS_SendInterrupt(uint8_t interrupt);
+#ifdef PROFILE
+void BUS_WriteProfile(FILE *out);
+#endif
 
 
 
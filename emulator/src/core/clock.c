@@ -1,36 +1,163 @@
 #define _XOPEN_SOURCE 700
 #include <time.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
-
+#include "../common/common.h"
 #include "clock.h"
+#include "machine.h"
+
+#define CL_MAX_LAG_NS 100000000L // give up catching up when further behind than this
+
+// Per machine wall clock reference, reached through machine->clock. Only
+// machines that run in real time have one.
+struct Clock
+{
+    uint64_t frequency; // cycles per second
+    struct timespec start_time;
+    uint64_t start_cycles;
+    bool started;
+
+    // An idle machine sleeps on wake, which interrupts signal
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool woken; // an interrupt was raised since the last CL_Idle
+};
+
+// Throttle the machine to `frequency` cycles per second
+Clock *CL_Create(uint64_t frequency)
+{
+    Clock *clock = calloc(1, sizeof(Clock));
+    if (!clock)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    clock->frequency = frequency;
 
-//static uint8_t pit = 0; // Programmable interval timer
-static struct timespec last_tick_time;
-bool enabled = true;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&clock->lock, NULL);
+    pthread_cond_init(&clock->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    return clock;
+}
 
-void CL_Tick() {
+void CL_Destroy(Clock *clock)
+{
+    pthread_cond_destroy(&clock->wake);
+    pthread_mutex_destroy(&clock->lock);
+    free(clock);
+}
 
-    if (BENCHMARK == true) return;
+static uint64_t CL_Elapsed(const Clock *clock, const struct timespec *current_time)
+{
+    return (current_time->tv_sec - clock->start_time.tv_sec) * 1000000000L + (current_time->tv_nsec - clock->start_time.tv_nsec);
+}
+
+// Wall time `cycles` take, and the other way round. Exact for any
+// frequency up to a few GHz, without overflowing.
+static uint64_t CL_Nanoseconds(const Clock *clock, uint64_t cycles)
+{
+    return cycles / clock->frequency * 1000000000L + cycles % clock->frequency * 1000000000L / clock->frequency;
+}
+
+static uint64_t CL_Cycles(const Clock *clock, uint64_t ns)
+{
+    return ns / 1000000000L * clock->frequency + ns % 1000000000L * clock->frequency / 1000000000L;
+}
+
+// Sleep until the wall clock has caught up with `cycles` retired cycles at
+// the machine's frequency. Called once per scheduler quantum rather than
+// per cycle.
+void CL_Sync(uint64_t cycles) {
+
+    Clock *clock = machine->clock;
+    if (!clock) return;
 
     struct timespec current_time, sleep_time;
     clock_gettime(CLOCK_MONOTONIC, &current_time);
 
-    // Calculate the delta time since the last tick in nanoseconds
-    uint64_t delta_ns = (current_time.tv_sec - last_tick_time.tv_sec) * 1000000000L + (current_time.tv_nsec - last_tick_time.tv_nsec);
+    if (!clock->started)
+    {
+        clock->start_time = current_time;
+        clock->start_cycles = cycles;
+        clock->started = true;
+        return;
+    }
 
-    // Period of one cycle in nanoseconds
-    uint64_t period_ns = 1000000000L / CLOCK_FREQUENCY;
+    uint64_t target_ns = CL_Nanoseconds(clock, cycles - clock->start_cycles);
+    uint64_t elapsed_ns = CL_Elapsed(clock, &current_time);
 
     // Calculate the sleep time required to maintain the desired clock frequency
-    if (delta_ns < period_ns) {
-        sleep_time.tv_sec = (period_ns - delta_ns) / 1000000000L;
-        sleep_time.tv_nsec = (period_ns - delta_ns) % 1000000000L;
+    if (elapsed_ns < target_ns) {
+        sleep_time.tv_sec = (target_ns - elapsed_ns) / 1000000000L;
+        sleep_time.tv_nsec = (target_ns - elapsed_ns) % 1000000000L;
 
         nanosleep(&sleep_time, NULL);
     }
+    else if (elapsed_ns - target_ns > CL_MAX_LAG_NS)
+    {
+        // The host can't keep up, don't try to make up for it later
+        clock->start_time = current_time;
+        clock->start_cycles = cycles;
+    }
+}
+
+// The CPU has nothing to do until `end`, the next deadline. Sleep until
+// the wall clock gets there or an interrupt wakes us, and return the
+// cycles that passed. Machines that don't run in real time skip straight
+// to the deadline.
+uint64_t CL_Idle(uint64_t now, uint64_t end)
+{
+    Clock *clock = machine->clock;
+    if (!clock)
+        return end - now;
+
+    struct timespec current_time;
+    clock_gettime(CLOCK_MONOTONIC, &current_time);
+    if (!clock->started)
+    {
+        clock->start_time = current_time;
+        clock->start_cycles = now;
+        clock->started = true;
+    }
+
+    uint64_t target_ns = CL_Nanoseconds(clock, end - clock->start_cycles);
+    struct timespec deadline = clock->start_time;
+    deadline.tv_sec += target_ns / 1000000000L;
+    deadline.tv_nsec += target_ns % 1000000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&clock->lock);
+    while (!clock->woken && pthread_cond_timedwait(&clock->wake, &clock->lock, &deadline) == 0)
+        ;
+    clock->woken = false;
+    pthread_mutex_unlock(&clock->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &current_time);
+    uint64_t reached = clock->start_cycles + CL_Cycles(clock, CL_Elapsed(clock, &current_time));
+    if (reached <= now)
+        return 0;
+    return reached < end ? reached - now : end - now;
+}
+
+// Safe to call from any thread
+void CL_Wake()
+{
+    Clock *clock = machine->clock;
+    if (!clock)
+        return;
 
-    // Update the last tick time to the current time
-    clock_gettime(CLOCK_MONOTONIC, &last_tick_time);
-}
\ No newline at end of file
+    pthread_mutex_lock(&clock->lock);
+    clock->woken = true;
+    pthread_cond_signal(&clock->wake);
+    pthread_mutex_unlock(&clock->lock);
+}
@@ -1,10 +1,16 @@
 #ifndef CLOCK_H
 #define CLOCK_H
 
-void CL_Tick();
+#include <stdint.h>
 
-#define CLOCK_FREQUENCY 1000000 // 1 MHz clock speed (example)
-//#define CLOCK_FREQUENCY 1 // Clock frequency in Hz
-#define BENCHMARK false
+typedef struct Clock Clock;
 
-#endif // CLOCK_H
\ No newline at end of file
+Clock *CL_Create(uint64_t frequency);
+void CL_Destroy(Clock *clock);
+void CL_Sync(uint64_t cycles);
+uint64_t CL_Idle(uint64_t now, uint64_t end);
+void CL_Wake();
+
+#define CLOCK_FREQUENCY 1000000 // default clock speed in Hz, see MachineConfig
+
+#endif // CLOCK_H
@@ -1,43 +1,118 @@
+#define LOG_CATEGORY LOG_CPU
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include "../common/common.h"
 #include "../common/isa.h"
 #include "cpu.h"
+#include "machine.h"
 #include "bus.h"
+#include "gdb.h"
+#include "interrupts.h"
+#include "smp.h"
 #include "../memory/ram.h"
+#ifdef CPU_JIT
+#include "jit.h"
+#endif
 
 // Global variables
 typedef uint64_t (*InstructionHandler)(Instruction instruction);
-static InstructionHandler instructionHandlers[256]; //
-
-static uint64_t registers[64];        // General Purpose Registers
-//static uint64_t wor[8];               // write-once registers
-static uint8_t ir[INSTRUCTION_WIDTH]; // Instruction Register - hold the current instruction
-static uint64_t pc = 0;               // program counter
-static uint64_t sp = 0;               // stack pointer - stack starts at end of 8MB memory minus 1MB, stack grows down -- mapped to r65
-static uint64_t ra = 0;               // return address register, also known as link register
-uint8_t itr = 0;                      // interrupt register
-static uint64_t fp = 0;               // frame pointer
 
 //  Status register
-static struct flags
+struct flags
 {
     uint8_t reserved : 4; // unused
     uint8_t overflow : 1; // overflow flag
     uint8_t carry : 1;    // Carry flag
     uint8_t sign : 1;     // sign flag
     uint8_t zero : 1;     // zero flag
-} sr = {.zero = 0, .sign = 0, .carry = 0, .overflow = 0};
-
-Instruction instruction;
+};
+
+// Decoded instruction cache
+//
+// Every instruction is fetched, decoded and validated once and kept here
+// together with its handler, keyed by the address it was fetched from.
+// Entries are direct mapped on the low bits of the PC; consecutive
+// instructions are between 2 and INSTRUCTION_WIDTH bytes apart, so they
+// never collide until the cache wraps around.
+#define DECODE_CACHE_SIZE 4096     // number of entries, must be a power of two
+#define CODE_PAGE_SHIFT 8          // granularity of the code page map (256 bytes)
+#define CPU_MAX_FUSED 3            // longest fused group of instructions (threaded core)
+#define CPU_REGISTER_DUMP_SIZE 448 // bytes, fits the register dump with every value at its widest
+
+typedef struct
+{
+    uint64_t pc; // address the instruction was fetched from
+    Instruction instruction;
+    InstructionHandler handler;
+    bool valid;
+    uint8_t size; // bytes of the instruction
+    uint8_t span; // bytes the entry covers, more than size if fused
+#ifdef PROFILE
+    uint64_t count; // executions not yet added to the profile
+#endif
+#ifdef CPU_THREADED
+    const void *label; // operand-mode specialized handler inside CPU_Run
+    uint64_t *src;     // source register, resolved at decode time
+    uint64_t *dest;    // destination register, resolved at decode time
+#endif
+} DecodedInstruction;
+
+// Per CPU state, reached through CPU_Self()
+struct Cpu
+{
+    uint64_t registers[64];        // General Purpose Registers
+    //uint64_t wor[8];               // write-once registers
+    uint8_t ir[INSTRUCTION_WIDTH]; // Instruction Register - hold the current instruction
+    uint64_t pc;                   // program counter
+    uint64_t sp;                   // stack pointer - stack starts at end of 8MB memory minus 1MB, stack grows down -- mapped to r65
+    uint64_t ra;                   // return address register, also known as link register
+    _Atomic uint8_t itr;           // interrupt register, set when the controller may have a line to deliver
+    uint64_t fp;                   // frame pointer
+    struct flags sr;               // status register
+
+    IsaEncoding encoding; // of the loaded image, kept across rst
+    uint64_t entry;       // of the loaded image, where rst starts over
+    Instruction instruction;
+    uint8_t size; // bytes of the instruction in ir
+
+    DecodedInstruction decodeCache[DECODE_CACHE_SIZE];
+    DecodedInstruction *current; // entry that is currently executing
+
+    _Atomic bool exitRequested;  // stop CPU_Run after the current instruction
+    _Atomic bool flushRequested; // another CPU wrote code, drop the decode cache
+    bool waiting;                // executed wfi, nothing runs until an interrupt is taken
+    bool halted;                 // a secondary CPU executed hlt, it never runs again
+    bool trapped;                // stopped at a breakpoint in this CPU_Run, see brk
+    bool itrHeld;                // itr was set when it did
+    _Atomic uint64_t retired;    // instructions, only written by the CPU's own thread
+    uint64_t executed;           // retired so far by the running CPU_Run, see CPU_Unwind
+
+    // One byte per page of low RAM, set if any cached instruction was fetched
+    // from it. Lets writes to pure data pages skip the invalidation walk.
+    // Pages past the map (high RAM) always count as code. Other CPUs read
+    // it, so it is accessed with relaxed atomics.
+    uint8_t codePages[RAM_LOW_SIZE >> CODE_PAGE_SHIFT];
+
+#ifdef CPU_THREADED
+    uint64_t zeroRegister; // what r0 reads resolve to
+    uint64_t sinkRegister; // what r0 writes resolve to
+#endif
+};
 
 // extern uint8_t filebuf[1024];
 
+// The CPU the calling thread runs
+static inline Cpu *CPU_Self()
+{
+    return machine->cpus[cpuId];
+}
+
 // local functions signatures
 static uint64_t nop(Instruction instruction);
 static uint64_t mov(Instruction instruction);
@@ -47,13 +122,76 @@ static uint64_t add(Instruction instruction);
 static uint64_t sub(Instruction instruction);
 static uint64_t mul(Instruction instruction);
 static uint64_t _div(Instruction instruction);
+static uint64_t and_(Instruction instruction);
+static uint64_t or_(Instruction instruction);
+static uint64_t xor_(Instruction instruction);
+static uint64_t not_(Instruction instruction);
+static uint64_t lsh(Instruction instruction);
+static uint64_t rsh(Instruction instruction);
 static uint64_t jmp(Instruction instruction);
 static uint64_t cmp(Instruction instruction);
 static uint64_t jeq(Instruction instruction);
 static uint64_t call(Instruction instruction);
 static uint64_t ret(Instruction instruction);
+static uint64_t iret(Instruction instruction);
+static uint64_t ldr(Instruction instruction);
+static uint64_t str(Instruction instruction);
+static uint64_t ld8(Instruction instruction);
+static uint64_t ld16(Instruction instruction);
+static uint64_t ld32(Instruction instruction);
+static uint64_t ld64(Instruction instruction);
+static uint64_t st8(Instruction instruction);
+static uint64_t st16(Instruction instruction);
+static uint64_t st32(Instruction instruction);
+static uint64_t st64(Instruction instruction);
+static uint64_t cas(Instruction instruction);
+static uint64_t fadd(Instruction instruction);
+static uint64_t fence(Instruction instruction);
+static uint64_t wfi(Instruction instruction);
 static uint64_t rst(Instruction instruction);
 static uint64_t hlt(Instruction instruction);
+static uint64_t brk(Instruction instruction);
+
+// Shared by every machine, it never changes
+static const InstructionHandler instructionHandlers[256] = {
+    [OP_NOP] = &nop,
+    [OP_MOV] = &mov,
+    [OP_PUSH] = &push,
+    [OP_POP] = &pop,
+    [OP_ADD] = &add,
+    [OP_SUB] = &sub,
+    [OP_MUL] = &mul,
+    [OP_DIV] = &_div,
+    [OP_AND] = &and_,
+    [OP_OR] = &or_,
+    [OP_XOR] = &xor_,
+    [OP_NOT] = &not_,
+    [OP_LSH] = &lsh,
+    [OP_RSH] = &rsh,
+    [OP_CMP] = &cmp,
+    [OP_JMP] = &jmp,
+    [OP_JEQ] = &jeq,
+    [OP_CALL] = &call,
+    [OP_RET] = &ret,
+    [OP_IRET] = &iret,
+    [OP_WFI] = &wfi,
+    [OP_RST] = &rst,
+
+    [OP_HLT] = &hlt,
+    [OP_LDR] = &ldr,
+    [OP_STR] = &str,
+    [OP_LD8] = &ld8,
+    [OP_LD16] = &ld16,
+    [OP_LD32] = &ld32,
+    [OP_LD64] = &ld64,
+    [OP_ST8] = &st8,
+    [OP_ST16] = &st16,
+    [OP_ST32] = &st32,
+    [OP_ST64] = &st64,
+    [OP_CAS] = &cas,
+    [OP_FADD] = &fadd,
+    [OP_FENCE] = &fence,
+};
 
 static void CPU_Reset();
 static void CPU_Halt();
@@ -64,20 +202,23 @@ static void CPU_ValidateInstruction();
 
 void CPU_PushStack(uint64_t value)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
-    BUS_Write(sp, value);
-    sp -= 8;
+    BUS_Write(cpu->sp, value);
+    cpu->sp -= 8;
 }
 
 uint64_t CPU_PopStack()
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
-    sp += 8;
-    return BUS_Read(sp);
+    cpu->sp += 8;
+    return BUS_Read(cpu->sp);
 }
 
 uint64_t CPU_GetValue(uint8_t addressing_mode, uint64_t operand)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("addressing_mode: %u | operand: %lu\n", addressing_mode, operand);
 
     switch (addressing_mode)
@@ -90,16 +231,16 @@ uint64_t CPU_GetValue(uint8_t addressing_mode, uint64_t operand)
         if (operand == 0)
             return 0; // r0 is always 0
         if (operand == 65)
-            return sp;
+            return cpu->sp;
         if (operand > 65)
             print_error("Invalid Register\n");
         else
-            print_debug("return operand: %lu\n", registers[operand]);
-        return registers[operand];
+            print_debug("return operand: %lu\n", cpu->registers[operand]);
+        return cpu->registers[operand];
         break;
     default:
         print_error("Invalid Addressing mode for Operand\n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
         break;
     }
     return 0;
@@ -107,27 +248,28 @@ uint64_t CPU_GetValue(uint8_t addressing_mode, uint64_t operand)
 
 uint64_t CPU_SetValue(uint8_t addressing_mode, uint64_t operand, uint64_t value)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("addressing_mode: %u | operand: %lu | value: %lu\n", addressing_mode, operand, value);
 
     switch (addressing_mode)
     {
     case AM_IMMEDIATE:
         print_error("Invalid Addressing mode for Operand\n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
         break;
     case AM_REGISTER:
         if (operand == 0)
             break; // r0 is always 0 and can not be set to something else -- this can be used to discard items from the stack
         if (operand == 65)
-            sp = value;
+            cpu->sp = value;
         if (operand > 65)
             print_error("Invalid Register\n");
         else
-            registers[operand] = value;
+            cpu->registers[operand] = value;
         break;
     default:
         print_error("Invalid Addressing mode for Operand\n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
         break;
     }
 
@@ -213,56 +355,153 @@ static uint64_t _div(Instruction instruction)
     return value;
 }
 
+static uint64_t and_(Instruction instruction)
+{
+    print_debug("\n");
+
+    uint64_t v1 = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    uint64_t v2 = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    uint64_t value = v2 & v1;
+
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t or_(Instruction instruction)
+{
+    print_debug("\n");
+
+    uint64_t v1 = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    uint64_t v2 = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    uint64_t value = v2 | v1;
+
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t xor_(Instruction instruction)
+{
+    print_debug("\n");
+
+    uint64_t v1 = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    uint64_t v2 = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    uint64_t value = v2 ^ v1;
+
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t not_(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = ~CPU_GetValue(instruction.destMode, instruction.destOperand);
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t lsh(Instruction instruction)
+{
+    print_debug("\n");
+
+    uint64_t v1 = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    uint64_t v2 = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    uint64_t value = v2 << (v1 & 63);
+
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t rsh(Instruction instruction)
+{
+    print_debug("\n");
+
+    uint64_t v1 = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    uint64_t v2 = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    uint64_t value = v2 >> (v1 & 63);
+
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
 static uint64_t jmp(Instruction instruction)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
-    pc = CPU_GetValue(instruction.destMode, instruction.destOperand);
-    return pc;
+    cpu->pc = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    return cpu->pc;
 }
 
 static uint64_t cmp(Instruction instruction)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
-    sr.zero = 0;
+    cpu->sr.zero = 0;
     uint64_t v1 = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
     uint64_t v2 = CPU_GetValue(instruction.destMode, instruction.destOperand);
     if (v1 == v2)
-        sr.zero = 1;
-    return sr.zero;
+        cpu->sr.zero = 1;
+    return cpu->sr.zero;
 }
 
 static uint64_t jeq(Instruction instruction)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
-    if (sr.zero == true)
+    if (cpu->sr.zero == true)
     {
-        pc = CPU_GetValue(instruction.destMode, instruction.destOperand);
+        cpu->pc = CPU_GetValue(instruction.destMode, instruction.destOperand);
     }
-    return pc;
+    return cpu->pc;
 }
 
 static uint64_t call(Instruction instruction)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
 
-    ra = pc;
-    CPU_PushStack(ra); // Push Return Address to Stack
+    cpu->ra = cpu->pc;
+    CPU_PushStack(cpu->ra); // Push Return Address to Stack
 
-    pc = CPU_GetValue(instruction.destMode, instruction.destOperand);
+    cpu->pc = CPU_GetValue(instruction.destMode, instruction.destOperand);
+#ifdef PROFILE
+    PROF_Call(machine->profile, cpu->pc);
+#endif
 
-    return pc;
+    return cpu->pc;
 }
 
 static uint64_t ret(Instruction instruction)
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
 
-    ra = CPU_PopStack(); // Pop Return Address from Stack
+    cpu->ra = CPU_PopStack(); // Pop Return Address from Stack
 
-    pc = ra;
-    ra = 0;
+    cpu->pc = cpu->ra;
+    cpu->ra = 0;
+#ifdef PROFILE
+    PROF_Return(machine->profile);
+#endif
 
-    return pc;
+    return cpu->pc;
+}
+
+// Return from an interrupt handler, see CPU_CheckInterrupts
+static uint64_t iret(Instruction instruction)
+{
+    Cpu *cpu = CPU_Self();
+    print_debug("\n");
+
+    uint64_t sr = CPU_PopStack();
+    cpu->pc = CPU_PopStack();
+    uint8_t flags = sr & 0xFF;
+    memcpy(&cpu->sr, &flags, sizeof(cpu->sr));
+#ifdef PROFILE
+    PROF_Return(machine->profile);
+#endif
+    INT_Return(sr >> 8);
+
+    return cpu->pc;
 }
 
 static uint64_t ldr(Instruction instruction)
@@ -281,6 +520,130 @@ static uint64_t str(Instruction instruction)
     return value;
 }
 
+// The address of a memory operand: the operand itself, or for AM_INDIRECT
+// the register it names
+static uint64_t CPU_Address(uint8_t addressing_mode, uint64_t operand)
+{
+    if (addressing_mode == AM_INDIRECT)
+        return CPU_GetValue(AM_REGISTER, operand);
+    return operand;
+}
+
+static uint64_t ld8(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = BUS_Read8(CPU_Address(instruction.srcMode, instruction.srcOperand));
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t ld16(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = BUS_Read16(CPU_Address(instruction.srcMode, instruction.srcOperand));
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t ld32(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = BUS_Read32(CPU_Address(instruction.srcMode, instruction.srcOperand));
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t ld64(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = BUS_Read(CPU_Address(instruction.srcMode, instruction.srcOperand));
+    CPU_SetValue(instruction.destMode, instruction.destOperand, value);
+    return value;
+}
+
+static uint64_t st8(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    BUS_Write8(CPU_Address(instruction.destMode, instruction.destOperand), value);
+    return value;
+}
+
+static uint64_t st16(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    BUS_Write16(CPU_Address(instruction.destMode, instruction.destOperand), value);
+    return value;
+}
+
+static uint64_t st32(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    BUS_Write32(CPU_Address(instruction.destMode, instruction.destOperand), value);
+    return value;
+}
+
+static uint64_t st64(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t value = CPU_GetValue(instruction.srcMode, instruction.srcOperand);
+    BUS_Write(CPU_Address(instruction.destMode, instruction.destOperand), value);
+    return value;
+}
+
+// Atomics, see OP_CAS. Plain loads and stores aren't ordered between CPUs
+// beyond what the host does; these are sequentially consistent.
+static uint64_t cas(Instruction instruction)
+{
+    Cpu *cpu = CPU_Self();
+    print_debug("\n");
+    uint64_t reg = instruction.srcOperand;
+    if (reg >= 63)
+    {
+        print_error("cas needs a register pair, r%lu has no successor\n", reg);
+        MACHINE_Abort();
+    }
+
+    uint64_t expected = CPU_GetValue(AM_REGISTER, reg);
+    uint64_t address = CPU_Address(instruction.destMode, instruction.destOperand);
+    bool swapped = BUS_CompareExchange(address, &expected, CPU_GetValue(AM_REGISTER, reg + 1));
+    cpu->sr.zero = swapped;
+    if (!swapped)
+        CPU_SetValue(AM_REGISTER, reg, expected);
+    return swapped;
+}
+
+static uint64_t fadd(Instruction instruction)
+{
+    print_debug("\n");
+    uint64_t address = CPU_Address(instruction.destMode, instruction.destOperand);
+    uint64_t previous = BUS_FetchAdd(address, CPU_GetValue(AM_REGISTER, instruction.srcOperand));
+    CPU_SetValue(AM_REGISTER, instruction.srcOperand, previous);
+    return previous;
+}
+
+static uint64_t fence(Instruction instruction)
+{
+    print_debug("\n");
+    atomic_thread_fence(memory_order_seq_cst);
+    return 0;
+}
+
+// Stop until an interrupt is raised, see CPU_Waiting
+static uint64_t wfi(Instruction instruction)
+{
+    Cpu *cpu = CPU_Self();
+    print_debug("\n");
+    if (cpu->itr == 0)
+    {
+        cpu->waiting = true;
+        CPU_RequestExit();
+    }
+    return 0;
+}
+
 static uint64_t rst(Instruction instruction)
 {
     print_debug("\n");
@@ -295,123 +658,341 @@ static uint64_t hlt(Instruction instruction)
     return 0;
 }
 
+// Stands in for the handler of an instruction the debugger has a
+// breakpoint on, see CPU_FillDecodeCache: stop in front of it instead of
+// running it. Interrupts wait until CPU_Run has returned, so the stop is
+// reported where the breakpoint is.
+static uint64_t brk(Instruction instruction)
+{
+    Cpu *cpu = CPU_Self();
+    print_debug("breakpoint at %lu\n", cpu->current->pc);
+    cpu->pc = cpu->current->pc;
+    cpu->trapped = true;
+    cpu->itrHeld = atomic_exchange(&cpu->itr, 0) != 0;
+    GDB_Breakpoint();
+    CPU_RequestExit();
+    return 0;
+}
+
 void CPU_FetchInstruction()
 {
+    Cpu *cpu = CPU_Self();
     //memcpy(ir, &ram[INSTRUCTION_WIDTH * pc], INSTRUCTION_WIDTH);
 
 
     uint64_t buf[3];
-    buf[0] = BUS_Read(pc);
-    buf[1] = BUS_Read(pc+8);
-    buf[2] = BUS_Read(pc+16);
+    buf[0] = BUS_Fetch(cpu->pc);
+    buf[1] = BUS_Fetch(cpu->pc+8);
+    buf[2] = BUS_Fetch(cpu->pc+16);
 
-    // Convert buf to ir
-    ir[0] = buf[0] & 0xFF; // Least significant byte of buf[0]
-    ir[1] = (buf[0] >> 8) & 0xFF; // Second byte
-    ir[2] = (buf[0] >> 16) & 0xFF; // Third byte
-    *(ir + 3) = (buf[0] >> 24) | (buf[1] << 40);
-    *(ir + 11) = (buf[1] >> 24) | (buf[2] << 40);
+    // The three little endian words hold the instruction bytes in order
+    memcpy(cpu->ir, buf, INSTRUCTION_WIDTH);
 
 
-    print_debug("%u %u %u %lu %lu\n", ir[0], ir[1], ir[2], *(uint64_t *)(ir + 3), *(uint64_t *)(ir + 11));
+    print_debug("%u %u %u %lu %lu\n", cpu->ir[0], cpu->ir[1], cpu->ir[2], *(uint64_t *)(cpu->ir + 3), *(uint64_t *)(cpu->ir + 11));
 }
 
 static void CPU_ValidateInstruction()
 {
-    print_debug("%u %u %u %lu %lu\n", instruction.opcode, instruction.srcMode, instruction.destMode, instruction.srcOperand, instruction.destOperand);
+    Cpu *cpu = CPU_Self();
+    print_debug("%u %u %u %lu %lu\n", cpu->instruction.opcode, cpu->instruction.srcMode, cpu->instruction.destMode, cpu->instruction.srcOperand, cpu->instruction.destOperand);
 
-    if (instruction.opcode == 0)
+    if (cpu->instruction.opcode == 0)
     {
         print_debug("Instruction with 0 opcode \n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
 
-    if (instructionSet[instruction.opcode].opcode != instruction.opcode)
+    if (instructionSet[cpu->instruction.opcode].opcode != cpu->instruction.opcode)
     {
         print_debug("Instruction not found in InstructionSet \n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
 
-    if ((instructionSet[instruction.opcode].srcMode & instruction.srcMode) != instruction.srcMode)
+    if ((instructionSet[cpu->instruction.opcode].srcMode & cpu->instruction.srcMode) != cpu->instruction.srcMode)
     {
         print_debug("Illegal Source mode \n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
 
-    if ((instructionSet[instruction.opcode].destMode & instruction.destMode) != instruction.destMode)
+    if ((instructionSet[cpu->instruction.opcode].destMode & cpu->instruction.destMode) != cpu->instruction.destMode)
     {
         print_debug("Illegal Destination mode \n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
 
     // Check source operand requirement
-    if (instructionSet[instruction.opcode].srcOperand && instruction.srcOperand < 0)
+    if (instructionSet[cpu->instruction.opcode].srcOperand && cpu->instruction.srcOperand < 0)
     {
         print_debug("Source operand required but missing\n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
 
     // Check destination operand requirement
-    if (instructionSet[instruction.opcode].destOperand && instruction.destOperand < 0)
+    if (instructionSet[cpu->instruction.opcode].destOperand && cpu->instruction.destOperand < 0)
     {
         print_debug("Destination operand required but missing\n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
     return;
 }
 
 void CPU_DecodeInstruction()
 {
-    instruction.opcode = ir[0];
-    instruction.srcMode = ir[1];
-    instruction.destMode = ir[2];
-    instruction.srcOperand = *(uint64_t *)(ir + 3);
-    instruction.destOperand = *(uint64_t *)(ir + 11);
-    print_debug("%u %u %u %lu %lu\n", instruction.opcode, instruction.srcMode, instruction.destMode, instruction.srcOperand, instruction.destOperand);
+    Cpu *cpu = CPU_Self();
+    cpu->size = ISA_Decode(cpu->ir, cpu->encoding, &cpu->instruction);
+    print_debug("%u %u %u %lu %lu\n", cpu->instruction.opcode, cpu->instruction.srcMode, cpu->instruction.destMode, cpu->instruction.srcOperand, cpu->instruction.destOperand);
 }
 
 uint64_t CPU_ExecuteInstruction()
 {
-    pc = pc + INSTRUCTION_WIDTH;
-    uint8_t index = instruction.opcode;
+    Cpu *cpu = CPU_Self();
+    cpu->pc = cpu->pc + cpu->size;
+    uint8_t index = cpu->instruction.opcode;
 
-    print_debug("%u %u %u %lu %lu\n", instruction.opcode, instruction.srcMode, instruction.destMode, instruction.srcOperand, instruction.destOperand);
+    print_debug("%u %u %u %lu %lu\n", cpu->instruction.opcode, cpu->instruction.srcMode, cpu->instruction.destMode, cpu->instruction.srcOperand, cpu->instruction.destOperand);
 
     InstructionHandler handler = instructionHandlers[index];
     if (handler)
     {
-        return handler(instruction);
+        return handler(cpu->instruction);
     }
     else
     {
         print_error("Unhandled instruction\n");
-        exit(EXIT_FAILURE);
+        MACHINE_Abort();
     }
 }
 
-void CPU_PrintRegisters()
+static void CPU_MarkCodePages(uint64_t address, uint64_t size)
 {
-    printf("PC: %lu | SP: %lu | FP: %lu | RA: %lu | R[0-10]: %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu\n",
-           pc, sp, fp, ra,
-           registers[0], registers[1], registers[2], registers[3], registers[4],
-           registers[5], registers[6], registers[7], registers[8], registers[9], registers[10]);
+    Cpu *cpu = CPU_Self();
+    for (uint64_t page = address >> CODE_PAGE_SHIFT; page <= (address + size - 1) >> CODE_PAGE_SHIFT; page++)
+    {
+        if (page < sizeof(cpu->codePages))
+            __atomic_store_n(&cpu->codePages[page], 1, __ATOMIC_RELAXED);
+    }
+
+    // Writes to code have to take the bus's slow path so they invalidate the cache
+    BUS_TrapWrites(address, size);
+}
+
+// Fetch, decode and validate the instruction at pc into a cache entry
+static void CPU_FillDecodeCache(DecodedInstruction *entry)
+{
+    Cpu *cpu = CPU_Self();
+    CPU_FetchInstruction();
+    CPU_DecodeInstruction();
+    CPU_ValidateInstruction();
+
+    InstructionHandler handler = instructionHandlers[cpu->instruction.opcode];
+    if (!handler)
+    {
+        print_error("Unhandled instruction\n");
+        MACHINE_Abort();
+    }
+
+#ifdef PROFILE
+    if (entry->count)
+        PROF_Count(machine->profile, entry->pc, entry->instruction.opcode, entry->count);
+    entry->count = 0;
+#endif
+    entry->pc = cpu->pc;
+    entry->instruction = cpu->instruction;
+    // Breakpoints cost nothing until they are reached: the entry gets a
+    // handler that stops instead, and setting or clearing one invalidates
+    // the entries covering it
+    entry->handler = machine->gdb && GDB_IsBreakpoint(cpu->pc) ? &brk : handler;
+    entry->valid = true;
+    entry->size = cpu->size;
+    entry->span = cpu->size;
+
+    CPU_MarkCodePages(cpu->pc, cpu->size);
+}
+
+// Make CPU_Run return after the instruction that is executing, used by
+// devices that need servicing before the guest continues
+void CPU_RequestExit()
+{
+    CPU_Kick(cpuId);
+}
+
+// CPU_RequestExit for any CPU of the machine, from any thread. If the CPU
+// isn't in CPU_Run, its next one returns after the first instruction.
+void CPU_Kick(int cpu)
+{
+    atomic_store(&machine->cpus[cpu]->exitRequested, true);
+#ifdef CPU_JIT
+    JIT_RequestExit(); // the JIT core only runs machines with one CPU
+#endif
+}
+
+// Whether cpu may have cached instructions in [address, address + size)
+static bool CPU_HoldsCode(Cpu *cpu, uint64_t address, uint64_t size)
+{
+    for (uint64_t page = address >> CODE_PAGE_SHIFT; page <= (address + size - 1) >> CODE_PAGE_SHIFT; page++)
+    {
+        if (page >= sizeof(cpu->codePages) || __atomic_load_n(&cpu->codePages[page], __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+static void CPU_FlushDecodeCache(Cpu *cpu)
+{
+    for (int i = 0; i < DECODE_CACHE_SIZE; i++)
+        cpu->decodeCache[i].valid = false;
+}
+
+// Drop every cached instruction that overlaps [address, address + size).
+// Other CPUs holding code there drop their whole decode cache before they
+// run on, at the latest when they leave CPU_Run after their current
+// instruction.
+void CPU_InvalidateCode(uint64_t address, uint64_t size)
+{
+    Cpu *cpu = CPU_Self();
+#ifdef CPU_JIT
+    if (JIT_Invalidate(address, size))
+        CPU_RequestExit();
+#endif
+
+    for (int i = 0; i < machine->cpuCount; i++)
+    {
+        if (i != cpuId && CPU_HoldsCode(machine->cpus[i], address, size))
+        {
+            atomic_store(&machine->cpus[i]->flushRequested, true);
+            CPU_Kick(i);
+        }
+    }
+    if (!CPU_HoldsCode(cpu, address, size))
+        return;
 
-    // printf("SR: %u | IR: %u %u %u %lu %lu", sr, ir[0], ir[1], ir[2], *(uint64_t *)(ir + 3), *(uint64_t *)(ir + 11));
-    printf("SR: ");
-    printf("%u", sr.reserved);
-    printf("%u", sr.overflow);
-    printf("%u", sr.carry);
-    printf("%u", sr.sign);
-    printf("%u", sr.zero);
+    // A fused entry also covers the instructions that follow it
+    uint64_t reach = CPU_MAX_FUSED * INSTRUCTION_WIDTH - 1;
+    uint64_t first = address >= reach ? address - reach : 0;
+    if (address + size - first > DECODE_CACHE_SIZE)
+    {
+        // Bulk writes: every cache slot is in range, check each entry once
+        for (int i = 0; i < DECODE_CACHE_SIZE; i++)
+        {
+            DecodedInstruction *entry = &cpu->decodeCache[i];
+            if (entry->valid && entry->pc < address + size && entry->pc + entry->span > address)
+                entry->valid = false;
+        }
+        return;
+    }
+    for (uint64_t start = first; start < address + size; start++)
+    {
+        DecodedInstruction *entry = &cpu->decodeCache[start & (DECODE_CACHE_SIZE - 1)];
+        if (entry->valid && entry->pc == start && start + entry->span > address)
+        {
+            print_debug("invalidating cached instruction at %lu\n", start);
+            entry->valid = false;
+        }
+    }
+}
+
+#ifdef PROFILE
+// Hand the execution counts still held by the decode cache to the profile
+void CPU_FlushProfile()
+{
+    Cpu *cpu = CPU_Self();
+    for (int i = 0; i < DECODE_CACHE_SIZE; i++)
+    {
+        DecodedInstruction *entry = &cpu->decodeCache[i];
+        if (entry->count)
+            PROF_Count(machine->profile, entry->pc, entry->instruction.opcode, entry->count);
+        entry->count = 0;
+    }
+}
+#endif
 
-    printf(" | IR: %u %u %u %lu %lu\n", ir[0], ir[1], ir[2], *(uint64_t *)(ir + 3), *(uint64_t *)(ir + 11));
+// Write the registers of the running CPU as one line
+static void CPU_FormatRegisters(char *buffer, size_t size)
+{
+    Cpu *cpu = CPU_Self();
+    uint8_t opcode, srcMode, destMode;
+    uint64_t srcOperand, destOperand;
+    if (cpu->current)
+    {
+        opcode = cpu->current->instruction.opcode;
+        srcMode = cpu->current->instruction.srcMode;
+        destMode = cpu->current->instruction.destMode;
+        srcOperand = cpu->current->instruction.srcOperand;
+        destOperand = cpu->current->instruction.destOperand;
+    }
+    else
+    {
+        opcode = cpu->ir[0];
+        srcMode = cpu->ir[1];
+        destMode = cpu->ir[2];
+        srcOperand = *(uint64_t *)(cpu->ir + 3);
+        destOperand = *(uint64_t *)(cpu->ir + 11);
+    }
+
+    snprintf(buffer, size,
+             "PC: %lu | SP: %lu | FP: %lu | RA: %lu | R[0-10]: %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu | %lu\n"
+             "SR: %u%u%u%u%u | IR: %u %u %u %lu %lu\n",
+             cpu->pc, cpu->sp, cpu->fp, cpu->ra,
+             cpu->registers[0], cpu->registers[1], cpu->registers[2], cpu->registers[3], cpu->registers[4],
+             cpu->registers[5], cpu->registers[6], cpu->registers[7], cpu->registers[8], cpu->registers[9], cpu->registers[10],
+             cpu->sr.reserved, cpu->sr.overflow, cpu->sr.carry, cpu->sr.sign, cpu->sr.zero,
+             opcode, srcMode, destMode, srcOperand, destOperand);
 }
 
+void CPU_PrintRegisters()
+{
+    char buffer[CPU_REGISTER_DUMP_SIZE];
+    CPU_FormatRegisters(buffer, sizeof buffer);
+    fputs(buffer, stdout);
+}
+
+// Per instruction trace, one message through the log ring so the CPU does
+// not wait for the terminal
+static void CPU_TraceRegisters()
+{
+    char buffer[CPU_REGISTER_DUMP_SIZE];
+    CPU_FormatRegisters(buffer, sizeof buffer);
+    print_debug("%s", buffer);
+}
+
+// Stop the machine on CPU 0, or just this CPU on the others; CPU_Run
+// returns after this instruction
 void CPU_Halt()
 {
     print_debug("\n");
-    CPU_PrintRegisters();
-    exit(EXIT_SUCCESS);
+    if (cpuId == 0)
+        MACHINE_Halt();
+    else
+        CPU_Self()->halted = true;
+    CPU_RequestExit();
+}
+
+bool CPU_Halted()
+{
+    return CPU_Self()->halted;
+}
+
+// Tell CPU `cpu` to look at its interrupt controller. Safe to call from
+// any thread. Wakes the CPU if it waits in wfi asleep, i.e. for CPU 0 if
+// the machine is idling in real time.
+void CPU_RaiseInterrupt(int cpu)
+{
+    atomic_store(&machine->cpus[cpu]->itr, 1);
+    if (cpu == 0)
+        CL_Wake();
+    else
+        SMP_Wake(cpu);
+}
+
+// Whether the CPU is stopped in wfi. A pending interrupt is taken here,
+// which ends the wait, so the next CPU_Run starts in its handler.
+bool CPU_Waiting()
+{
+    Cpu *cpu = CPU_Self();
+    if (cpu->waiting && cpu->itr != 0)
+        CPU_CheckInterrupts();
+    return cpu->waiting;
 }
 
 void CPU_Pause()
@@ -421,56 +1002,773 @@ void CPU_Pause()
 
 void CPU_Reset()
 {
+    Cpu *cpu = CPU_Self();
     print_debug("\n");
 
-    sr.zero = 0;
-    sr.carry = 0;
-    sr.sign = 0;
-    sr.overflow = 0;
-
-    sp = 0;
-    fp = 0;
-    ra = 0;
-    pc = 0;
-    itr = 0;
-    memset(registers, 0, sizeof(registers));
+    cpu->sr.zero = 0;
+    cpu->sr.carry = 0;
+    cpu->sr.sign = 0;
+    cpu->sr.overflow = 0;
+
+    cpu->sp = 0;
+    cpu->fp = 0;
+    cpu->ra = 0;
+    cpu->pc = cpu->entry;
+    cpu->itr = 0;
+    cpu->waiting = false;
+    INT_Reset();
+    memset(cpu->registers, 0, sizeof(cpu->registers));
     // memset(stack, 0, sizeof(stack));
     // memset(mem, 0, sizeof(mem)); // CPU can only access memory through the bus
-    memset(ir, 0, sizeof(ir));
+    memset(cpu->ir, 0, sizeof(cpu->ir));
+}
+
+void CPU_GetState(CpuState *state)
+{
+    Cpu *cpu = CPU_Self();
+    memcpy(state->registers, cpu->registers, sizeof(cpu->registers));
+    state->pc = cpu->pc;
+    state->sp = cpu->sp;
+    state->fp = cpu->fp;
+    state->ra = cpu->ra;
+    memcpy(&state->sr, &cpu->sr, sizeof(cpu->sr));
+    state->itr = cpu->itr;
+    state->waiting = cpu->waiting;
+    state->encoding = cpu->encoding;
+    state->entry = cpu->entry;
+}
+
+// Only valid before the first CPU_Run: cached instructions and translated
+// blocks are not flushed
+void CPU_SetState(const CpuState *state)
+{
+    Cpu *cpu = CPU_Self();
+    memcpy(cpu->registers, state->registers, sizeof(cpu->registers));
+    cpu->pc = state->pc;
+    cpu->sp = state->sp;
+    cpu->fp = state->fp;
+    cpu->ra = state->ra;
+    memcpy(&cpu->sr, &state->sr, sizeof(cpu->sr));
+    cpu->itr = state->itr;
+    cpu->waiting = state->waiting;
+    cpu->encoding = state->encoding;
+    cpu->entry = state->entry;
+}
+
+// Only valid before the first CPU_Run, like CPU_SetState
+void CPU_SetEncoding(IsaEncoding encoding)
+{
+    CPU_Self()->encoding = encoding;
+}
+
+// Only valid before the first CPU_Run, like CPU_SetState
+void CPU_SetEntry(uint64_t entry)
+{
+    CPU_Self()->entry = entry;
+    CPU_Self()->pc = entry;
+}
+
+IsaEncoding CPU_GetEncoding()
+{
+    return CPU_Self()->encoding;
+}
+
+Cpu *CPU_Create()
+{
+    Cpu *cpu = calloc(1, sizeof(Cpu));
+    if (!cpu)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return cpu;
+}
+
+void CPU_Destroy(Cpu *cpu)
+{
+    free(cpu);
 }
 
 void CPU_Init()
 {
+    Cpu *cpu = CPU_Self();
+
+    memset(cpu->decodeCache, 0, sizeof(cpu->decodeCache));
+    memset(cpu->codePages, 0, sizeof(cpu->codePages));
+    cpu->current = NULL;
+
+    CPU_Reset();
+}
+
+// CPU_Init for a secondary CPU, on its own thread once the image is loaded:
+// it starts where CPU 0 did
+void CPU_InitSecondary()
+{
+    Cpu *cpu = CPU_Self();
+    cpu->encoding = machine->cpus[0]->encoding;
+    cpu->entry = machine->cpus[0]->entry;
+    CPU_Init();
+}
+
+#ifndef CPU_THREADED
+
+#ifdef CPU_JIT
+
+// Run translated blocks where there are any, and interpret everything
+// else. Cold code is interpreted while JIT_GetBlock counts how often each
+// block start is reached.
+static uint64_t CPU_RunCore(Cpu *cpu, uint64_t cycles)
+{
+    uint64_t executed = 0;
+    uint8_t *link = NULL;
+
+    if (cpu->itr != 0)
+        CPU_CheckInterrupts();
+    while (executed < cycles && !cpu->exitRequested)
+    {
+        void *code = JIT_GetBlock(cpu->pc, link);
+        link = NULL;
+
+        JitFrame frame = {.sp = cpu->sp, .zero = cpu->sr.zero, .budget = (int64_t)(cycles - executed), .link = NULL, .ra = cpu->ra};
+        uint64_t start = cpu->pc;
+        if (code)
+            cpu->pc = JIT_Execute(code, cpu->registers, &frame);
+
+        if (!code || (cpu->pc == start && frame.budget == (int64_t)(cycles - executed)))
+        {
+            // Nothing translated here, or not enough budget for the block
+            CPU_Tick();
+            cpu->executed = ++executed;
+            continue;
+        }
+
+        executed = cycles - (uint64_t)frame.budget;
+        cpu->executed = executed;
+        cpu->sp = frame.sp;
+        cpu->sr.zero = frame.zero;
+        cpu->ra = frame.ra;
+        link = frame.link;
+
+        if (cpu->itr != 0)
+        {
+            // don't chain the block to an interrupt handler
+            CPU_CheckInterrupts();
+            link = NULL;
+        }
+    }
+    return executed;
+}
+
+#else
+
+static uint64_t CPU_RunCore(Cpu *cpu, uint64_t cycles)
+{
+    uint64_t executed = 0;
+
+    if (cpu->itr != 0)
+        CPU_CheckInterrupts();
+    while (executed < cycles && !cpu->exitRequested)
+    {
+        CPU_Tick();
+        cpu->executed = ++executed;
+    }
+    return executed;
+}
+
+#endif // CPU_JIT
+
+void CPU_Tick()
+{
+    Cpu *cpu = CPU_Self();
+    DecodedInstruction *entry = &cpu->decodeCache[cpu->pc & (DECODE_CACHE_SIZE - 1)];
+    if (!entry->valid || entry->pc != cpu->pc)
+        CPU_FillDecodeCache(entry);
+
+    cpu->current = entry;
+    cpu->pc = cpu->pc + entry->size;
+    entry->handler(entry->instruction);
+#ifdef PROFILE
+    entry->count++;
+#endif
+
+    if (LOG_LEVEL >= LOG_LEVEL_DEBUG && LOG_Enabled(LOG_CPU))
+        CPU_TraceRegisters();
+
+    if (cpu->itr != 0)
+        CPU_CheckInterrupts();
+}
 
-    instructionHandlers[OP_NOP] = &nop;
-    instructionHandlers[OP_MOV] = &mov;
-    instructionHandlers[OP_PUSH] = &push;
-    instructionHandlers[OP_POP] = &pop;
-    instructionHandlers[OP_ADD] = &add;
-    instructionHandlers[OP_SUB] = &sub;
-    instructionHandlers[OP_MUL] = &mul;
-    instructionHandlers[OP_DIV] = &_div;
-    instructionHandlers[OP_CMP] = &cmp;
-    instructionHandlers[OP_JMP] = &jmp;
-    instructionHandlers[OP_JEQ] = &jeq;
-    instructionHandlers[OP_CALL] = &call;
-    instructionHandlers[OP_RET] = &ret;
-    instructionHandlers[OP_RST] = &rst;
-
-    instructionHandlers[OP_HLT] = &hlt;
-    instructionHandlers[OP_LDR] = &ldr;
-    instructionHandlers[OP_STR] = &str;
+#else // CPU_THREADED
+
+// Direct-threaded core
+//
+// Every decode cache entry carries the address of a label inside CPU_Run
+// that implements its opcode for its exact combination of addressing
+// modes, and register operands are resolved to pointers when the entry is
+// filled. Executing an instruction is a single indirect jump, with no
+// handler call and no addressing mode switch.
+//
+// Common sequences are fused: the entry of the first instruction of a
+// group (cmp + jeq, mov + call, and str + mov + str as in write_char)
+// gets a handler that runs the whole group, moving from one instruction
+// to the next with a direct jump instead of a dispatch. Every instruction
+// still retires on its own, so pc, flags, cycle counts, interrupts and
+// exit requests are exactly those of the unfused instructions; whenever
+// one of them needs attention between two instructions of a group, the
+// group is left through the normal dispatch.
+
+typedef enum
+{
+    TH_GENERIC, // anything without a specialized handler, uses instructionHandlers
+    TH_NOP,
+    TH_MOV_IMM_REG,
+    TH_MOV_REG_REG,
+    TH_PUSH_REG,
+    TH_POP_REG,
+    TH_ADD_IMM_REG,
+    TH_ADD_REG_REG,
+    TH_SUB_IMM_REG,
+    TH_SUB_REG_REG,
+    TH_MUL_IMM_REG,
+    TH_MUL_REG_REG,
+    TH_DIV_IMM_REG,
+    TH_DIV_REG_REG,
+    TH_AND, // from here to TH_RSH any source mode, see CPU_FillThreaded
+    TH_OR,
+    TH_XOR,
+    TH_NOT,
+    TH_LSH,
+    TH_RSH,
+    TH_JMP_IMM,
+    TH_CMP_IMM_IMM,
+    TH_CMP_IMM_REG,
+    TH_CMP_REG_IMM,
+    TH_CMP_REG_REG,
+    TH_JEQ_IMM,
+    TH_CALL_IMM,
+    TH_RET,
+    TH_LDR_DIR_REG,
+    TH_STR_REG_DIR,
+    TH_LD8, // direct or indirect addresses alike
+    TH_LD16,
+    TH_LD32,
+    TH_LD64,
+    TH_ST8,
+    TH_ST16,
+    TH_ST32,
+    TH_ST64,
+    TH_RST,
+    TH_HLT,
+    TH_CMP_JEQ,
+    TH_MOV_CALL,
+    TH_STR_MOV_STR,
+    TH_COUNT
+} ThreadedOp;
+
+static uint64_t *CPU_ResolveRegister(uint64_t operand, bool write)
+{
+    Cpu *cpu = CPU_Self();
+    if (operand == 0)
+        return write ? &cpu->sinkRegister : &cpu->zeroRegister;
+    if (operand == 65)
+        return &cpu->sp;
+    if (operand >= 64)
+    {
+        print_error("Invalid Register\n");
+        MACHINE_Abort();
+    }
+    return &cpu->registers[operand];
+}
 
+static ThreadedOp CPU_SelectThreadedOp(const Instruction *in)
+{
+    bool srcImm = in->srcMode == AM_IMMEDIATE;
+    bool srcReg = in->srcMode == AM_REGISTER;
+    bool destImm = in->destMode == AM_IMMEDIATE;
+    bool destReg = in->destMode == AM_REGISTER;
+
+    switch (in->opcode)
+    {
+    case OP_NOP:
+        return TH_NOP;
+    case OP_MOV:
+        return !destReg ? TH_GENERIC : srcImm ? TH_MOV_IMM_REG : srcReg ? TH_MOV_REG_REG : TH_GENERIC;
+    case OP_PUSH:
+        return destReg ? TH_PUSH_REG : TH_GENERIC;
+    case OP_POP:
+        return destReg ? TH_POP_REG : TH_GENERIC;
+    case OP_ADD:
+        return !destReg ? TH_GENERIC : srcImm ? TH_ADD_IMM_REG : srcReg ? TH_ADD_REG_REG : TH_GENERIC;
+    case OP_SUB:
+        return !destReg ? TH_GENERIC : srcImm ? TH_SUB_IMM_REG : srcReg ? TH_SUB_REG_REG : TH_GENERIC;
+    case OP_MUL:
+        return !destReg ? TH_GENERIC : srcImm ? TH_MUL_IMM_REG : srcReg ? TH_MUL_REG_REG : TH_GENERIC;
+    case OP_DIV:
+        return !destReg ? TH_GENERIC : srcImm ? TH_DIV_IMM_REG : srcReg ? TH_DIV_REG_REG : TH_GENERIC;
+    case OP_AND:
+        return destReg && (srcImm || srcReg) ? TH_AND : TH_GENERIC;
+    case OP_OR:
+        return destReg && (srcImm || srcReg) ? TH_OR : TH_GENERIC;
+    case OP_XOR:
+        return destReg && (srcImm || srcReg) ? TH_XOR : TH_GENERIC;
+    case OP_NOT:
+        return destReg ? TH_NOT : TH_GENERIC;
+    case OP_LSH:
+        return destReg && (srcImm || srcReg) ? TH_LSH : TH_GENERIC;
+    case OP_RSH:
+        return destReg && (srcImm || srcReg) ? TH_RSH : TH_GENERIC;
+    case OP_JMP:
+        return destImm ? TH_JMP_IMM : TH_GENERIC;
+    case OP_CMP:
+        if (srcImm && destImm)
+            return TH_CMP_IMM_IMM;
+        if (srcImm && destReg)
+            return TH_CMP_IMM_REG;
+        if (srcReg && destImm)
+            return TH_CMP_REG_IMM;
+        if (srcReg && destReg)
+            return TH_CMP_REG_REG;
+        return TH_GENERIC;
+    case OP_JEQ:
+        return destImm ? TH_JEQ_IMM : TH_GENERIC;
+    case OP_CALL:
+        return destImm ? TH_CALL_IMM : TH_GENERIC;
+    case OP_RET:
+        return TH_RET;
+    case OP_LDR:
+        return in->srcMode == AM_DIRECT && destReg ? TH_LDR_DIR_REG : TH_GENERIC;
+    case OP_STR:
+        return srcReg && in->destMode == AM_DIRECT ? TH_STR_REG_DIR : TH_GENERIC;
+    case OP_LD8:
+        return destReg ? TH_LD8 : TH_GENERIC;
+    case OP_LD16:
+        return destReg ? TH_LD16 : TH_GENERIC;
+    case OP_LD32:
+        return destReg ? TH_LD32 : TH_GENERIC;
+    case OP_LD64:
+        return destReg ? TH_LD64 : TH_GENERIC;
+    case OP_ST8:
+        return srcReg ? TH_ST8 : TH_GENERIC;
+    case OP_ST16:
+        return srcReg ? TH_ST16 : TH_GENERIC;
+    case OP_ST32:
+        return srcReg ? TH_ST32 : TH_GENERIC;
+    case OP_ST64:
+        return srcReg ? TH_ST64 : TH_GENERIC;
+    case OP_RST:
+        return TH_RST;
+    case OP_HLT:
+        return TH_HLT;
+    default:
+        return TH_GENERIC;
+    }
+}
+
+// Decode the instruction at pc straight from RAM, without fetching it over
+// the bus or validating it, to see what follows an instruction being
+// filled. The followers are validated when they are filled themselves.
+// Advances *pc past the instruction.
+static bool CPU_PeekInstruction(uint64_t *pc, Instruction *in)
+{
+    if (*pc + INSTRUCTION_WIDTH > RAM_LowSize())
+        return false;
+
+    *pc += ISA_Decode(&machine->ram[*pc], CPU_Self()->encoding, in);
+    return true;
+}
+
+// Whether the instruction at *pc would get the plain handler `op`.
+// Advances *pc past it.
+static bool CPU_FollowedBy(uint64_t *pc, ThreadedOp op)
+{
+    Instruction in;
+    if (machine->gdb && GDB_IsBreakpoint(*pc))
+        return false; // a group would run past it
+    return CPU_PeekInstruction(pc, &in) && CPU_SelectThreadedOp(&in) == op;
+}
+
+// Pick a fused handler for the group starting with `op` at pc, if any,
+// and return how many bytes it covers
+static uint8_t CPU_SelectFusedOp(ThreadedOp *op, uint64_t pc, uint8_t size)
+{
+    uint64_t next = pc + size;
+
+    switch (*op)
+    {
+    case TH_CMP_IMM_IMM:
+    case TH_CMP_IMM_REG:
+    case TH_CMP_REG_IMM:
+    case TH_CMP_REG_REG:
+        if (!CPU_FollowedBy(&next, TH_JEQ_IMM))
+            return size;
+        *op = TH_CMP_JEQ;
+        break;
+    case TH_MOV_IMM_REG:
+    case TH_MOV_REG_REG:
+        if (!CPU_FollowedBy(&next, TH_CALL_IMM))
+            return size;
+        *op = TH_MOV_CALL;
+        break;
+    case TH_STR_REG_DIR:
+        if (!CPU_FollowedBy(&next, TH_MOV_IMM_REG) || !CPU_FollowedBy(&next, TH_STR_REG_DIR))
+            return size;
+        *op = TH_STR_MOV_STR;
+        break;
+    default:
+        return size;
+    }
+    return (uint8_t)(next - pc);
+}
+
+static void CPU_FillThreaded(DecodedInstruction *entry, const void *const *labels)
+{
+    CPU_FillDecodeCache(entry);
+
+    const Instruction *in = &entry->instruction;
+    ThreadedOp op = CPU_SelectThreadedOp(in);
+
+    // Arithmetic on r0 has to read it as zero and discard the result,
+    // which a single resolved pointer can't express
+    if (op >= TH_ADD_IMM_REG && op <= TH_RSH && in->destOperand == 0)
+        op = TH_GENERIC;
+    if (entry->handler == &brk)
+        op = TH_GENERIC;
+
+    // Only reads go through the source; the destination is written by
+    // everything except push and cmp, which only read it. Indirect
+    // operands only read the register holding the address.
+    bool destWrite = op != TH_PUSH_REG && op != TH_CMP_IMM_REG && op != TH_CMP_REG_REG;
+
+    entry->src = in->srcMode == AM_REGISTER || in->srcMode == AM_INDIRECT ? CPU_ResolveRegister(in->srcOperand, false) : NULL;
+    entry->dest = in->destMode == AM_REGISTER ? CPU_ResolveRegister(in->destOperand, destWrite)
+                  : in->destMode == AM_INDIRECT ? CPU_ResolveRegister(in->destOperand, false)
+                                                 : NULL;
+
+    // Fused handlers, the bitwise ones and the sized loads and stores read
+    // immediate and direct operands through the operand pointers too, so
+    // one handler serves every mode
+    if (in->srcMode == AM_IMMEDIATE || in->srcMode == AM_DIRECT)
+        entry->src = &entry->instruction.srcOperand;
+    if (in->destMode == AM_IMMEDIATE || in->destMode == AM_DIRECT)
+        entry->dest = &entry->instruction.destOperand;
+
+    // Writes to the followers of a fused group have to invalidate it
+    entry->span = CPU_SelectFusedOp(&op, entry->pc, entry->size);
+    if (entry->span > entry->size)
+        CPU_MarkCodePages(entry->pc, entry->span);
+    entry->label = labels[op];
+}
+
+#ifdef PROFILE
+#define PROFILE_RETIRE() entry->count++
+#else
+#define PROFILE_RETIRE()
+#endif
+
+// Jump straight to the next instruction's handler
+#define DISPATCH()                                                             \
+    do                                                                         \
+    {                                                                          \
+        PROFILE_RETIRE();                                                      \
+        if (LOG_LEVEL >= LOG_LEVEL_DEBUG && LOG_Enabled(LOG_CPU))              \
+            CPU_TraceRegisters();                                              \
+        if (cpu->itr != 0)                                                     \
+            CPU_CheckInterrupts();                                             \
+        cpu->executed = ++executed;                                            \
+        if (executed == cycles || cpu->exitRequested)                          \
+            return executed;                                                   \
+        entry = &cpu->decodeCache[cpu->pc & (DECODE_CACHE_SIZE - 1)];          \
+        if (!entry->valid || entry->pc != cpu->pc)                             \
+            CPU_FillThreaded(entry, labels);                                   \
+        cpu->current = entry;                                                  \
+        cpu->pc = cpu->pc + entry->size;                                       \
+        __extension__({ goto *entry->label; });                                \
+    } while (0)
+
+// Go on with the next instruction of a fused group, as DISPATCH() would
+// but without the indirect jump. Falls back to DISPATCH() if the next
+// instruction isn't decoded yet or anything has to be checked first.
+#define FUSED_NEXT()                                                           \
+    do                                                                         \
+    {                                                                          \
+        DecodedInstruction *next = &cpu->decodeCache[cpu->pc & (DECODE_CACHE_SIZE - 1)]; \
+        if (cpu->itr != 0 || cpu->exitRequested || executed + 1 == cycles ||   \
+            !next->valid || next->pc != cpu->pc ||                             \
+            (LOG_LEVEL >= LOG_LEVEL_DEBUG && LOG_Enabled(LOG_CPU)))            \
+            DISPATCH();                                                        \
+        PROFILE_RETIRE();                                                      \
+        cpu->executed = ++executed;                                            \
+        entry = next;                                                          \
+        cpu->current = entry;                                                  \
+        cpu->pc = cpu->pc + entry->size;                                       \
+    } while (0)
+
+static uint64_t CPU_RunCore(Cpu *cpu, uint64_t cycles)
+{
+    static const void *const labels[TH_COUNT] = {
+        [TH_GENERIC] = __extension__ &&generic,
+        [TH_NOP] = __extension__ &&nop,
+        [TH_MOV_IMM_REG] = __extension__ &&mov_imm_reg,
+        [TH_MOV_REG_REG] = __extension__ &&mov_reg_reg,
+        [TH_PUSH_REG] = __extension__ &&push_reg,
+        [TH_POP_REG] = __extension__ &&pop_reg,
+        [TH_ADD_IMM_REG] = __extension__ &&add_imm_reg,
+        [TH_ADD_REG_REG] = __extension__ &&add_reg_reg,
+        [TH_SUB_IMM_REG] = __extension__ &&sub_imm_reg,
+        [TH_SUB_REG_REG] = __extension__ &&sub_reg_reg,
+        [TH_MUL_IMM_REG] = __extension__ &&mul_imm_reg,
+        [TH_MUL_REG_REG] = __extension__ &&mul_reg_reg,
+        [TH_DIV_IMM_REG] = __extension__ &&div_imm_reg,
+        [TH_DIV_REG_REG] = __extension__ &&div_reg_reg,
+        [TH_AND] = __extension__ &&and_,
+        [TH_OR] = __extension__ &&or_,
+        [TH_XOR] = __extension__ &&xor_,
+        [TH_NOT] = __extension__ &&not_,
+        [TH_LSH] = __extension__ &&lsh,
+        [TH_RSH] = __extension__ &&rsh,
+        [TH_JMP_IMM] = __extension__ &&jmp_imm,
+        [TH_CMP_IMM_IMM] = __extension__ &&cmp_imm_imm,
+        [TH_CMP_IMM_REG] = __extension__ &&cmp_imm_reg,
+        [TH_CMP_REG_IMM] = __extension__ &&cmp_reg_imm,
+        [TH_CMP_REG_REG] = __extension__ &&cmp_reg_reg,
+        [TH_JEQ_IMM] = __extension__ &&jeq_imm,
+        [TH_CALL_IMM] = __extension__ &&call_imm,
+        [TH_RET] = __extension__ &&ret,
+        [TH_LDR_DIR_REG] = __extension__ &&ldr_dir_reg,
+        [TH_STR_REG_DIR] = __extension__ &&str_reg_dir,
+        [TH_LD8] = __extension__ &&ld8,
+        [TH_LD16] = __extension__ &&ld16,
+        [TH_LD32] = __extension__ &&ld32,
+        [TH_LD64] = __extension__ &&ld64,
+        [TH_ST8] = __extension__ &&st8,
+        [TH_ST16] = __extension__ &&st16,
+        [TH_ST32] = __extension__ &&st32,
+        [TH_ST64] = __extension__ &&st64,
+        [TH_RST] = __extension__ &&rst,
+        [TH_HLT] = __extension__ &&hlt,
+        [TH_CMP_JEQ] = __extension__ &&cmp_jeq,
+        [TH_MOV_CALL] = __extension__ &&mov_call,
+        [TH_STR_MOV_STR] = __extension__ &&str_mov_str,
+    };
+
+    DecodedInstruction *entry;
+    uint64_t executed = 0;
+
+    if (cycles == 0)
+        return 0;
+    if (cpu->itr != 0)
+        CPU_CheckInterrupts();
+
+    entry = &cpu->decodeCache[cpu->pc & (DECODE_CACHE_SIZE - 1)];
+    if (!entry->valid || entry->pc != cpu->pc)
+        CPU_FillThreaded(entry, labels);
+    cpu->current = entry;
+    cpu->pc = cpu->pc + entry->size;
+    __extension__({ goto *entry->label; });
+
+generic:
+    entry->handler(entry->instruction);
+    DISPATCH();
+nop:
+    DISPATCH();
+mov_imm_reg:
+    *entry->dest = entry->instruction.srcOperand;
+    DISPATCH();
+mov_reg_reg:
+    *entry->dest = *entry->src;
+    DISPATCH();
+push_reg:
+    CPU_PushStack(*entry->dest);
+    DISPATCH();
+pop_reg:
+    *entry->dest = CPU_PopStack();
+    DISPATCH();
+add_imm_reg:
+    *entry->dest += entry->instruction.srcOperand;
+    DISPATCH();
+add_reg_reg:
+    *entry->dest += *entry->src;
+    DISPATCH();
+sub_imm_reg:
+    *entry->dest -= entry->instruction.srcOperand;
+    DISPATCH();
+sub_reg_reg:
+    *entry->dest -= *entry->src;
+    DISPATCH();
+mul_imm_reg:
+    *entry->dest *= entry->instruction.srcOperand;
+    DISPATCH();
+mul_reg_reg:
+    *entry->dest *= *entry->src;
+    DISPATCH();
+div_imm_reg:
+    *entry->dest = entry->instruction.srcOperand / *entry->dest;
+    DISPATCH();
+div_reg_reg:
+    *entry->dest = *entry->src / *entry->dest;
+    DISPATCH();
+and_:
+    *entry->dest &= *entry->src;
+    DISPATCH();
+or_:
+    *entry->dest |= *entry->src;
+    DISPATCH();
+xor_:
+    *entry->dest ^= *entry->src;
+    DISPATCH();
+not_:
+    *entry->dest = ~*entry->dest;
+    DISPATCH();
+lsh:
+    *entry->dest <<= *entry->src & 63;
+    DISPATCH();
+rsh:
+    *entry->dest >>= *entry->src & 63;
+    DISPATCH();
+jmp_imm:
+    cpu->pc = entry->instruction.destOperand;
+    DISPATCH();
+cmp_imm_imm:
+    cpu->sr.zero = entry->instruction.srcOperand == entry->instruction.destOperand;
+    DISPATCH();
+cmp_imm_reg:
+    cpu->sr.zero = entry->instruction.srcOperand == *entry->dest;
+    DISPATCH();
+cmp_reg_imm:
+    cpu->sr.zero = *entry->src == entry->instruction.destOperand;
+    DISPATCH();
+cmp_reg_reg:
+    cpu->sr.zero = *entry->src == *entry->dest;
+    DISPATCH();
+jeq_imm:
+    if (cpu->sr.zero)
+        cpu->pc = entry->instruction.destOperand;
+    DISPATCH();
+call_imm:
+    cpu->ra = cpu->pc;
+    CPU_PushStack(cpu->ra);
+    cpu->pc = entry->instruction.destOperand;
+#ifdef PROFILE
+    PROF_Call(machine->profile, cpu->pc);
+#endif
+    DISPATCH();
+ret:
+    cpu->pc = CPU_PopStack();
+    cpu->ra = 0;
+#ifdef PROFILE
+    PROF_Return(machine->profile);
+#endif
+    DISPATCH();
+ldr_dir_reg:
+    *entry->dest = BUS_Read(entry->instruction.srcOperand);
+    DISPATCH();
+str_reg_dir:
+    BUS_Write(entry->instruction.destOperand, *entry->src);
+    DISPATCH();
+ld8:
+    *entry->dest = BUS_Read8(*entry->src);
+    DISPATCH();
+ld16:
+    *entry->dest = BUS_Read16(*entry->src);
+    DISPATCH();
+ld32:
+    *entry->dest = BUS_Read32(*entry->src);
+    DISPATCH();
+ld64:
+    *entry->dest = BUS_Read(*entry->src);
+    DISPATCH();
+st8:
+    BUS_Write8(*entry->dest, *entry->src);
+    DISPATCH();
+st16:
+    BUS_Write16(*entry->dest, *entry->src);
+    DISPATCH();
+st32:
+    BUS_Write32(*entry->dest, *entry->src);
+    DISPATCH();
+st64:
+    BUS_Write(*entry->dest, *entry->src);
+    DISPATCH();
+rst:
     CPU_Reset();
+    DISPATCH();
+hlt:
+    CPU_Halt();
+    DISPATCH();
+
+    // Fused groups end by jumping to the handler of their last instruction
+cmp_jeq:
+    cpu->sr.zero = *entry->src == *entry->dest;
+    FUSED_NEXT();
+    goto jeq_imm;
+mov_call:
+    *entry->dest = *entry->src;
+    FUSED_NEXT();
+    goto call_imm;
+str_mov_str:
+    BUS_Write(entry->instruction.destOperand, *entry->src);
+    FUSED_NEXT();
+    *entry->dest = entry->instruction.srcOperand;
+    FUSED_NEXT();
+    goto str_reg_dir;
 }
 
 void CPU_Tick()
 {
-    CPU_FetchInstruction();
-    CPU_DecodeInstruction();
-    CPU_ValidateInstruction();
-    CPU_ExecuteInstruction();
-    CPU_CheckInterrupts();
+    CPU_Run(1);
+}
+
+#endif // CPU_THREADED
+
+// Run the calling thread's CPU for up to `cycles` instructions. A request
+// to exit is only dropped once CPU_Run returns, so one from another thread
+// that comes in before it starts isn't lost.
+uint64_t CPU_Run(uint64_t cycles)
+{
+    Cpu *cpu = CPU_Self();
+    if (atomic_load_explicit(&cpu->flushRequested, memory_order_relaxed) && atomic_exchange(&cpu->flushRequested, false))
+        CPU_FlushDecodeCache(cpu);
+
+    uint64_t executed = CPU_RunCore(cpu, cycles);
+    cpu->executed = 0;
+    atomic_store_explicit(&cpu->exitRequested, false, memory_order_relaxed);
+#ifdef CPU_JIT
+    JIT_ClearExit();
+#endif
+    if (cpu->trapped)
+    {
+        // the breakpoint was dispatched like an instruction but retired none
+        cpu->trapped = false;
+        executed--;
+        if (cpu->itrHeld)
+            atomic_store(&cpu->itr, 1);
+    }
+    atomic_store_explicit(&cpu->retired, atomic_load_explicit(&cpu->retired, memory_order_relaxed) + executed,
+                          memory_order_relaxed);
+    return executed;
+}
+
+// A guest fault is unwinding CPU_Run, see MACHINE_Abort: count what it
+// retired before the faulting instruction, as CPU_Run would have on
+// return, and return that. 0 outside CPU_Run.
+uint64_t CPU_Unwind()
+{
+    Cpu *cpu = CPU_Self();
+    uint64_t executed = cpu->executed;
+#ifdef CPU_JIT
+    executed += JIT_Unwind();
+#endif
+    cpu->executed = 0;
+    atomic_store_explicit(&cpu->retired, atomic_load_explicit(&cpu->retired, memory_order_relaxed) + executed,
+                          memory_order_relaxed);
+    return executed;
+}
+
+// Instructions CPU `cpu` of the calling thread's machine retired so far.
+// Safe to call from any thread.
+uint64_t CPU_Retired(int cpu)
+{
+    return atomic_load_explicit(&machine->cpus[cpu]->retired, memory_order_relaxed);
 }
 
 /*void print_state()
@@ -490,18 +1788,30 @@ void CPU_Tick()
     printf("\n");
 }*/
 
+// Take the most urgent interrupt the controller has for us: push pc, then
+// sr with the controller's previous level in bits 8-15 for iret, and jump
+// through the line's vector
 void CPU_CheckInterrupts()
 {
-    print_debug("Checking interrupts\n");
-    if (itr != 0)
-    {
-        print_info("INTERRUPT: %u\n", itr);
-        if (itr == 1)
-        {
-            pc = BUS_Read(16);
-        }
-        // pc = 1;
-        itr = 0;
-        // exit(EXIT_SUCCESS);
-    }
+    Cpu *cpu = CPU_Self();
+    // Clear the register before asking the controller, so a line raised in
+    // between sets it again rather than getting lost
+    if (atomic_exchange(&cpu->itr, 0) == 0)
+        return;
+
+    uint8_t level;
+    int line = INT_Acknowledge(&level);
+    if (line < 0)
+        return; // masked or not urgent enough, the controller rings again when that changes
+
+    print_debug("interrupt %d\n", line);
+    uint8_t flags;
+    memcpy(&flags, &cpu->sr, sizeof(flags));
+    cpu->waiting = false;
+    CPU_PushStack(cpu->pc);
+    CPU_PushStack(flags | (uint64_t)level << 8);
+    cpu->pc = BUS_Read(INT_Vector(line));
+#ifdef PROFILE
+    PROF_Call(machine->profile, cpu->pc);
+#endif
 }
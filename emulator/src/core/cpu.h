@@ -1,15 +1,55 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../common/isa.h"
+
+// Architectural state, as saved in snapshots
+typedef struct
+{
+    uint64_t registers[64];
+    uint64_t pc;
+    uint64_t sp;
+    uint64_t fp;
+    uint64_t ra;
+    uint8_t sr;
+    uint8_t itr;
+    uint8_t waiting; // stopped in wfi
+    uint8_t encoding; // IsaEncoding
+    uint64_t entry;
+} CpuState;
+
+typedef struct Cpu Cpu;
+
+Cpu *CPU_Create();
+void CPU_Destroy(Cpu *cpu);
 void CPU_Init();
+void CPU_InitSecondary();
 void CPU_Tick();
+uint64_t CPU_Run(uint64_t cycles);
+uint64_t CPU_Unwind();
+uint64_t CPU_Retired(int cpu);
 void CPU_PrintRegisters();
 void CPU_FetchInstruction();
 void CPU_DecodeInstruction();
 uint64_t CPU_ExecuteInstruction();
 
 void CPU_CheckInterrupts();
-
-extern uint8_t itr;
+void CPU_RaiseInterrupt(int cpu);
+bool CPU_Waiting();
+bool CPU_Halted();
+void CPU_InvalidateCode(uint64_t address, uint64_t size);
+void CPU_RequestExit();
+void CPU_Kick(int cpu);
+void CPU_GetState(CpuState *state);
+#ifdef PROFILE
+void CPU_FlushProfile();
+#endif
+void CPU_SetState(const CpuState *state);
+void CPU_SetEncoding(IsaEncoding encoding);
+void CPU_SetEntry(uint64_t entry);
+IsaEncoding CPU_GetEncoding();
 
 #endif // CPU_H
\ No newline at end of file
@@ -0,0 +1,731 @@
+#define _DEFAULT_SOURCE
+#define LOG_CATEGORY LOG_GENERAL
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/common.h"
+#include "../devices/io.h"
+#include "bus.h"
+#include "clock.h"
+#include "cpu.h"
+#include "gdb.h"
+#include "machine.h"
+
+// GDB remote stub
+//
+// A machine created with a debugger address waits for GDB, or anything
+// else speaking its remote serial protocol, to connect over TCP on the
+// loopback interface (the address is a port) or over a Unix socket (the
+// address is a path), and then runs only when the debugger says so.
+//
+// Breakpoints cost nothing until they are reached: the decode cache entry
+// of an instruction with a breakpoint on it gets a handler that stops in
+// front of it instead (see CPU_FillDecodeCache), translated blocks end in
+// front of it, and setting or clearing one invalidates the cached code
+// covering it and nothing else. Watchpoints make the pages they cover trap
+// reads and writes (see BUS_Watch); the bus slow paths report accesses to
+// them here and the CPU stops after the instruction that made them. DMA
+// transfers go straight to host memory and don't trip them.
+//
+// The debugger sees registers r0 to r63, then pc, sp, fp, ra and sr, 64
+// bits each, as target.xml describes them. It can read and write RAM and
+// ROM, but not device registers, where reads have side effects. Machines
+// with one CPU only.
+
+#define GDB_PACKET_SIZE 4096 // largest packet either side sends
+#define GDB_MAX_BREAKPOINTS 64
+#define GDB_MAX_WATCHPOINTS 16
+#define GDB_REGISTERS 69
+
+typedef struct
+{
+    uint64_t address;
+    uint64_t size;
+    char type; // '2' write, '3' read, '4' access, as in Z packets
+} GdbWatch;
+
+// Per machine state, reached through machine->gdb
+struct Gdb
+{
+    int fd;
+    const char *path; // of the Unix socket, removed again by GDB_Destroy
+    bool noAck;       // after QStartNoAckMode
+
+    uint64_t breakpoints[GDB_MAX_BREAKPOINTS];
+    int breakpointCount;
+    uint64_t skip; // breakpoint being stepped over, see GDB_Resume
+    bool skipping;
+    GdbWatch watches[GDB_MAX_WATCHPOINTS];
+    int watchCount;
+
+    bool stopped;             // hit a breakpoint or watchpoint since resuming
+    _Atomic bool interrupted; // ^C from the debugger, or it went away
+    char stop[64];            // stop reply for the last stop
+
+    uint8_t received[256];
+    size_t receivedAt, receivedSize;
+    char packet[GDB_PACKET_SIZE + 1];
+    char reply[GDB_PACKET_SIZE + 1];
+    char xml[8192]; // target.xml
+};
+
+static void GDB_DescribeTarget(Gdb *gdb)
+{
+    static const char *const names[] = {"pc", "sp", "fp", "ra", "sr"};
+    static const char *const types[] = {"code_ptr", "data_ptr", "data_ptr", "code_ptr", "int64"};
+    size_t at = snprintf(gdb->xml, sizeof(gdb->xml),
+                         "<?xml version=\"1.0\"?>\n<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+                         "<target version=\"1.0\">\n<feature name=\"org.tisc.core\">\n");
+    for (int i = 0; i < GDB_REGISTERS; i++)
+    {
+        if (i < 64)
+            at += snprintf(gdb->xml + at, sizeof(gdb->xml) - at, "<reg name=\"r%d\" bitsize=\"64\" type=\"int64\"/>\n", i);
+        else
+            at += snprintf(gdb->xml + at, sizeof(gdb->xml) - at, "<reg name=\"%s\" bitsize=\"64\" type=\"%s\"/>\n",
+                           names[i - 64], types[i - 64]);
+    }
+    snprintf(gdb->xml + at, sizeof(gdb->xml) - at, "</feature>\n</target>\n");
+}
+
+static int GDB_Listen(const char *address)
+{
+    int listener;
+    if (strchr(address, '/'))
+    {
+        struct sockaddr_un local = {.sun_family = AF_UNIX};
+        if (strlen(address) >= sizeof(local.sun_path))
+        {
+            print_error("Debugger socket path too long: %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(local.sun_path, address);
+        unlink(address);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == -1 || bind(listener, (struct sockaddr *)&local, sizeof(local)) == -1)
+        {
+            perror(address);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        char *end;
+        long port = strtol(address, &end, 10);
+        if (*end || port <= 0 || port > 65535)
+        {
+            print_error("Debugger address must be a port or a socket path: %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+        struct sockaddr_in local = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+        int on = 1;
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == -1 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+            bind(listener, (struct sockaddr *)&local, sizeof(local)) == -1)
+        {
+            perror("gdb socket");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (listen(listener, 1) == -1)
+    {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return listener;
+}
+
+// Wait for a debugger to connect to `address`
+Gdb *GDB_Create(const char *address)
+{
+    Gdb *gdb = calloc(1, sizeof(Gdb));
+    if (!gdb)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&gdb->interrupted, false);
+    strcpy(gdb->stop, "S05");
+    GDB_DescribeTarget(gdb);
+
+    int listener = GDB_Listen(address);
+    if (strchr(address, '/'))
+        gdb->path = address;
+    print_info("Waiting for a debugger on %s\n", address);
+    gdb->fd = accept(listener, NULL, NULL);
+    close(listener);
+    if (gdb->fd == -1)
+    {
+        perror("accept");
+        exit(EXIT_FAILURE);
+    }
+    int on = 1;
+    setsockopt(gdb->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly on Unix sockets
+    print_info("Debugger connected\n");
+    return gdb;
+}
+
+void GDB_Destroy(Gdb *gdb)
+{
+    close(gdb->fd);
+    if (gdb->path)
+        unlink(gdb->path);
+    free(gdb);
+}
+
+// Next byte from the debugger, -1 once it is gone
+static int GDB_GetChar(Gdb *gdb)
+{
+    if (gdb->receivedAt == gdb->receivedSize)
+    {
+        ssize_t received = recv(gdb->fd, gdb->received, sizeof(gdb->received), 0);
+        if (received <= 0)
+            return -1;
+        gdb->receivedAt = 0;
+        gdb->receivedSize = received;
+    }
+    return gdb->received[gdb->receivedAt++];
+}
+
+static void GDB_Send(Gdb *gdb, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(gdb->fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return; // the next read finds out
+        data += sent;
+        size -= sent;
+    }
+}
+
+static int GDB_Hex(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Read the next packet into gdb->packet and acknowledge it. Anything
+// between packets, acks and stray ^Cs included, is skipped, and so are
+// packets that are too long or fail their checksum, acks or not. False
+// once the debugger is gone.
+static bool GDB_GetPacket(Gdb *gdb)
+{
+    for (;;)
+    {
+        int c;
+        do
+        {
+            c = GDB_GetChar(gdb);
+        } while (c != '$' && c != -1);
+
+        size_t length = 0;
+        uint8_t sum = 0;
+        while ((c = GDB_GetChar(gdb)) != '#' && c != -1)
+        {
+            if (length < GDB_PACKET_SIZE)
+                gdb->packet[length] = (char)c;
+            length++;
+            sum += (uint8_t)c;
+        }
+        int high = c == -1 ? -1 : GDB_GetChar(gdb);
+        int low = high == -1 ? -1 : GDB_GetChar(gdb);
+        if (low == -1)
+            return false;
+
+        bool ok = length <= GDB_PACKET_SIZE && GDB_Hex(high) >= 0 && GDB_Hex(low) >= 0 &&
+                  GDB_Hex(high) * 16 + GDB_Hex(low) == sum;
+        if (!gdb->noAck)
+            GDB_Send(gdb, ok ? "+" : "-", 1);
+        if (ok)
+        {
+            gdb->packet[length] = '\0';
+            return true;
+        }
+    }
+}
+
+// Send `data` as a packet, again until the debugger acknowledges it
+static void GDB_PutPacket(Gdb *gdb, const char *data)
+{
+    static const char digits[] = "0123456789abcdef";
+    uint8_t sum = 0;
+    for (const char *c = data; *c; c++)
+        sum += (uint8_t)*c;
+    char trailer[3] = {'#', digits[sum >> 4], digits[sum & 15]};
+
+    for (;;)
+    {
+        GDB_Send(gdb, "$", 1);
+        GDB_Send(gdb, data, strlen(data));
+        GDB_Send(gdb, trailer, sizeof(trailer));
+        if (gdb->noAck)
+            return;
+
+        int c;
+        do
+        {
+            c = GDB_GetChar(gdb);
+        } while (c != '+' && c != '-' && c != -1);
+        if (c != '-')
+            return;
+    }
+}
+
+// Parse a hex number at *text and move past it. False if there is none.
+static bool GDB_ParseHex(const char **text, uint64_t *value)
+{
+    const char *start = *text;
+    *value = 0;
+    while (GDB_Hex(**text) >= 0)
+        *value = *value << 4 | (uint64_t)GDB_Hex(*(*text)++);
+    return *text != start;
+}
+
+// `size` bytes from `bytes` as hex into `out`, which gets a terminator
+static void GDB_PutBytes(char *out, const uint8_t *bytes, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++)
+    {
+        *out++ = digits[bytes[i] >> 4];
+        *out++ = digits[bytes[i] & 15];
+    }
+    *out = '\0';
+}
+
+// `size` bytes of hex at `text` into `bytes`. False if there are fewer.
+static bool GDB_GetBytes(const char *text, uint8_t *bytes, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        int high = GDB_Hex(text[2 * i]);
+        int low = high < 0 ? -1 : GDB_Hex(text[2 * i + 1]);
+        if (low < 0)
+            return false;
+        bytes[i] = (uint8_t)(high << 4 | low);
+    }
+    return true;
+}
+
+// Registers travel in target byte order, which is little endian on every
+// host this runs on
+static void GDB_ReadRegisters(uint64_t *values)
+{
+    CpuState state;
+    CPU_GetState(&state);
+    memcpy(values, state.registers, sizeof(state.registers));
+    values[64] = state.pc;
+    values[65] = state.sp;
+    values[66] = state.fp;
+    values[67] = state.ra;
+    values[68] = state.sr;
+}
+
+static void GDB_WriteRegisters(const uint64_t *values)
+{
+    CpuState state;
+    CPU_GetState(&state);
+    memcpy(state.registers, values, sizeof(state.registers));
+    state.pc = values[64];
+    state.sp = values[65];
+    state.fp = values[66];
+    state.ra = values[67];
+    state.sr = (uint8_t)values[68];
+    CPU_SetState(&state);
+}
+
+static int GDB_FindBreakpoint(Gdb *gdb, uint64_t address)
+{
+    for (int i = 0; i < gdb->breakpointCount; i++)
+    {
+        if (gdb->breakpoints[i] == address)
+            return i;
+    }
+    return -1;
+}
+
+// Whether the instruction at address has a breakpoint, for filling the
+// decode cache and translating blocks
+bool GDB_IsBreakpoint(uint64_t address)
+{
+    Gdb *gdb = machine->gdb;
+    if (gdb->skipping && address == gdb->skip)
+        return false;
+    return GDB_FindBreakpoint(gdb, address) >= 0;
+}
+
+// The CPU stopped at a breakpoint, in front of the instruction
+void GDB_Breakpoint()
+{
+    Gdb *gdb = machine->gdb;
+    if (gdb->stopped)
+        return;
+    gdb->stopped = true;
+    strcpy(gdb->stop, "S05");
+}
+
+// The guest read or wrote [address, address + size) on a page with a
+// watchpoint. The CPU stops after the instruction if a watchpoint covers
+// the access.
+void GDB_Access(uint64_t address, unsigned size, bool write)
+{
+    static const char *const kinds[] = {['2'] = "watch", ['3'] = "rwatch", ['4'] = "awatch"};
+    Gdb *gdb = machine->gdb;
+    for (int i = 0; i < gdb->watchCount; i++)
+    {
+        GdbWatch *watch = &gdb->watches[i];
+        if (address < watch->address + watch->size && address + size > watch->address &&
+            (watch->type == '4' || (watch->type == '2') == write))
+        {
+            if (!gdb->stopped)
+            {
+                gdb->stopped = true;
+                snprintf(gdb->stop, sizeof(gdb->stop), "T05%s:%lx;", kinds[(int)watch->type], watch->address);
+                CPU_RequestExit();
+            }
+            return;
+        }
+    }
+}
+
+// Whether MACHINE_Run should return to the debugger
+bool GDB_Stopped()
+{
+    Gdb *gdb = machine->gdb;
+    return gdb->stopped || atomic_load_explicit(&gdb->interrupted, memory_order_relaxed);
+}
+
+// I/O thread, while the machine runs: the debugger sends ^C to stop it
+static void GDB_Input(void *opaque, uint32_t events)
+{
+    Gdb *gdb = opaque;
+    uint8_t bytes[64];
+    ssize_t received = recv(gdb->fd, bytes, sizeof(bytes), MSG_DONTWAIT);
+    if (received > 0 && !memchr(bytes, 0x03, received))
+        return;
+    if (received == -1)
+        return;
+    atomic_store(&gdb->interrupted, true); // ^C, or the connection closed
+    CPU_Kick(0);
+    CL_Wake(); // if idling in wfi
+}
+
+// Z and z packets: add or remove a breakpoint or watchpoint
+static const char *GDB_SetPoint(Gdb *gdb, const char *text, bool set)
+{
+    char type = text[0];
+    uint64_t address, size;
+    text++;
+    if (*text++ != ',' || !GDB_ParseHex(&text, &address) || *text++ != ',' || !GDB_ParseHex(&text, &size))
+        return "E01";
+
+    if (type == '0' || type == '1')
+    {
+        int found = GDB_FindBreakpoint(gdb, address);
+        if (set && found < 0)
+        {
+            if (gdb->breakpointCount == GDB_MAX_BREAKPOINTS)
+                return "E01";
+            gdb->breakpoints[gdb->breakpointCount++] = address;
+        }
+        else if (!set && found >= 0)
+            gdb->breakpoints[found] = gdb->breakpoints[--gdb->breakpointCount];
+        CPU_InvalidateCode(address, 1);
+        return "OK";
+    }
+    if (type < '2' || type > '4' || size == 0)
+        return "";
+
+    if (set)
+    {
+        if (gdb->watchCount == GDB_MAX_WATCHPOINTS)
+            return "E01";
+        gdb->watches[gdb->watchCount++] = (GdbWatch){.address = address, .size = size, .type = type};
+        BUS_Watch(address, size);
+        return "OK";
+    }
+    for (int i = 0; i < gdb->watchCount; i++)
+    {
+        GdbWatch *watch = &gdb->watches[i];
+        if (watch->address == address && watch->size == size && watch->type == type)
+        {
+            BUS_Unwatch(address, size);
+            *watch = gdb->watches[--gdb->watchCount];
+            break;
+        }
+    }
+    return "OK";
+}
+
+// Drop every breakpoint and watchpoint
+static void GDB_Clear(Gdb *gdb)
+{
+    while (gdb->breakpointCount)
+        CPU_InvalidateCode(gdb->breakpoints[--gdb->breakpointCount], 1);
+    while (gdb->watchCount)
+    {
+        gdb->watchCount--;
+        BUS_Unwatch(gdb->watches[gdb->watchCount].address, gdb->watches[gdb->watchCount].size);
+    }
+}
+
+// c and s packets: run the machine until it stops, or for one
+// instruction, and reply with why it stopped. False if it halted, or
+// faulted before, which ends the session.
+static bool GDB_Resume(Gdb *gdb, const char *text, bool step)
+{
+    Machine *m = machine;
+    uint64_t address;
+    if (m->status == MACHINE_HALTED)
+    {
+        GDB_PutPacket(gdb, "W00");
+        return false;
+    }
+    if (m->status == MACHINE_FAULTED)
+    {
+        GDB_PutPacket(gdb, "X0b");
+        return false;
+    }
+    if (GDB_ParseHex(&text, &address))
+    {
+        uint64_t values[GDB_REGISTERS];
+        GDB_ReadRegisters(values);
+        values[64] = address;
+        GDB_WriteRegisters(values);
+    }
+
+    gdb->stopped = false;
+    atomic_store(&gdb->interrupted, false);
+    strcpy(gdb->stop, "S05");
+
+    // The breakpoint the CPU stopped at would stop it again right away:
+    // hide it for one instruction
+    CpuState state;
+    CPU_GetState(&state);
+    bool over = GDB_FindBreakpoint(gdb, state.pc) >= 0;
+    if (over)
+    {
+        gdb->skip = state.pc;
+        gdb->skipping = true;
+        CPU_InvalidateCode(state.pc, 1);
+    }
+    if (step || over)
+        MACHINE_Step(m);
+    if (over)
+    {
+        gdb->skipping = false;
+        CPU_InvalidateCode(state.pc, 1);
+    }
+
+    if (!step && !gdb->stopped && m->status == MACHINE_RUNNING)
+    {
+        IO_Watch(gdb->fd, EPOLLIN, &GDB_Input, gdb);
+        MACHINE_Run(m, UINT64_MAX); // returns once GDB_Stopped
+        IO_Unwatch(gdb->fd);
+        if (!gdb->stopped)
+            strcpy(gdb->stop, "S02");
+    }
+
+    if (m->status == MACHINE_HALTED)
+    {
+        GDB_PutPacket(gdb, "W00");
+        return false;
+    }
+    if (m->status == MACHINE_FAULTED)
+        strcpy(gdb->stop, "S0b");
+    GDB_PutPacket(gdb, gdb->stop);
+    return true;
+}
+
+// qXfer:features:read:target.xml:offset,length
+static const char *GDB_ReadFeatures(Gdb *gdb, const char *text)
+{
+    uint64_t offset, length;
+    size_t size = strlen(gdb->xml);
+    if (strncmp(text, "target.xml:", 11) != 0)
+        return "E00";
+    text += 11;
+    if (!GDB_ParseHex(&text, &offset) || *text++ != ',' || !GDB_ParseHex(&text, &length))
+        return "E01";
+    if (offset > size)
+        offset = size;
+    if (length > GDB_PACKET_SIZE - 1)
+        length = GDB_PACKET_SIZE - 1;
+    if (length > size - offset)
+        length = size - offset;
+    gdb->reply[0] = offset + length < size ? 'm' : 'l';
+    memcpy(gdb->reply + 1, gdb->xml + offset, length);
+    gdb->reply[length + 1] = '\0';
+    return gdb->reply;
+}
+
+// Reply to the packet in gdb->packet. False once the session is over.
+static bool GDB_Handle(Gdb *gdb)
+{
+    const char *text = gdb->packet + 1;
+    const char *reply = "";
+    uint64_t values[GDB_REGISTERS];
+    uint64_t address, length;
+
+    switch (gdb->packet[0])
+    {
+    case '?':
+        reply = gdb->stop;
+        break;
+    case 'g':
+        GDB_ReadRegisters(values);
+        GDB_PutBytes(gdb->reply, (const uint8_t *)values, sizeof(values));
+        reply = gdb->reply;
+        break;
+    case 'G':
+        GDB_ReadRegisters(values);
+        if (!GDB_GetBytes(text, (uint8_t *)values, sizeof(values)))
+        {
+            reply = "E01";
+            break;
+        }
+        GDB_WriteRegisters(values);
+        reply = "OK";
+        break;
+    case 'p':
+        if (!GDB_ParseHex(&text, &address) || address >= GDB_REGISTERS)
+        {
+            reply = "E01";
+            break;
+        }
+        GDB_ReadRegisters(values);
+        GDB_PutBytes(gdb->reply, (const uint8_t *)&values[address], sizeof(uint64_t));
+        reply = gdb->reply;
+        break;
+    case 'P':
+        GDB_ReadRegisters(values);
+        if (!GDB_ParseHex(&text, &address) || address >= GDB_REGISTERS || *text++ != '=' ||
+            !GDB_GetBytes(text, (uint8_t *)&values[address], sizeof(uint64_t)))
+        {
+            reply = "E01";
+            break;
+        }
+        GDB_WriteRegisters(values);
+        reply = "OK";
+        break;
+    case 'm':
+    {
+        if (!GDB_ParseHex(&text, &address) || *text++ != ',' || !GDB_ParseHex(&text, &length))
+        {
+            reply = "E01";
+            break;
+        }
+        if (length > GDB_PACKET_SIZE / 2)
+            length = GDB_PACKET_SIZE / 2;
+        const uint8_t *memory = length ? BUS_HostRange(address, length) : NULL;
+        if (!memory)
+        {
+            reply = "E01";
+            break;
+        }
+        GDB_PutBytes(gdb->reply, memory, length);
+        reply = gdb->reply;
+        break;
+    }
+    case 'M':
+    {
+        if (!GDB_ParseHex(&text, &address) || *text++ != ',' || !GDB_ParseHex(&text, &length) || *text++ != ':' ||
+            length > GDB_PACKET_SIZE / 2)
+        {
+            reply = "E01";
+            break;
+        }
+        uint8_t bytes[GDB_PACKET_SIZE / 2];
+        uint8_t *memory = length ? BUS_HostRange(address, length) : NULL;
+        if (!memory || !GDB_GetBytes(text, bytes, length))
+        {
+            reply = length ? "E01" : "OK";
+            break;
+        }
+        // the debugger may patch code, and ROM too
+        memcpy(memory, bytes, length);
+        CPU_InvalidateCode(address, length);
+        reply = "OK";
+        break;
+    }
+    case 'c':
+        return GDB_Resume(gdb, text, false);
+    case 's':
+        return GDB_Resume(gdb, text, true);
+    case 'Z':
+        reply = GDB_SetPoint(gdb, text, true);
+        break;
+    case 'z':
+        reply = GDB_SetPoint(gdb, text, false);
+        break;
+    case 'H':
+    case 'T':
+        reply = "OK"; // there is only one thread
+        break;
+    case 'D':
+        GDB_Clear(gdb);
+        GDB_PutPacket(gdb, "OK");
+        return false;
+    case 'k':
+        MACHINE_Halt();
+        return false;
+    case 'q':
+        if (strncmp(text, "Supported", 9) == 0)
+            reply = "PacketSize=1000;qXfer:features:read+;QStartNoAckMode+";
+        else if (strncmp(text, "Xfer:features:read:", 19) == 0)
+            reply = GDB_ReadFeatures(gdb, text + 19);
+        else if (strcmp(text, "Attached") == 0)
+            reply = "1";
+        else if (strcmp(text, "C") == 0)
+            reply = "QC1";
+        else if (strcmp(text, "fThreadInfo") == 0)
+            reply = "m1";
+        else if (strcmp(text, "sThreadInfo") == 0)
+            reply = "l";
+        break;
+    case 'Q':
+        if (strcmp(text, "StartNoAckMode") == 0)
+        {
+            GDB_PutPacket(gdb, "OK");
+            gdb->noAck = true;
+            return true;
+        }
+        break;
+    }
+    GDB_PutPacket(gdb, reply);
+    return true;
+}
+
+// Let the debugger drive the calling thread's machine until it detaches,
+// kills it or goes away, or the machine halts. The machine stays as it
+// was left, and runs on without breakpoints and watchpoints.
+void GDB_Serve()
+{
+    Gdb *gdb = machine->gdb;
+    while (GDB_GetPacket(gdb))
+    {
+        if (!GDB_Handle(gdb))
+        {
+            GDB_Clear(gdb);
+            return;
+        }
+    }
+    print_info("Debugger went away, running on\n");
+    GDB_Clear(gdb);
+}
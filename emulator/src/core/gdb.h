@@ -0,0 +1,17 @@
+#ifndef GDB_H
+#define GDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Gdb Gdb;
+
+Gdb *GDB_Create(const char *address);
+void GDB_Destroy(Gdb *gdb);
+bool GDB_IsBreakpoint(uint64_t address);
+void GDB_Breakpoint();
+void GDB_Access(uint64_t address, unsigned size, bool write);
+bool GDB_Stopped();
+void GDB_Serve();
+
+#endif // GDB_H
@@ -0,0 +1,228 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/common.h"
+#include "../memory/ram.h"
+#include "../memory/rom.h"
+#include "bus.h"
+#include "cpu.h"
+#include "image.h"
+#include "machine.h"
+
+// Image loader
+//
+// Three kinds of files load: images with segments (image.h), and flat
+// binaries in either encoding, which are one segment at the start of RAM.
+// Contents at a page aligned file offset and guest address are mapped
+// MAP_PRIVATE over guest RAM or ROM instead of being copied, so a big
+// image costs nothing until its pages are touched and instances started
+// from the same file share the pages they don't write. Everything else
+// is read in. Pages of segments without IMG_WRITE are write protected on
+// the bus unless a writable segment shares them; that is not part of
+// snapshots. IMG_EXEC is not enforced.
+
+// Host memory behind [address, address + size), if that is inside RAM or ROM
+static uint8_t *IMG_Host(uint64_t address, uint64_t size)
+{
+    uint64_t low = RAM_LowSize();
+    if (address - RAM_START < low && size <= low - (address - RAM_START))
+        return machine->ram + (address - RAM_START);
+    uint64_t high = machine->ramSize - low;
+    if (address - HIGH_RAM_START < high && size <= high - (address - HIGH_RAM_START))
+        return machine->ram + low + (address - HIGH_RAM_START);
+    if (address - ROM_START < ROM_SIZE && size <= ROM_SIZE - (address - ROM_START))
+        return machine->rom + (address - ROM_START);
+    return NULL;
+}
+
+static bool IMG_Read(int fd, uint8_t *host, uint64_t offset, uint64_t size)
+{
+    while (size)
+    {
+        ssize_t count = pread(fd, host, size, offset);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        host += count;
+        offset += count;
+        size -= count;
+    }
+    return true;
+}
+
+static bool IMG_Place(int fd, const ImageSegment *segment, const char *path)
+{
+    uint8_t *host = IMG_Host(segment->address, segment->memSize);
+    if (!host || segment->fileSize > segment->memSize)
+    {
+        print_error("%s: segment 0x%lx+%lu doesn't fit in RAM or ROM\n", path, segment->address, segment->memSize);
+        return false;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (segment->fileSize && ((uintptr_t)host | segment->offset) % pageSize == 0)
+    {
+        if (mmap(host, segment->fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, segment->offset) == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        // the rest of the last page comes from the file too
+        uint64_t mapped = (segment->fileSize + pageSize - 1) & ~(uint64_t)(pageSize - 1);
+        uint64_t end = segment->memSize < mapped ? segment->memSize : mapped;
+        if (end > segment->fileSize)
+            memset(host + segment->fileSize, 0, end - segment->fileSize);
+    }
+    else if (!IMG_Read(fd, host, segment->offset, segment->fileSize))
+    {
+        print_error("Reading error: unexpected end of %s\n", path);
+        return false;
+    }
+
+    print_debug("segment 0x%lx+%lu from offset %lu, flags %u\n", segment->address, segment->memSize, segment->offset, segment->flags);
+    return true;
+}
+
+static bool IMG_Overlaps(const ImageSegment *segment, uint64_t address, uint64_t size)
+{
+    return segment->memSize && segment->address < address + size && address < segment->address + segment->memSize;
+}
+
+// Write protect the pages of segments without IMG_WRITE, except for pages
+// they share with a writable segment
+static void IMG_Protect(const ImageSegment *segments, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if ((segments[i].flags & IMG_WRITE) || segments[i].memSize == 0)
+            continue;
+
+        uint64_t end = segments[i].address + segments[i].memSize;
+        for (uint64_t page = segments[i].address & ~(uint64_t)(IMG_ALIGN - 1); page < end; page += IMG_ALIGN)
+        {
+            bool shared = false;
+            for (uint32_t j = 0; j < count && !shared; j++)
+                shared = (segments[j].flags & IMG_WRITE) && IMG_Overlaps(&segments[j], page, IMG_ALIGN);
+            if (!shared)
+                BUS_Protect(page, IMG_ALIGN);
+        }
+    }
+}
+
+static int IMG_CompareSegments(const void *a, const void *b)
+{
+    const ImageSegment *x = a, *y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+static bool IMG_LoadSymbols(int fd, const ImageHeader *header)
+{
+#ifdef PROFILE
+    char *text = malloc(header->symbolSize);
+    if (!text)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    bool ok = IMG_Read(fd, (uint8_t *)text, header->symbolOffset, header->symbolSize);
+    FILE *file = ok ? fmemopen(text, header->symbolSize, "r") : NULL;
+    if (file)
+    {
+        PROF_AddSymbols(machine->profile, file);
+        fclose(file);
+    }
+    free(text);
+    return ok;
+#else
+    return true;
+#endif
+}
+
+static bool IMG_LoadSegments(int fd, uint64_t length, const char *path)
+{
+    ImageHeader header;
+    ImageSegment segments[IMG_MAX_SEGMENTS];
+    if (!IMG_Read(fd, (uint8_t *)&header, 0, sizeof(header)) || header.segmentCount > IMG_MAX_SEGMENTS ||
+        !IMG_Read(fd, (uint8_t *)segments, sizeof(header), header.segmentCount * sizeof(ImageSegment)))
+    {
+        print_error("%s: bad image header\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header.segmentCount; i++)
+    {
+        if (segments[i].offset > length || segments[i].fileSize > length - segments[i].offset)
+        {
+            print_error("%s: segment 0x%lx runs past the end of the file\n", path, segments[i].address);
+            return false;
+        }
+    }
+
+    // in address order, so that a mapped page can't clobber a segment
+    // that was read into its tail
+    qsort(segments, header.segmentCount, sizeof(ImageSegment), &IMG_CompareSegments);
+    for (uint32_t i = 0; i < header.segmentCount; i++)
+    {
+        if (!IMG_Place(fd, &segments[i], path))
+            return false;
+    }
+    IMG_Protect(segments, header.segmentCount);
+
+    if (header.symbolSize && (header.symbolOffset > length || header.symbolSize > length - header.symbolOffset ||
+                              !IMG_LoadSymbols(fd, &header)))
+    {
+        print_error("%s: bad symbol table\n", path);
+        return false;
+    }
+
+    CPU_SetEncoding(header.flags & IMG_COMPACT ? ISA_COMPACT : ISA_FIXED);
+    CPU_SetEntry(header.entry);
+    return true;
+}
+
+// Load an image into the calling thread's machine. Only valid before the
+// first MACHINE_Run.
+bool IMG_Load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        print_error("Can't open %s\n", path);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    char magic[ISA_MAGIC_WIDTH] = {0};
+    bool known = IMG_Read(fd, (uint8_t *)magic, 0, sizeof(magic));
+    bool ok;
+    if (known && memcmp(magic, IMG_MAGIC, sizeof(magic)) == 0)
+    {
+        ok = IMG_LoadSegments(fd, st.st_size, path);
+    }
+    else
+    {
+        // Flat binary. Images in the compact encoding start with
+        // ISA_COMPACT_MAGIC, which is not loaded.
+        uint64_t start = known && memcmp(magic, ISA_COMPACT_MAGIC, sizeof(magic)) == 0 ? sizeof(magic) : 0;
+        ImageSegment segment = {.address = RAM_START, .offset = start, .fileSize = st.st_size - start,
+                                .memSize = st.st_size - start, .flags = IMG_READ | IMG_WRITE | IMG_EXEC};
+        CPU_SetEncoding(start ? ISA_COMPACT : ISA_FIXED);
+        ok = IMG_Place(fd, &segment, path);
+    }
+
+    close(fd); // the mappings keep the file alive
+    return ok;
+}
@@ -0,0 +1,47 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Program images, as written by tasm.py -i. All fields are little endian.
+//
+// The file starts with an ImageHeader and segmentCount ImageSegments.
+// Segment contents and the symbol table live elsewhere in the file, at
+// the offsets given; tasm.py puts contents at IMG_ALIGN file offsets so
+// they can be mapped straight into the guest address space.
+#define IMG_MAGIC "TISCIMG1"
+#define IMG_ALIGN 4096
+#define IMG_MAX_SEGMENTS 64
+
+// header flags
+#define IMG_COMPACT 1 // instructions use the compact encoding
+
+// segment flags
+#define IMG_READ 1
+#define IMG_WRITE 2 // without it, guest writes to the segment fault
+#define IMG_EXEC 4
+
+typedef struct
+{
+    char magic[8];
+    uint32_t flags;
+    uint32_t segmentCount;
+    uint64_t entry;        // initial pc, and where rst starts over
+    uint64_t symbolOffset; // "<hex address> <label>" lines, as in a .sym file
+    uint64_t symbolSize;   // 0 if there are no symbols
+} ImageHeader;
+
+typedef struct
+{
+    uint64_t address;  // guest address, the segment has to be inside RAM or ROM
+    uint64_t offset;   // file offset of the contents
+    uint64_t fileSize; // bytes of contents in the file
+    uint64_t memSize;  // bytes in memory, the rest is zero
+    uint32_t flags;
+    uint32_t reserved;
+} ImageSegment;
+
+bool IMG_Load(const char *path);
+
+#endif // IMAGE_H
@@ -1,35 +1,228 @@
-#include <stdint.h> 
-#include <stdio.h>
-/*
+#define LOG_CATEGORY LOG_DEVICE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
 #include "../common/common.h"
+#include "cpu.h"
 #include "interrupts.h"
+#include "machine.h"
+
+// Interrupt controller
+//
+// pending:        0x01100400     | clear:          0x01100408,
+// mapped to       0              |                 8
+// mask:           0x01100410     | vector base:    0x01100418,
+// mapped to       16             |                 24
+// level:          0x01100420     | IPI:            0x01100428,
+// mapped to       32             |                 40
+// CPU:            0x01100430     | CPU count:      0x01100438,
+// mapped to       48             |                 56
+// priority of line n at 0x01100440 + 8 * n, mapped to 64 + 8 * n
+//
+// Devices raise lines by setting bits in the pending word with one atomic
+// or, from any thread, and ring the CPU, which only ever looks at its own
+// interrupt register. When that is set the CPU acknowledges the most
+// urgent line that is pending, not masked and of a higher priority than
+// the running level (ties go to the lower line), pushes pc and sr and
+// jumps through the line's vector. The level goes up to the line's
+// priority until iret restores the one saved with sr, so a handler is
+// only interrupted by more urgent lines. A line of priority 0 is never
+// taken. Writing the pending register raises the lines set in the value,
+// writing the clear register drops them.
+//
+// Every CPU has a controller of its own, and the registers are banked:
+// each CPU sees its own at the same addresses. Devices raise their lines
+// on CPU 0's. Writing a mask of CPUs to the IPI register raises INT_IPI on
+// each of them, the writer included if its bit is set; the CPU register
+// reads the number of the CPU that reads it.
+
+// Per CPU controller state, reached through machine->intcs. Only the
+// pending word is touched by other threads.
+struct Intc
+{
+    int cpu; // the one it interrupts
+    _Atomic uint64_t pending;
+    uint64_t mask; // set bits mask lines, INT_NMI ignores it
+    uint64_t vectorBase;
+    uint8_t level; // priority of the handler that is running, 0 if none
+    uint8_t priorities[INT_LINES];
+};
 
+Intc *INT_Create(int cpu)
+{
+    Intc *intc = calloc(1, sizeof(Intc));
+    if (!intc)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    intc->cpu = cpu;
+    intc->vectorBase = INT_DEFAULT_VECTOR_BASE;
+    memset(intc->priorities, INT_DEFAULT_PRIORITY, sizeof(intc->priorities));
+    intc->priorities[INT_NMI] = INT_NMI_PRIORITY;
+    return intc;
+}
+
+void INT_Destroy(Intc *intc)
+{
+    free(intc);
+}
 
+// Drop everything pending and leave any handler, on rst. The mask, the
+// priorities and the vector base stay as they are.
+void INT_Reset()
+{
+    Intc *intc = machine->intcs[cpuId];
+    atomic_store(&intc->pending, 0);
+    intc->level = 0;
+}
 
-typedef uint64_t (*InterruptHandler)(Interrupt interrupt);
-static InterruptHandler interruptHandlers[8];
+static uint64_t INT_Deliverable(const Intc *intc)
+{
+    return atomic_load_explicit(&intc->pending, memory_order_relaxed) & ~(intc->mask & ~((uint64_t)1 << INT_NMI));
+}
 
-static uint64_t _INT_None(Interrupt interrupt);
-static uint64_t _INT_NMI(Interrupt interrupt);
-static uint64_t _INT_IRQ(Interrupt interrupt);
-static uint64_t _INT_CON(Interrupt interrupt);
+// Ring the CPU again if something may have become deliverable
+static void INT_Update(Intc *intc)
+{
+    if (INT_Deliverable(intc))
+        CPU_RaiseInterrupt(intc->cpu);
+}
 
-void INT_Init(){
-    print_debug("Initializing interrupts\n");
+static void INT_RaiseOn(Intc *intc, uint8_t line)
+{
+    atomic_fetch_or(&intc->pending, (uint64_t)1 << line);
+    CPU_RaiseInterrupt(intc->cpu);
+}
 
-    interruptHandlers[INT_NONE] = &_INT_None;
-    interruptHandlers[INT_NMI] = &_INT_NMI;
-    interruptHandlers[INT_IRQ] = &_INT_IRQ;
-    interruptHandlers[INT_CON] = &_INT_CON;
-    return;
+// Raise a device line, on CPU 0. Safe to call from any thread, without
+// locks.
+void INT_Raise(uint8_t line)
+{
+    if (line == INT_NONE || line >= INT_LINES)
+        return;
+    INT_RaiseOn(machine->intcs[0], line);
 }
 
-void INT_Tick(){
-    print_debug("Checking interrupts\n");
-    return;
+// Take the most urgent deliverable line off the pending word and raise
+// the level to its priority. Returns the line, or -1 if there is none.
+int INT_Acknowledge(uint8_t *previousLevel)
+{
+    Intc *intc = machine->intcs[cpuId];
+    uint64_t candidates = INT_Deliverable(intc);
+    int line = -1;
+    uint8_t priority = intc->level;
+
+    for (; candidates; candidates &= candidates - 1)
+    {
+        int candidate = __builtin_ctzll(candidates);
+        if (intc->priorities[candidate] > priority)
+        {
+            line = candidate;
+            priority = intc->priorities[candidate];
+        }
+    }
+    if (line < 0)
+        return -1;
+
+    atomic_fetch_and(&intc->pending, ~((uint64_t)1 << line));
+    *previousLevel = intc->level;
+    intc->level = priority;
+    return line;
 }
 
-void INT_SetInterrupt(Interrupt interrupt){
-    print_debug("Setting interrupt\n");
-    return;
-}*/
\ No newline at end of file
+uint64_t INT_Vector(uint8_t line)
+{
+    return machine->intcs[cpuId]->vectorBase + 8 * line;
+}
+
+// iret, back to the level of the interrupted code
+void INT_Return(uint8_t level)
+{
+    Intc *intc = machine->intcs[cpuId];
+    intc->level = level;
+    INT_Update(intc);
+}
+
+void INT_Write(void *opaque, uint64_t address, uint64_t data)
+{
+    Intc *intc = machine->intcs[cpuId];
+    print_debug("address: %lu, data: %lu\n", address, data);
+    switch (address)
+    {
+    case 0:
+        data &= ~(uint64_t)1; // there is no line 0
+        atomic_fetch_or(&intc->pending, data);
+        break;
+    case 8:
+        atomic_fetch_and(&intc->pending, ~data);
+        break;
+    case 16:
+        intc->mask = data;
+        break;
+    case 24:
+        intc->vectorBase = data;
+        break;
+    case 40:
+        for (; data; data &= data - 1)
+        {
+            int cpu = __builtin_ctzll(data);
+            if (cpu < machine->cpuCount)
+                INT_RaiseOn(machine->intcs[cpu], INT_IPI);
+        }
+        break;
+    default:
+        if (address >= 64 && address < 64 + 8 * INT_LINES && address != 64 + 8 * INT_NMI)
+            intc->priorities[(address - 64) / 8] = data;
+        break;
+    }
+    INT_Update(intc);
+}
+
+uint64_t INT_Read(void *opaque, uint64_t address)
+{
+    Intc *intc = machine->intcs[cpuId];
+    print_debug("\n");
+    switch (address)
+    {
+    case 0:
+        return atomic_load(&intc->pending);
+    case 16:
+        return intc->mask;
+    case 24:
+        return intc->vectorBase;
+    case 32:
+        return intc->level;
+    case 48:
+        return cpuId;
+    case 56:
+        return machine->cpuCount;
+    default:
+        if (address >= 64 && address < 64 + 8 * INT_LINES)
+            return intc->priorities[(address - 64) / 8];
+        return 0;
+    }
+}
+
+void INT_GetState(IntcState *state)
+{
+    Intc *intc = machine->intcs[0];
+    state->pending = atomic_load(&intc->pending);
+    state->mask = intc->mask;
+    state->vectorBase = intc->vectorBase;
+    state->level = intc->level;
+    memcpy(state->priorities, intc->priorities, sizeof(intc->priorities));
+}
+
+void INT_SetState(const IntcState *state)
+{
+    Intc *intc = machine->intcs[0];
+    atomic_store(&intc->pending, state->pending);
+    intc->mask = state->mask;
+    intc->vectorBase = state->vectorBase;
+    intc->level = state->level;
+    memcpy(intc->priorities, state->priorities, sizeof(intc->priorities));
+}
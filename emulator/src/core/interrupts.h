@@ -3,20 +3,44 @@
 
 #include <stdint.h>
 
+#define INT_LINES 64
+#define INT_DEFAULT_VECTOR_BASE 8 // vector of line n at base + 8 * n
+#define INT_DEFAULT_PRIORITY 1
+#define INT_NMI_PRIORITY 255
+
+// Interrupt lines
 typedef enum
 {
     INT_NONE,
-    INT_NMI,
-    INT_IRQ,
+    INT_NMI, // can't be masked, highest priority
+    INT_PIT, // interval timer
     INT_CON, // console interrupt
-
+    INT_PTY,
+    INT_IPI, // inter-processor interrupt, see INTC_IPI_REGISTER
 } Interrupt;
 
-extern uint8_t itr; // interrupt register - in cpu.c -- contains the current interrupt
-
-
-//void INT_Init();
-//void INT_Tick();
-
-
-#endif // INTERRUPTS_H
\ No newline at end of file
+// Controller registers, as saved in snapshots
+typedef struct
+{
+    uint64_t pending;
+    uint64_t mask;
+    uint64_t vectorBase;
+    uint8_t level;
+    uint8_t priorities[INT_LINES];
+} IntcState;
+
+typedef struct Intc Intc;
+
+Intc *INT_Create(int cpu);
+void INT_Destroy(Intc *intc);
+void INT_Reset();
+void INT_Raise(uint8_t line);
+int INT_Acknowledge(uint8_t *previousLevel);
+uint64_t INT_Vector(uint8_t line);
+void INT_Return(uint8_t level);
+void INT_GetState(IntcState *state);
+void INT_SetState(const IntcState *state);
+uint64_t INT_Read(void *opaque, uint64_t address);
+void INT_Write(void *opaque, uint64_t address, uint64_t data);
+
+#endif // INTERRUPTS_H
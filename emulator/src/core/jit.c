@@ -0,0 +1,1002 @@
+#define _DEFAULT_SOURCE
+#define LOG_CATEGORY LOG_CPU
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "../common/common.h"
+#include "../common/isa.h"
+#include "../memory/ram.h"
+#include "bus.h"
+#include "gdb.h"
+#include "jit.h"
+#include "machine.h"
+
+// x86-64 dynamic binary translator
+//
+// Hot basic blocks (straight-line code up to a jmp, jeq, call or ret) are
+// translated to host code in an executable buffer. Inside translated code
+// the guest state lives in host registers:
+//
+//   rbp      guest register file (registers[n] at [rbp + 8 * n])
+//   r14      guest sp
+//   r15      sr.zero
+//   rbx,r12,r13  the three guest registers a block uses most
+//   [rsp]    remaining instruction budget
+//   [rsp+8]  JitFrame pointer
+//   [rsp+16] instructions of the block left unretired if the bus call in
+//            progress faults, see JIT_Unwind
+//
+// rbx, r12 and r13 are loaded at block entry and written back at every
+// exit; sp and the zero flag stay in registers across chained blocks.
+// Blocks with a static successor exit through a patchable jmp which is
+// pointed directly at the successor once that is translated.
+//
+// With a debugger attached, blocks end in front of breakpoints, loads
+// always go through the bus and every memory access checks for an exit
+// request, so that watchpoints stop right after the instruction that hit
+// them, see gdb.c.
+
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+#define JIT_BLOCK_MAX_BYTES 8192      // worst case size of one translated block
+#define JIT_BLOCK_MAX_INSTRUCTIONS 64
+#define JIT_MAX_BLOCKS 8192
+#define JIT_TABLE_SIZE 4096           // lookup table entries, must be a power of two
+#define JIT_HOT_THRESHOLD 16          // executions before a block gets translated
+#define JIT_PAGE_SHIFT 8
+
+enum
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+#if defined(__x86_64__)
+
+#define JIT_CACHED_REGISTERS 3
+static const uint8_t cachedHostRegisters[JIT_CACHED_REGISTERS] = {RBX, R12, R13};
+
+typedef struct
+{
+    uint8_t *site;   // the 5 byte jmp that gets patched
+    uint64_t target; // guest address it leads to
+    bool linked;
+} JitLink;
+
+typedef struct
+{
+    uint64_t start; // guest address of the first instruction
+    uint64_t end;   // guest address just past the last instruction
+    uint8_t *code;
+    JitLink links[2];
+    bool valid;
+} JitBlock;
+
+// Per machine translator state, reached through machine->jit. Translated
+// code has the machine's RAM and exit flag addresses baked in, so blocks
+// are never shared between machines.
+struct Jit
+{
+    uint8_t *buffer;    // executable code buffer
+    uint8_t *emitPtr;   // next free byte
+    uint8_t *codeStart; // first byte after the entry/exit trampolines
+    uint8_t *epilogue;
+
+    JitBlock blocks[JIT_MAX_BLOCKS];
+    uint64_t blockCount;
+    JitBlock *table[JIT_TABLE_SIZE];
+    uint16_t hotness[JIT_TABLE_SIZE];
+
+    // One byte per RAM page that holds translated code
+    uint8_t codePages[RAM_LOW_SIZE >> JIT_PAGE_SHIFT];
+
+    // Set by JIT_RequestExit, from any thread, and only cleared once
+    // CPU_Run returns (JIT_ClearExit); blocks check it after every store
+    // and leave to the dispatcher
+    _Atomic uint8_t exitRequest;
+
+    // The host stack frame of the running JIT_Execute and the budget it
+    // started with, so that a fault can tell what it retired
+    uint64_t *stack;
+    int64_t entryBudget;
+    uint32_t unretired; // while translating, what [rsp+16] gets before a call
+};
+
+typedef uint64_t (*JitEntry)(void *code, uint64_t *registers, JitFrame *frame);
+
+// Emitter
+
+static void emit8(uint8_t byte)
+{
+    Jit *jit = machine->jit;
+    *jit->emitPtr++ = byte;
+}
+
+static void emit32(uint32_t value)
+{
+    Jit *jit = machine->jit;
+    memcpy(jit->emitPtr, &value, sizeof(value));
+    jit->emitPtr += sizeof(value);
+}
+
+static void emit64(uint64_t value)
+{
+    Jit *jit = machine->jit;
+    memcpy(jit->emitPtr, &value, sizeof(value));
+    jit->emitPtr += sizeof(value);
+}
+
+static void emit_rex(bool wide, uint8_t reg, uint8_t rm)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40)
+        emit8(rex);
+}
+
+// op r/m64, reg64 (register direct)
+static void emit_rr(uint8_t opcode, uint8_t reg, uint8_t rm)
+{
+    emit_rex(true, reg, rm);
+    emit8(opcode);
+    emit8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg64, [base + disp32]
+static void emit_mem(uint8_t opcode, uint8_t reg, uint8_t base, int32_t disp)
+{
+    emit_rex(true, reg, base);
+    emit8(opcode);
+    emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit8(0x24);
+    emit32((uint32_t)disp);
+}
+
+static void emit_mov_imm(uint8_t reg, uint64_t value)
+{
+    if (value <= 0xFFFFFFFF)
+    {
+        emit_rex(false, 0, reg); // mov r32, imm32 zero extends
+        emit8(0xB8 | (reg & 7));
+        emit32((uint32_t)value);
+    }
+    else
+    {
+        emit_rex(true, 0, reg);
+        emit8(0xB8 | (reg & 7));
+        emit64(value);
+    }
+}
+
+static void emit_mov(uint8_t dest, uint8_t src)
+{
+    if (dest != src)
+        emit_rr(0x89, src, dest);
+}
+
+// Calls may fault, see JIT_Unwind
+static void emit_call(uint64_t function)
+{
+    Jit *jit = machine->jit;
+    emit8(0x48); emit8(0xC7); emit8(0x44); emit8(0x24); emit8(0x10); emit32(jit->unretired); // mov qword [rsp+16], unretired
+    emit_mov_imm(RAX, function);
+    emit8(0xFF); // call rax
+    emit8(0xD0);
+}
+
+static uint8_t *emit_jmp32(uint8_t *target)
+{
+    Jit *jit = machine->jit;
+    uint8_t *site = jit->emitPtr;
+    emit8(0xE9);
+    emit32((uint32_t)(target - (site + 5)));
+    return site;
+}
+
+static uint8_t *emit_jcc32(uint8_t condition, uint8_t *target)
+{
+    Jit *jit = machine->jit;
+    uint8_t *site = jit->emitPtr;
+    emit8(0x0F);
+    emit8(0x80 | condition);
+    emit32((uint32_t)(target - (site + 6)));
+    return site;
+}
+
+static void patch_rel32(uint8_t *field, uint8_t *target)
+{
+    uint32_t rel = (uint32_t)(target - (field + 4));
+    memcpy(field, &rel, sizeof(rel));
+}
+
+static void emit_trampolines()
+{
+    Jit *jit = machine->jit;
+    // uint64_t entry(void *code, uint64_t *registers, JitFrame *frame)
+    emit8(0x53);             // push rbx
+    emit8(0x55);             // push rbp
+    emit8(0x41); emit8(0x54); // push r12
+    emit8(0x41); emit8(0x55); // push r13
+    emit8(0x41); emit8(0x56); // push r14
+    emit8(0x41); emit8(0x57); // push r15
+    emit8(0x48); emit8(0x83); emit8(0xEC); emit8(0x18); // sub rsp, 24
+    emit_mov_imm(RAX, (uint64_t)(uintptr_t)&jit->stack);
+    emit_mem(0x89, RSP, RAX, 0); // jit->stack = rsp
+    emit_mov(RBP, RSI);
+    emit_mem(0x89, RDX, RSP, 8);  // [rsp+8] = frame
+    emit_mem(0x8B, R14, RDX, 0);  // sp
+    emit_mem(0x8B, R15, RDX, 8);  // zero flag
+    emit_mem(0x8B, RAX, RDX, 16); // budget
+    emit_mem(0x89, RAX, RSP, 0);
+    emit8(0xFF); emit8(0xE7); // jmp rdi
+
+    // rax = next guest pc, rdx = link site or 0
+    jit->epilogue = jit->emitPtr;
+    emit_mem(0x8B, RCX, RSP, 8);
+    emit_mem(0x89, R14, RCX, 0);
+    emit_mem(0x89, R15, RCX, 8);
+    emit_mem(0x8B, RSI, RSP, 0);
+    emit_mem(0x89, RSI, RCX, 16);
+    emit_mem(0x89, RDX, RCX, 24);
+    emit8(0x48); emit8(0x83); emit8(0xC4); emit8(0x18); // add rsp, 24
+    emit8(0x41); emit8(0x5F); // pop r15
+    emit8(0x41); emit8(0x5E); // pop r14
+    emit8(0x41); emit8(0x5D); // pop r13
+    emit8(0x41); emit8(0x5C); // pop r12
+    emit8(0x5D);             // pop rbp
+    emit8(0x5B);             // pop rbx
+    emit8(0xC3);             // ret
+
+    jit->codeStart = jit->emitPtr;
+}
+
+// Translator
+
+typedef struct
+{
+    uint8_t host[64]; // host register caching each guest register, or 0
+} RegisterMap;
+
+// Returns the size of the instruction, 0 if it can't be decoded
+static uint8_t JIT_DecodeAt(uint64_t address, Instruction *instruction)
+{
+    if (address + INSTRUCTION_WIDTH > RAM_LowSize())
+        return 0;
+
+    uint8_t size = ISA_Decode(&machine->ram[address], CPU_GetEncoding(), instruction);
+
+    // Same checks as CPU_ValidateInstruction, but an invalid instruction
+    // just ends the block and is left for the interpreter to report
+    const Instruction *spec = &instructionSet[instruction->opcode];
+    if (instruction->opcode == 0 || spec->opcode != instruction->opcode)
+        return 0;
+    if ((spec->srcMode & instruction->srcMode) != instruction->srcMode)
+        return 0;
+    if ((spec->destMode & instruction->destMode) != instruction->destMode)
+        return 0;
+    return size;
+}
+
+static bool JIT_ValidRegisterOperand(uint8_t mode, uint64_t operand)
+{
+    return (mode != AM_REGISTER && mode != AM_INDIRECT) || operand < 64 || operand == 65;
+}
+
+// Whether the instruction can be translated, and whether it ends the block
+static bool JIT_Translatable(const Instruction *in, bool *terminator)
+{
+    *terminator = false;
+
+    if (!JIT_ValidRegisterOperand(in->srcMode, in->srcOperand) || !JIT_ValidRegisterOperand(in->destMode, in->destOperand))
+        return false;
+
+    switch (in->opcode)
+    {
+    case OP_NOP:
+        return true;
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_LSH:
+    case OP_RSH:
+        return (in->srcMode == AM_IMMEDIATE || in->srcMode == AM_REGISTER) && in->destMode == AM_REGISTER;
+    case OP_CMP:
+        return (in->srcMode == AM_IMMEDIATE || in->srcMode == AM_REGISTER) &&
+               (in->destMode == AM_IMMEDIATE || in->destMode == AM_REGISTER);
+    case OP_PUSH:
+    case OP_POP:
+    case OP_NOT:
+        return in->destMode == AM_REGISTER;
+    case OP_LDR:
+        return in->srcMode == AM_DIRECT && in->destMode == AM_REGISTER;
+    case OP_STR:
+        return in->srcMode == AM_REGISTER && in->destMode == AM_DIRECT;
+    case OP_LD8:
+    case OP_LD16:
+    case OP_LD32:
+    case OP_LD64:
+        return (in->srcMode == AM_DIRECT || in->srcMode == AM_INDIRECT) && in->destMode == AM_REGISTER;
+    case OP_ST8:
+    case OP_ST16:
+    case OP_ST32:
+    case OP_ST64:
+        return in->srcMode == AM_REGISTER && (in->destMode == AM_DIRECT || in->destMode == AM_INDIRECT);
+    case OP_JMP:
+    case OP_JEQ:
+    case OP_CALL:
+        *terminator = true;
+        return in->destMode == AM_IMMEDIATE;
+    case OP_RET:
+        *terminator = true;
+        return true;
+    default:
+        // div can trap, iret, wfi, rst and hlt leave the translated world
+        return false;
+    }
+}
+
+static void JIT_Load(const RegisterMap *map, uint8_t host, uint8_t mode, uint64_t operand)
+{
+    if (mode == AM_IMMEDIATE)
+        emit_mov_imm(host, operand);
+    else if (operand == 0)
+        emit_mov_imm(host, 0);
+    else if (operand == 65)
+        emit_mov(host, R14);
+    else if (map->host[operand])
+        emit_mov(host, map->host[operand]);
+    else
+        emit_mem(0x8B, host, RBP, (int32_t)(operand * 8));
+}
+
+static void JIT_Store(const RegisterMap *map, uint64_t operand, uint8_t host)
+{
+    if (operand == 0)
+        return; // r0 discards writes
+    else if (operand == 65)
+        emit_mov(R14, host);
+    else if (map->host[operand])
+        emit_mov(map->host[operand], host);
+    else
+        emit_mem(0x89, host, RBP, (int32_t)(operand * 8));
+}
+
+static void JIT_Spill(const RegisterMap *map)
+{
+    for (int reg = 1; reg < 64; reg++)
+    {
+        if (map->host[reg])
+            emit_mem(0x89, map->host[reg], RBP, reg * 8);
+    }
+}
+
+// Leave the block for a guest address known at translation time
+static void JIT_ExitStatic(const RegisterMap *map, JitBlock *block, int slot, uint64_t target)
+{
+    Jit *jit = machine->jit;
+    JIT_Spill(map);
+
+    // Falls through to the dispatcher exit until it gets linked
+    uint8_t *site = jit->emitPtr;
+    emit8(0xE9);
+    emit32(0);
+    block->links[slot].site = site;
+    block->links[slot].target = target;
+    block->links[slot].linked = false;
+
+    emit_mov_imm(RAX, target);
+    emit_mov_imm(RDX, (uint64_t)(uintptr_t)site);
+    emit_jmp32(jit->epilogue);
+}
+
+// Leave the block with the next guest pc in rax
+static void JIT_ExitDynamic(const RegisterMap *map)
+{
+    Jit *jit = machine->jit;
+    JIT_Spill(map);
+    emit_mov_imm(RDX, 0);
+    emit_jmp32(jit->epilogue);
+}
+
+// Leave for the dispatcher if the store just invalidated code, or the
+// access hit a watchpoint. The block
+// was charged for all its instructions up front, so hand back the budget
+// for the ones that are skipped.
+static void JIT_CheckExitRequest(const RegisterMap *map, uint64_t next, uint32_t skipped)
+{
+    Jit *jit = machine->jit;
+    emit_mov_imm(RAX, (uint64_t)(uintptr_t)&jit->exitRequest);
+    emit8(0x80); emit8(0x38); emit8(0x00); // cmp byte [rax], 0
+    uint8_t *skip = emit_jcc32(0x4, jit->emitPtr); // je past the exit
+    if (skipped)
+    {
+        emit8(0x48); emit8(0x81); emit8(0x04); emit8(0x24); emit32(skipped); // add qword [rsp], skipped
+    }
+    JIT_Spill(map);
+    emit_mov_imm(RAX, next);
+    emit_mov_imm(RDX, 0);
+    emit_jmp32(jit->epilogue);
+    patch_rel32(skip + 2, jit->emitPtr);
+}
+
+static void JIT_PushValue(uint8_t host)
+{
+    emit_mov(RSI, host);
+    emit_mov(RDI, R14);
+    emit_call((uint64_t)(uintptr_t)&BUS_Write);
+    emit8(0x49); emit8(0x83); emit8(0xEE); emit8(0x08); // sub r14, 8
+}
+
+static void JIT_PopValue()
+{
+    emit8(0x49); emit8(0x83); emit8(0xC6); emit8(0x08); // add r14, 8
+    emit_mov(RDI, R14);
+    emit_call((uint64_t)(uintptr_t)&BUS_Read);
+}
+
+// Zero extending load of `size` bytes from [rax] into rax
+static void JIT_LoadHost(unsigned size)
+{
+    switch (size)
+    {
+    case 1:
+        emit8(0x0F); emit8(0xB6); emit8(0x00); // movzx eax, byte [rax]
+        break;
+    case 2:
+        emit8(0x0F); emit8(0xB7); emit8(0x00); // movzx eax, word [rax]
+        break;
+    case 4:
+        emit8(0x8B); emit8(0x00); // mov eax, [rax]
+        break;
+    default:
+        emit8(0x48); emit8(0x8B); emit8(0x00); // mov rax, [rax]
+        break;
+    }
+}
+
+static unsigned JIT_AccessSize(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_LD8:
+    case OP_ST8:
+        return 1;
+    case OP_LD16:
+    case OP_ST16:
+        return 2;
+    case OP_LD32:
+    case OP_ST32:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+// The bus accessor for a sized load or store
+static uint64_t JIT_AccessFunction(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_LD8:
+        return (uint64_t)(uintptr_t)&BUS_Read8;
+    case OP_LD16:
+        return (uint64_t)(uintptr_t)&BUS_Read16;
+    case OP_LD32:
+        return (uint64_t)(uintptr_t)&BUS_Read32;
+    case OP_LD64:
+        return (uint64_t)(uintptr_t)&BUS_Read;
+    case OP_ST8:
+        return (uint64_t)(uintptr_t)&BUS_Write8;
+    case OP_ST16:
+        return (uint64_t)(uintptr_t)&BUS_Write16;
+    case OP_ST32:
+        return (uint64_t)(uintptr_t)&BUS_Write32;
+    default:
+        return (uint64_t)(uintptr_t)&BUS_Write;
+    }
+}
+
+static void JIT_AllocateRegisters(const Instruction *code, int count, RegisterMap *map)
+{
+    uint32_t uses[64] = {0};
+    for (int i = 0; i < count; i++)
+    {
+        if ((code[i].srcMode == AM_REGISTER || code[i].srcMode == AM_INDIRECT) && code[i].srcOperand > 0 && code[i].srcOperand < 64)
+            uses[code[i].srcOperand]++;
+        if ((code[i].destMode == AM_REGISTER || code[i].destMode == AM_INDIRECT) && code[i].destOperand > 0 && code[i].destOperand < 64)
+            uses[code[i].destOperand]++;
+    }
+
+    memset(map, 0, sizeof(*map));
+    for (int slot = 0; slot < JIT_CACHED_REGISTERS; slot++)
+    {
+        int best = 0;
+        for (int reg = 1; reg < 64; reg++)
+        {
+            if (!map->host[reg] && uses[reg] > uses[best])
+                best = reg;
+        }
+        if (best == 0)
+            break;
+        map->host[best] = cachedHostRegisters[slot];
+    }
+}
+
+// next is the address of the following instruction, remaining the number
+// of instructions in the block after this one
+static void JIT_TranslateInstruction(const RegisterMap *map, JitBlock *block, const Instruction *in, uint64_t next, uint32_t remaining)
+{
+    Jit *jit = machine->jit;
+    jit->unretired = remaining + 1;
+
+    switch (in->opcode)
+    {
+    case OP_NOP:
+        break;
+    case OP_MOV:
+        JIT_Load(map, RAX, in->srcMode, in->srcOperand);
+        JIT_Store(map, in->destOperand, RAX);
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+        JIT_Load(map, RAX, in->srcMode, in->srcOperand);
+        JIT_Load(map, RCX, in->destMode, in->destOperand);
+        if (in->opcode == OP_ADD)
+            emit_rr(0x01, RAX, RCX); // add rcx, rax
+        else if (in->opcode == OP_SUB)
+            emit_rr(0x29, RAX, RCX); // sub rcx, rax
+        else
+        {
+            emit_rex(true, RCX, RAX); // imul rcx, rax
+            emit8(0x0F);
+            emit8(0xAF);
+            emit8(0xC0 | ((RCX & 7) << 3) | (RAX & 7));
+        }
+        JIT_Store(map, in->destOperand, RCX);
+        break;
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        JIT_Load(map, RAX, in->srcMode, in->srcOperand);
+        JIT_Load(map, RCX, in->destMode, in->destOperand);
+        emit_rr(in->opcode == OP_AND ? 0x21 : in->opcode == OP_OR ? 0x09 : 0x31, RAX, RCX); // op rcx, rax
+        JIT_Store(map, in->destOperand, RCX);
+        break;
+    case OP_NOT:
+        JIT_Load(map, RAX, in->destMode, in->destOperand);
+        emit8(0x48); emit8(0xF7); emit8(0xD0); // not rax
+        JIT_Store(map, in->destOperand, RAX);
+        break;
+    case OP_LSH:
+    case OP_RSH:
+        // x86 masks 64 bit shift counts to 6 bits, as the guest does
+        JIT_Load(map, RCX, in->srcMode, in->srcOperand);
+        JIT_Load(map, RAX, in->destMode, in->destOperand);
+        emit8(0x48); emit8(0xD3); emit8(in->opcode == OP_LSH ? 0xE0 : 0xE8); // shl/shr rax, cl
+        JIT_Store(map, in->destOperand, RAX);
+        break;
+    case OP_CMP:
+        JIT_Load(map, RAX, in->srcMode, in->srcOperand);
+        JIT_Load(map, RCX, in->destMode, in->destOperand);
+        emit8(0x45); emit8(0x31); emit8(0xFF); // xor r15d, r15d
+        emit_rr(0x39, RCX, RAX);               // cmp rax, rcx
+        emit8(0x41); emit8(0x0F); emit8(0x94); emit8(0xC7); // sete r15b
+        break;
+    case OP_PUSH:
+        JIT_Load(map, RAX, in->destMode, in->destOperand);
+        JIT_PushValue(RAX);
+        JIT_CheckExitRequest(map, next, remaining);
+        break;
+    case OP_POP:
+        JIT_PopValue();
+        JIT_Store(map, in->destOperand, RAX);
+        if (machine->gdb)
+            JIT_CheckExitRequest(map, next, remaining);
+        break;
+    case OP_LDR:
+        if (!machine->gdb && in->srcOperand >= RAM_START && in->srcOperand + sizeof(uint64_t) <= RAM_START + RAM_LowSize())
+        {
+            // Plain RAM, read it directly
+            emit_mov_imm(RAX, (uint64_t)(uintptr_t)&machine->ram[in->srcOperand - RAM_START]);
+            emit_mem(0x8B, RAX, RAX, 0);
+        }
+        else
+        {
+            emit_mov_imm(RDI, in->srcOperand);
+            emit_call((uint64_t)(uintptr_t)&BUS_Read);
+        }
+        JIT_Store(map, in->destOperand, RAX);
+        if (machine->gdb)
+            JIT_CheckExitRequest(map, next, remaining);
+        break;
+    case OP_STR:
+        // Stores always go through the bus so MMIO and code invalidation see them
+        JIT_Load(map, RSI, in->srcMode, in->srcOperand);
+        emit_mov_imm(RDI, in->destOperand);
+        emit_call((uint64_t)(uintptr_t)&BUS_Write);
+        JIT_CheckExitRequest(map, next, remaining);
+        break;
+    case OP_LD8:
+    case OP_LD16:
+    case OP_LD32:
+    case OP_LD64:
+    {
+        unsigned size = JIT_AccessSize(in->opcode);
+        if (!machine->gdb && in->srcMode == AM_DIRECT && in->srcOperand >= RAM_START && in->srcOperand + size <= RAM_START + RAM_LowSize())
+        {
+            // Plain RAM at a known address, as for ldr
+            emit_mov_imm(RAX, (uint64_t)(uintptr_t)&machine->ram[in->srcOperand - RAM_START]);
+            JIT_LoadHost(size);
+        }
+        else
+        {
+            if (in->srcMode == AM_DIRECT)
+                emit_mov_imm(RDI, in->srcOperand);
+            else
+                JIT_Load(map, RDI, AM_REGISTER, in->srcOperand);
+            emit_call(JIT_AccessFunction(in->opcode));
+        }
+        JIT_Store(map, in->destOperand, RAX);
+        if (machine->gdb)
+            JIT_CheckExitRequest(map, next, remaining);
+        break;
+    }
+    case OP_ST8:
+    case OP_ST16:
+    case OP_ST32:
+    case OP_ST64:
+        // Through the bus, like str
+        JIT_Load(map, RSI, in->srcMode, in->srcOperand);
+        if (in->destMode == AM_DIRECT)
+            emit_mov_imm(RDI, in->destOperand);
+        else
+            JIT_Load(map, RDI, AM_REGISTER, in->destOperand);
+        emit_call(JIT_AccessFunction(in->opcode));
+        JIT_CheckExitRequest(map, next, remaining);
+        break;
+    case OP_JMP:
+        JIT_ExitStatic(map, block, 0, in->destOperand);
+        break;
+    case OP_JEQ:
+    {
+        emit8(0x4D); emit8(0x85); emit8(0xFF); // test r15, r15
+        uint8_t *taken = emit_jcc32(0x5, jit->emitPtr); // jne
+        JIT_ExitStatic(map, block, 0, next);
+        patch_rel32(taken + 2, jit->emitPtr);
+        JIT_ExitStatic(map, block, 1, in->destOperand);
+        break;
+    }
+    case OP_CALL:
+        emit_mov_imm(RAX, next);
+        JIT_PushValue(RAX);
+        emit_mem(0x8B, RAX, RSP, 8); // ra = return address
+        emit_mov_imm(RCX, next);
+        emit_mem(0x89, RCX, RAX, (int32_t)offsetof(JitFrame, ra));
+        JIT_ExitStatic(map, block, 0, in->destOperand);
+        break;
+    case OP_RET:
+        JIT_PopValue();
+        emit_mem(0x8B, RCX, RSP, 8); // ra = 0
+        emit_mov_imm(RDX, 0);
+        emit_mem(0x89, RDX, RCX, (int32_t)offsetof(JitFrame, ra));
+        JIT_ExitDynamic(map);
+        break;
+    }
+}
+
+static void JIT_Flush()
+{
+    Jit *jit = machine->jit;
+    print_debug("flushing translation cache\n");
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->table, 0, sizeof(jit->table));
+    memset(jit->codePages, 0, sizeof(jit->codePages));
+    jit->blockCount = 0;
+    jit->emitPtr = jit->codeStart;
+}
+
+static JitBlock *JIT_Translate(uint64_t pc)
+{
+    Jit *jit = machine->jit;
+    Instruction code[JIT_BLOCK_MAX_INSTRUCTIONS];
+    uint64_t ends[JIT_BLOCK_MAX_INSTRUCTIONS]; // address after each instruction
+    uint64_t end = pc;
+    int count = 0;
+    bool terminated = false;
+
+    while (count < JIT_BLOCK_MAX_INSTRUCTIONS && !terminated)
+    {
+        bool terminator;
+        if (machine->gdb && GDB_IsBreakpoint(end))
+            break; // the interpreter stops there
+        uint8_t size = JIT_DecodeAt(end, &code[count]);
+        if (!size)
+            break;
+        if (!JIT_Translatable(&code[count], &terminator))
+            break;
+        terminated = terminator;
+        end += size;
+        ends[count++] = end;
+    }
+    if (count == 0)
+        return NULL;
+
+    if (jit->blockCount == JIT_MAX_BLOCKS || (size_t)(jit->buffer + JIT_BUFFER_SIZE - jit->emitPtr) < JIT_BLOCK_MAX_BYTES)
+        JIT_Flush();
+
+    JitBlock *block = &jit->blocks[jit->blockCount++];
+    memset(block, 0, sizeof(*block));
+    block->start = pc;
+    block->end = end;
+    block->code = jit->emitPtr;
+
+    RegisterMap map;
+    JIT_AllocateRegisters(code, count, &map);
+
+    // Not enough budget left for the whole block: let the interpreter step
+    emit8(0x48); emit8(0x81); emit8(0x3C); emit8(0x24); emit32((uint32_t)count); // cmp qword [rsp], count
+    uint8_t *enough = emit_jcc32(0xD, jit->emitPtr); // jge
+    emit_mov_imm(RAX, pc);
+    emit_mov_imm(RDX, 0);
+    emit_jmp32(jit->epilogue);
+    patch_rel32(enough + 2, jit->emitPtr);
+    emit8(0x48); emit8(0x81); emit8(0x2C); emit8(0x24); emit32((uint32_t)count); // sub qword [rsp], count
+
+    for (int reg = 1; reg < 64; reg++)
+    {
+        if (map.host[reg])
+            emit_mem(0x8B, map.host[reg], RBP, reg * 8);
+    }
+
+    for (int i = 0; i < count; i++)
+        JIT_TranslateInstruction(&map, block, &code[i], ends[i], (uint32_t)(count - i - 1));
+
+    if (!terminated)
+        JIT_ExitStatic(&map, block, 0, block->end);
+
+    block->valid = true;
+    jit->table[pc & (JIT_TABLE_SIZE - 1)] = block;
+
+    for (uint64_t page = block->start >> JIT_PAGE_SHIFT; page <= (block->end - 1) >> JIT_PAGE_SHIFT; page++)
+        jit->codePages[page] = 1;
+    BUS_TrapWrites(block->start, block->end - block->start);
+
+    print_debug("translated %d instructions at %lu into %ld bytes\n", count, pc, (long)(jit->emitPtr - block->code));
+    return block;
+}
+
+static JitBlock *JIT_Lookup(uint64_t pc)
+{
+    Jit *jit = machine->jit;
+    JitBlock *block = jit->table[pc & (JIT_TABLE_SIZE - 1)];
+    if (block && block->valid && block->start == pc)
+        return block;
+    return NULL;
+}
+
+void *JIT_GetBlock(uint64_t pc, uint8_t *link)
+{
+    Jit *jit = machine->jit;
+#ifdef PROFILE
+    // Translated code isn't instrumented, interpret so every instruction counts
+    return NULL;
+#endif
+    if (!jit->buffer)
+        return NULL;
+
+    JitBlock *block = JIT_Lookup(pc);
+    if (!block)
+    {
+        uint16_t *heat = &jit->hotness[pc & (JIT_TABLE_SIZE - 1)];
+        if (++*heat < JIT_HOT_THRESHOLD)
+            return NULL;
+        *heat = 0;
+        block = JIT_Translate(pc);
+        if (!block)
+            return NULL;
+    }
+
+    // Chain the exit we came from straight into this block. The site is
+    // only trusted if a live block still owns it, which also covers a
+    // flush in between.
+    if (link)
+    {
+        for (uint64_t i = 0; i < jit->blockCount; i++)
+        {
+            for (int slot = 0; slot < 2; slot++)
+            {
+                JitLink *l = &jit->blocks[i].links[slot];
+                if (jit->blocks[i].valid && l->site == link && l->target == pc)
+                {
+                    patch_rel32(link + 1, block->code);
+                    l->linked = true;
+                }
+            }
+        }
+    }
+    return block->code;
+}
+
+uint64_t JIT_Execute(void *code, uint64_t *registers, JitFrame *frame)
+{
+    Jit *jit = machine->jit;
+    jit->entryBudget = frame->budget;
+    JitEntry entry = __extension__(JitEntry) jit->buffer;
+    uint64_t pc = entry(code, registers, frame);
+    jit->stack = NULL;
+    return pc;
+}
+
+// A fault is unwinding translated code from inside a bus call: the
+// instructions it retired before the faulting one, 0 if none is running.
+// Blocks are charged for up front, so this is the budget spent minus what
+// the faulting block hasn't got to.
+uint64_t JIT_Unwind()
+{
+    Jit *jit = machine->jit;
+    if (!jit->stack)
+        return 0;
+    uint64_t retired = jit->entryBudget - (int64_t)jit->stack[0] - jit->stack[2];
+    jit->stack = NULL;
+    return retired;
+}
+
+// Drop the translations that overlap [address, address + size). Returns
+// true if there were any: they may be running, so the caller has to make
+// the CPU leave them (CPU_RequestExit).
+bool JIT_Invalidate(uint64_t address, uint64_t size)
+{
+    Jit *jit = machine->jit;
+    bool code = false;
+    for (uint64_t page = address >> JIT_PAGE_SHIFT; page <= (address + size - 1) >> JIT_PAGE_SHIFT && !code; page++)
+    {
+        if (page < sizeof(jit->codePages) && jit->codePages[page])
+            code = true;
+    }
+    if (!code)
+        return false;
+
+    bool any = false;
+    for (uint64_t i = 0; i < jit->blockCount; i++)
+    {
+        JitBlock *block = &jit->blocks[i];
+        if (block->valid && address < block->end && address + size > block->start)
+        {
+            print_debug("invalidating translation at %lu\n", block->start);
+            block->valid = false;
+            any = true;
+        }
+    }
+    if (!any)
+        return false;
+
+    // Unchain every exit that led into a block that is gone
+    for (uint64_t i = 0; i < jit->blockCount; i++)
+    {
+        for (int slot = 0; slot < 2; slot++)
+        {
+            JitLink *l = &jit->blocks[i].links[slot];
+            if (l->linked && !JIT_Lookup(l->target))
+            {
+                patch_rel32(l->site + 1, l->site + 5);
+                l->linked = false;
+            }
+        }
+    }
+    return true;
+}
+
+// Make running translated code return to the dispatcher after its next store
+void JIT_RequestExit()
+{
+    Jit *jit = machine->jit;
+    atomic_store(&jit->exitRequest, 1);
+}
+
+// CPU_Run returned, so every request to exit has been served
+void JIT_ClearExit()
+{
+    Jit *jit = machine->jit;
+    atomic_store_explicit(&jit->exitRequest, 0, memory_order_relaxed);
+}
+
+Jit *JIT_Create()
+{
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (!jit)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the pages that get code are ever backed
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (jit->buffer == MAP_FAILED)
+    {
+        print_error("could not map JIT code buffer, running interpreted\n");
+        jit->buffer = NULL;
+    }
+    return jit;
+}
+
+void JIT_Destroy(Jit *jit)
+{
+    if (jit->buffer)
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+void JIT_Init()
+{
+    Jit *jit = machine->jit;
+    if (!jit->buffer)
+        return;
+    jit->emitPtr = jit->buffer;
+    emit_trampolines();
+    JIT_Flush();
+}
+
+#else // !__x86_64__
+
+void *JIT_GetBlock(uint64_t pc, uint8_t *link)
+{
+    return NULL;
+}
+
+uint64_t JIT_Execute(void *code, uint64_t *registers, JitFrame *frame)
+{
+    return 0;
+}
+
+uint64_t JIT_Unwind()
+{
+    return 0;
+}
+
+bool JIT_Invalidate(uint64_t address, uint64_t size)
+{
+    return false;
+}
+
+void JIT_RequestExit()
+{
+}
+
+void JIT_ClearExit()
+{
+}
+
+Jit *JIT_Create()
+{
+    return NULL;
+}
+
+void JIT_Destroy(Jit *jit)
+{
+}
+
+void JIT_Init()
+{
+    print_info("JIT is only available on x86-64, running interpreted\n");
+}
+
+#endif // __x86_64__
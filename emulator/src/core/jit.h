@@ -0,0 +1,30 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Guest state that lives in host registers while translated code runs.
+// Filled in by the caller before JIT_Execute and written back on return.
+typedef struct
+{
+    uint64_t sp;   // guest stack pointer, kept in r14
+    uint64_t zero; // sr.zero, kept in r15
+    int64_t budget; // instructions the translated code may still retire
+    uint8_t *link; // exit site to chain to the next block, or NULL
+    uint64_t ra;   // return address register
+} JitFrame;
+
+typedef struct Jit Jit;
+
+Jit *JIT_Create();
+void JIT_Destroy(Jit *jit);
+void JIT_Init();
+void *JIT_GetBlock(uint64_t pc, uint8_t *link);
+uint64_t JIT_Execute(void *code, uint64_t *registers, JitFrame *frame);
+bool JIT_Invalidate(uint64_t address, uint64_t size);
+void JIT_RequestExit();
+void JIT_ClearExit();
+uint64_t JIT_Unwind();
+
+#endif // JIT_H
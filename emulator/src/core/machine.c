@@ -0,0 +1,281 @@
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "../common/common.h"
+#include "../memory/ram.h"
+#include "../memory/rom.h"
+#include "image.h"
+#include "machine.h"
+#include "smp.h"
+
+// Machine context
+//
+// A machine is created, loaded and run on one thread at a time. While it
+// runs, `machine` points at it, and the modules find their state there.
+// Guest faults don't exit the process: MACHINE_Abort marks the machine as
+// faulted and unwinds back to MACHINE_Run, leaving other machines in the
+// process alone. Machines with several CPUs run the others on threads of
+// their own, see smp.c.
+
+_Thread_local Machine *machine;
+_Thread_local int cpuId;
+
+// Armed while MACHINE_Run or MACHINE_RunSecondary is on the stack
+static _Thread_local jmp_buf *unwind;
+
+Machine *MACHINE_Create(const MachineConfig *config)
+{
+    Machine *m = calloc(1, sizeof(Machine));
+    if (!m)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    machine = m;
+
+    // The scheduler comes before the devices, which register events with
+    // it, and the devices before the bus, which maps them
+    m->ramSize = config->ramSize ? (config->ramSize + IMG_ALIGN - 1) & ~(uint64_t)(IMG_ALIGN - 1) : RAM_DEFAULT_SIZE;
+    if (m->ramSize > RAM_MAX_SIZE)
+    {
+        print_error("RAM size %lu exceeds the maximum of %lu\n", config->ramSize, (uint64_t)RAM_MAX_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    m->cpuCount = config->cpus ? config->cpus : 1;
+    if (m->cpuCount < 1 || m->cpuCount > MACHINE_MAX_CPUS)
+    {
+        print_error("Number of CPUs must be between 1 and %d\n", MACHINE_MAX_CPUS);
+        exit(EXIT_FAILURE);
+    }
+#if defined(CPU_JIT) || defined(PROFILE)
+    // one code cache and one profile per machine, filled by one thread
+    if (m->cpuCount > 1)
+    {
+        print_error("Machines with several CPUs need the interp or threaded core without PROFILE\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if ((config->record || config->replay) && m->cpuCount > 1)
+    {
+        // the other CPUs would read devices in an order of the host's choosing
+        print_error("Recording and replaying need a machine with one CPU\n");
+        exit(EXIT_FAILURE);
+    }
+    if (config->gdb && m->cpuCount > 1)
+    {
+        print_error("Debugging needs a machine with one CPU\n");
+        exit(EXIT_FAILURE);
+    }
+    m->ram = RAM_Create(m->ramSize);
+    m->rom = ROM_Create();
+    for (int i = 0; i < m->cpuCount; i++)
+    {
+        m->cpus[i] = CPU_Create();
+        m->intcs[i] = INT_Create(i);
+    }
+    if (m->cpuCount > 1)
+        m->smp = SMP_Create(m->cpuCount);
+    m->sched = SCHED_Create(config->quantum);
+    if (config->frequency)
+        m->clock = CL_Create(config->frequency);
+#ifdef CPU_JIT
+    m->jit = JIT_Create();
+#endif
+#ifdef PROFILE
+    m->profile = PROF_Create();
+#endif
+    m->fileout = FO_Create(config->fileout);
+    m->pty = PTY_Create(config->pty);
+    m->console = CON_Create(config->console);
+    m->pit = PIT_Create();
+    m->dma = DMA_Create();
+    if (config->video.width)
+        m->video = VID_Create(&config->video);
+    if (config->record || config->replay)
+        m->replay = REPLAY_Create(config->replay ? config->replay : config->record, config->replay != NULL);
+    if (config->gdb)
+        m->gdb = GDB_Create(config->gdb);
+    m->bus = BUS_Create();
+
+    BUS_Init();
+    CPU_Init();
+#ifdef CPU_JIT
+    JIT_Init();
+#endif
+    m->status = MACHINE_RUNNING;
+    return m;
+}
+
+// Pending fileout bytes and the profile, if any, are written out
+void MACHINE_Destroy(Machine *m)
+{
+    Machine *previous = machine;
+    machine = m;
+
+    // the secondary CPUs go first, they may be using everything else
+    if (m->smp)
+        SMP_Destroy(m->smp);
+    if (m->replay)
+        REPLAY_Destroy(m->replay);
+    if (m->gdb)
+        GDB_Destroy(m->gdb);
+#ifdef PROFILE
+    PROF_Destroy(m->profile);
+#endif
+    if (m->video)
+        VID_Destroy(m->video);
+    DMA_Destroy(m->dma);
+    PIT_Destroy(m->pit);
+    CON_Destroy(m->console);
+    PTY_Destroy(m->pty);
+    FO_Destroy(m->fileout);
+    BUS_Destroy(m->bus);
+#ifdef CPU_JIT
+    JIT_Destroy(m->jit);
+#endif
+    if (m->clock)
+        CL_Destroy(m->clock);
+    SCHED_Destroy(m->sched);
+    for (int i = 0; i < m->cpuCount; i++)
+    {
+        INT_Destroy(m->intcs[i]);
+        CPU_Destroy(m->cpus[i]);
+    }
+    ROM_Destroy(m->rom);
+    RAM_Destroy(m->ram, m->ramSize);
+    free(m);
+
+    machine = previous == m ? NULL : previous;
+}
+
+// Load a program image, see image.c. Only valid before the first
+// MACHINE_Run.
+bool MACHINE_Load(Machine *m, const char *path)
+{
+    machine = m;
+    if (!IMG_Load(path))
+        return false;
+#ifdef PROFILE
+    PROF_SetImage(m->profile, path);
+#endif
+    return true;
+}
+
+// MACHINE_Run, or MACHINE_Step if `step`
+static MachineStatus MACHINE_Enter(Machine *m, uint64_t cycles, bool step)
+{
+    jmp_buf here;
+
+    machine = m;
+    if (m->status != MACHINE_RUNNING)
+        return m->status;
+
+    SMP_Start();
+    REPLAY_Start();
+    unwind = &here;
+    if (setjmp(here) == 0)
+    {
+        uint64_t start = SCHED_Now();
+        if (step)
+            SCHED_Step();
+        while (m->status == MACHINE_RUNNING && SCHED_Now() - start < cycles && !(m->gdb && GDB_Stopped()))
+            SCHED_RunQuantum(cycles - (SCHED_Now() - start));
+    }
+    unwind = NULL;
+    return m->status;
+}
+
+// Run until exactly `cycles` cycles have been retired (the last quantum is
+// cut short), the machine stops, or the debugger has to take over. Returns
+// MACHINE_RUNNING if it is still good to go.
+MachineStatus MACHINE_Run(Machine *m, uint64_t cycles)
+{
+    return MACHINE_Enter(m, cycles, false);
+}
+
+// Run a single instruction, for debuggers, see gdb.c. A CPU waiting in
+// wfi waits up to the next event instead.
+MachineStatus MACHINE_Step(Machine *m)
+{
+    return MACHINE_Enter(m, 0, true);
+}
+
+// Body of the thread of secondary CPU `cpu`: run it from the image's entry
+// until it halts or the machine stops. There is no cycle budget; the
+// scheduler only counts CPU 0's cycles.
+void MACHINE_RunSecondary(Machine *m, int cpu)
+{
+    jmp_buf here;
+
+    machine = m;
+    cpuId = cpu;
+    unwind = &here;
+    if (setjmp(here) == 0)
+    {
+        CPU_InitSecondary();
+        while (m->status == MACHINE_RUNNING && !SMP_Stopping() && !CPU_Halted())
+        {
+            if (CPU_Waiting())
+                SMP_Sleep();
+            else
+                CPU_Run(SCHED_DEFAULT_QUANTUM);
+        }
+    }
+    unwind = NULL;
+}
+
+// Counters for the harness, valid while the machine isn't running
+void MACHINE_GetStats(Machine *m, MachineStats *stats)
+{
+    machine = m;
+    *stats = (MachineStats){.cycles = SCHED_Now()};
+    for (int i = 0; i < m->cpuCount; i++)
+        stats->instructions += CPU_Retired(i);
+    CpuState state;
+    CPU_GetState(&state);
+    stats->exitValue = state.registers[1];
+    PTY_GetTraffic(&stats->ptyIn, &stats->ptyOut);
+    CON_GetTraffic(&stats->consoleIn, &stats->consoleOut);
+    stats->fileoutOut = FO_BytesOut();
+    stats->videoFrames = m->video ? VID_Frames() : 0;
+    RAM_GetStats(&stats->ram);
+}
+
+// Make the other CPUs notice that the machine stopped
+static void MACHINE_KickOthers()
+{
+    for (int i = 0; i < machine->cpuCount; i++)
+    {
+        if (i != cpuId)
+            CPU_Kick(i);
+    }
+}
+
+// CPU 0 halted; CPU_Run returns after the current instruction, on every CPU
+void MACHINE_Halt()
+{
+    machine->status = MACHINE_HALTED;
+    MACHINE_KickOthers();
+}
+
+// The guest faulted. Gives up on the running machine, or on the process
+// if the fault happens outside MACHINE_Run. What the CPU retired before
+// the fault still counts, for the reports.
+_Noreturn void MACHINE_Abort()
+{
+    machine->status = MACHINE_FAULTED;
+    SMP_Abandon();
+    MACHINE_KickOthers();
+    if (unwind)
+    {
+        uint64_t executed = CPU_Unwind();
+        if (cpuId == 0)
+            SCHED_Unwind(executed);
+        longjmp(*unwind, 1);
+    }
+    exit(EXIT_FAILURE);
+}
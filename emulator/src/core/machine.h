@@ -0,0 +1,108 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../devices/console.h"
+#include "../devices/dma.h"
+#include "../devices/fileout.h"
+#include "../devices/pit.h"
+#include "../devices/pty.h"
+#include "../devices/video.h"
+#include "../memory/ram.h"
+#include "bus.h"
+#include "clock.h"
+#include "cpu.h"
+#include "gdb.h"
+#include "interrupts.h"
+#include "jit.h"
+#include "profile.h"
+#include "replay.h"
+#include "sched.h"
+#include "smp.h"
+
+#define MACHINE_MAX_CPUS 64
+
+typedef enum
+{
+    MACHINE_RUNNING,
+    MACHINE_HALTED,  // the guest executed hlt
+    MACHINE_FAULTED, // the guest did something the emulator can't carry on from
+} MachineStatus;
+
+typedef struct
+{
+    const char *fileout; // file the fileout device appends to, NULL for the default
+    bool pty;            // expose the PTY device on a host pseudoterminal
+    bool console;        // expose the console device on the host FIFOs
+    uint64_t frequency;  // throttle to this many cycles per second, 0 to run flat out
+    uint64_t quantum;    // scheduler quantum, 0 for the default
+    uint64_t ramSize;    // bytes of guest RAM, 0 for RAM_DEFAULT_SIZE
+    int cpus;            // CPUs sharing the machine, 0 for 1, see smp.c
+    const char *record;  // log host input to this file, see replay.c
+    const char *replay;  // take host input from this log instead
+    const char *gdb;     // wait for a debugger on this port or socket, see gdb.c
+    VideoConfig video;   // framebuffer, none unless video.width is set
+} MachineConfig;
+
+// Everything one emulated machine owns. Module code reaches its own part
+// through the `machine` of the calling thread rather than through globals,
+// so a process can host any number of machines, one per thread at a time.
+typedef struct
+{
+    Cpu *cpus[MACHINE_MAX_CPUS]; // cpus[0] runs the scheduler and the devices
+    Intc *intcs[MACHINE_MAX_CPUS]; // one per CPU, devices raise lines on intcs[0]
+    int cpuCount;
+    Smp *smp; // NULL unless cpuCount > 1
+    Bus *bus;
+    Sched *sched;
+    Clock *clock; // NULL unless the machine runs in real time
+    Jit *jit; // NULL unless built with CPU_JIT
+    Profile *profile; // NULL unless built with PROFILE
+    Replay *replay; // NULL unless recording or replaying
+    Gdb *gdb; // NULL unless a debugger is attached
+    uint8_t *ram;
+    uint64_t ramSize;
+    uint8_t *rom;
+    FileOut *fileout;
+    Pty *pty;
+    Console *console;
+    Pit *pit;
+    Dma *dma;
+    Video *video; // NULL unless the machine has a framebuffer
+
+    _Atomic MachineStatus status;
+} Machine;
+
+// What a machine did so far, for reports
+typedef struct
+{
+    uint64_t cycles;       // scheduler cycles, idle ones included
+    uint64_t instructions; // retired by all CPUs
+    uint64_t exitValue;    // r1 of CPU 0, what a guest that halted hands back
+    uint64_t ptyIn, ptyOut; // bytes the guest received and sent over each device
+    uint64_t consoleIn, consoleOut;
+    uint64_t fileoutOut;
+    uint64_t videoFrames; // frames the framebuffer exported
+    RamStats ram;
+} MachineStats;
+
+// The machine the calling thread is running or setting up
+extern _Thread_local Machine *machine;
+
+// Which of its CPUs the calling thread runs: 0 except on the threads of
+// secondary CPUs, see smp.c
+extern _Thread_local int cpuId;
+
+Machine *MACHINE_Create(const MachineConfig *config);
+void MACHINE_Destroy(Machine *m);
+bool MACHINE_Load(Machine *m, const char *path);
+MachineStatus MACHINE_Run(Machine *m, uint64_t cycles);
+MachineStatus MACHINE_Step(Machine *m);
+void MACHINE_RunSecondary(Machine *m, int cpu);
+void MACHINE_GetStats(Machine *m, MachineStats *stats);
+void MACHINE_Halt();
+_Noreturn void MACHINE_Abort();
+
+#endif // MACHINE_H
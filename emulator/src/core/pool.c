@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../common/common.h"
+#include "pool.h"
+
+// Batch runner
+//
+// Runs independent guest programs on a fixed set of worker threads. Each
+// worker takes the next job, builds a fresh machine for it, runs it to
+// completion and tears it down again, so the process and its threads are
+// only started once for the whole batch.
+
+typedef struct
+{
+    PoolJob *jobs;
+    int count;
+    atomic_int next;
+    const MachineConfig *config;
+} Pool;
+
+static void POOL_RunJob(PoolJob *job, const MachineConfig *config)
+{
+    MachineConfig jobConfig = *config;
+    jobConfig.fileout = job->fileout;
+
+    Machine *m = MACHINE_Create(&jobConfig);
+    if (!MACHINE_Load(m, job->image))
+    {
+        job->status = MACHINE_FAULTED;
+        MACHINE_GetStats(m, &job->stats);
+        MACHINE_Destroy(m);
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job->status = MACHINE_Run(m, job->maxCycles ? job->maxCycles : UINT64_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    MACHINE_GetStats(m, &job->stats);
+    print_debug("%s: status %d after %lu cycles\n", job->image, job->status, job->stats.cycles);
+    MACHINE_Destroy(m);
+}
+
+static void *POOL_Worker(void *arg)
+{
+    Pool *pool = arg;
+    int index;
+
+    while ((index = atomic_fetch_add(&pool->next, 1)) < pool->count)
+        POOL_RunJob(&pool->jobs[index], pool->config);
+    return NULL;
+}
+
+// Run every job, `threads` machines at a time, and return once all of
+// them are done
+void POOL_Run(PoolJob *jobs, int count, int threads, const MachineConfig *config)
+{
+    Pool pool = {.jobs = jobs, .count = count, .config = config};
+    atomic_init(&pool.next, 0);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > count)
+        threads = count;
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (!workers)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        if (pthread_create(&workers[started], NULL, POOL_Worker, &pool) != 0)
+            break;
+    }
+    if (started == 0)
+        POOL_Worker(&pool); // no threads to be had, run them here
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+}
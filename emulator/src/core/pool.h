@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include "machine.h"
+
+typedef struct
+{
+    const char *image;   // program loaded at RAM_START
+    const char *fileout; // file its fileout device appends to
+    uint64_t maxCycles;  // give up after this many cycles, 0 for no limit
+
+    // filled in by POOL_Run
+    MachineStatus status; // MACHINE_RUNNING if it ran out of cycles
+    MachineStats stats;   // when it stopped
+    double seconds;       // wall time MACHINE_Run took
+} PoolJob;
+
+void POOL_Run(PoolJob *jobs, int count, int threads, const MachineConfig *config);
+
+#endif // POOL_H
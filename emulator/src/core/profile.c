@@ -0,0 +1,519 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "../common/isa.h"
+#include "../memory/ram.h"
+#include "bus.h"
+#include "cpu.h"
+#include "machine.h"
+#include "profile.h"
+#include "sched.h"
+
+#ifdef PROFILE
+
+// Reports are written when the machine is destroyed, next to the image:
+//   <image>.folded  collapsed stacks, samples per call context
+//   <image>.prof    instruction counts per opcode, hottest instructions,
+//                   hottest instruction pairs and triples (candidates for
+//                   fusion) and bus accesses per device
+// Addresses are named after the assembler labels in the symbol table of
+// the image (tasm -i), or else in <image>.sym (tasm -s) if there is one.
+
+#define PROF_DEFAULT_OUTPUT "tisc"
+#define PROF_HOT_INSTRUCTIONS 20
+#define PROF_HOT_SEQUENCES 10
+
+typedef struct
+{
+    uint64_t address;
+    char *name;
+} ProfileSymbol;
+
+typedef struct ProfileNode
+{
+    uint64_t target;  // call target, the entry point for the root
+    uint64_t samples; // taken in this context, callees excluded
+    struct ProfileNode *parent;
+    struct ProfileNode *child;   // first callee
+    struct ProfileNode *sibling; // next callee of the parent
+} ProfileNode;
+
+// Per machine profile, reached through machine->profile
+struct Profile
+{
+    uint64_t *pcCounts;  // one per byte of low RAM, where instructions may start
+    uint64_t pcLimit;    // bytes of low RAM
+    uint64_t otherCount; // instructions retired outside low RAM
+    uint64_t opcodeCounts[256];
+
+    ProfileNode root;
+    ProfileNode *node; // current call context
+    int depth;
+    int overflow; // calls below PROF_MAX_DEPTH still to be returned from
+    int event;    // scheduler event that takes the samples
+    uint64_t random; // xorshift state for the sample intervals
+
+    char *output; // file name prefix of the reports
+    ProfileSymbol *symbols;
+    int symbolCount;
+};
+
+static const char *opcodeNames[256] = {
+    [OP_NOP] = "nop",
+    [OP_MOV] = "mov",
+    [OP_PUSH] = "push",
+    [OP_POP] = "pop",
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_AND] = "and",
+    [OP_OR] = "or",
+    [OP_XOR] = "xor",
+    [OP_NOT] = "not",
+    [OP_LSH] = "lsh",
+    [OP_RSH] = "rsh",
+    [OP_JMP] = "jmp",
+    [OP_CMP] = "cmp",
+    [OP_JEQ] = "jeq",
+    [OP_CALL] = "call",
+    [OP_RET] = "ret",
+    [OP_IRET] = "iret",
+    [OP_LDR] = "ldr",
+    [OP_STR] = "str",
+    [OP_LD8] = "ld8",
+    [OP_LD16] = "ld16",
+    [OP_LD32] = "ld32",
+    [OP_LD64] = "ld64",
+    [OP_ST8] = "st8",
+    [OP_ST16] = "st16",
+    [OP_ST32] = "st32",
+    [OP_ST64] = "st64",
+    [OP_CAS] = "cas",
+    [OP_FADD] = "fadd",
+    [OP_FENCE] = "fence",
+    [OP_WFI] = "wfi",
+    [OP_RST] = "rst",
+    [OP_HLT] = "hlt",
+};
+
+// Sample intervals are jittered around PROF_SAMPLE_CYCLES so that they
+// don't lock onto the period of a guest loop
+static uint64_t PROF_NextInterval(Profile *profile)
+{
+    profile->random ^= profile->random << 13;
+    profile->random ^= profile->random >> 7;
+    profile->random ^= profile->random << 17;
+    return PROF_SAMPLE_CYCLES / 2 + profile->random % PROF_SAMPLE_CYCLES;
+}
+
+static void PROF_Sample(void *opaque)
+{
+    Profile *profile = opaque;
+    profile->node->samples++;
+    SCHED_ScheduleIn(profile->event, PROF_NextInterval(profile));
+}
+
+// The scheduler and RAM have to exist already
+Profile *PROF_Create()
+{
+    Profile *profile = calloc(1, sizeof(Profile));
+    if (!profile || !(profile->pcCounts = calloc(RAM_LowSize(), sizeof(uint64_t))))
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    profile->pcLimit = RAM_LowSize();
+    profile->root.target = RAM_START;
+    profile->node = &profile->root;
+    profile->random = 0x9e3779b97f4a7c15;
+    profile->event = SCHED_Register("profile", &PROF_Sample, profile);
+    SCHED_ScheduleIn(profile->event, PROF_NextInterval(profile));
+    return profile;
+}
+
+static int PROF_CompareSymbols(const void *a, const void *b)
+{
+    const ProfileSymbol *x = a, *y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+// Lines of "<hex address> <label>", from a .sym file or the symbol table
+// of an image
+void PROF_AddSymbols(Profile *profile, FILE *file)
+{
+    char line[256];
+    int capacity = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[200];
+        unsigned long long address;
+        if (sscanf(line, "%llx %199s", &address, name) != 2)
+            continue;
+
+        if (profile->symbolCount == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            ProfileSymbol *symbols = realloc(profile->symbols, capacity * sizeof(ProfileSymbol));
+            if (!symbols)
+            {
+                print_error("Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            profile->symbols = symbols;
+        }
+        profile->symbols[profile->symbolCount++] = (ProfileSymbol){.address = address, .name = strdup(name)};
+    }
+
+    qsort(profile->symbols, profile->symbolCount, sizeof(ProfileSymbol), &PROF_CompareSymbols);
+    print_debug("%d symbols\n", profile->symbolCount);
+}
+
+static void PROF_LoadSymbols(Profile *profile, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return;
+    PROF_AddSymbols(profile, file);
+    fclose(file);
+}
+
+// Name the reports after the image and pick up its symbols, unless the
+// image carried its own
+void PROF_SetImage(Profile *profile, const char *path)
+{
+    size_t size = strlen(path) + sizeof(".sym");
+    char *symbolPath = malloc(size);
+    free(profile->output);
+    profile->output = strdup(path);
+    if (!symbolPath || !profile->output)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(symbolPath, size, "%s.sym", path);
+    if (profile->symbolCount == 0)
+        PROF_LoadSymbols(profile, symbolPath);
+    free(symbolPath);
+}
+
+// Add `count` executions of the instruction at pc
+void PROF_Count(Profile *profile, uint64_t pc, uint8_t opcode, uint64_t count)
+{
+    if (pc < profile->pcLimit)
+        profile->pcCounts[pc] += count;
+    else
+        profile->otherCount += count;
+    profile->opcodeCounts[opcode] += count;
+}
+
+void PROF_Call(Profile *profile, uint64_t target)
+{
+    if (profile->depth == PROF_MAX_DEPTH)
+    {
+        profile->overflow++;
+        return;
+    }
+
+    ProfileNode *node = profile->node->child;
+    while (node && node->target != target)
+        node = node->sibling;
+    if (!node)
+    {
+        node = calloc(1, sizeof(ProfileNode));
+        if (!node)
+        {
+            print_error("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        node->target = target;
+        node->parent = profile->node;
+        node->sibling = profile->node->child;
+        profile->node->child = node;
+    }
+    profile->node = node;
+    profile->depth++;
+}
+
+// A ret without a matching call (e.g. the guest unwinding its own stack)
+// stays in the root context
+void PROF_Return(Profile *profile)
+{
+    if (profile->overflow)
+        profile->overflow--;
+    else if (profile->node->parent)
+    {
+        profile->node = profile->node->parent;
+        profile->depth--;
+    }
+}
+
+// label, label+0x10 or the bare address
+static void PROF_Symbolize(const Profile *profile, uint64_t address, char *buf, size_t size)
+{
+    int low = 0, high = profile->symbolCount - 1, found = -1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (profile->symbols[mid].address <= address)
+        {
+            found = mid;
+            low = mid + 1;
+        }
+        else
+            high = mid - 1;
+    }
+
+    if (found == -1)
+        snprintf(buf, size, "0x%lx", address);
+    else if (profile->symbols[found].address == address)
+        snprintf(buf, size, "%s", profile->symbols[found].name);
+    else
+        snprintf(buf, size, "%s+0x%lx", profile->symbols[found].name, address - profile->symbols[found].address);
+}
+
+// stack holds the names of the callers, separated by ';'
+static void PROF_WriteStacks(const Profile *profile, FILE *out, const ProfileNode *node, char *stack, size_t size)
+{
+    size_t start = strlen(stack);
+    char name[256];
+    PROF_Symbolize(profile, node->target, name, sizeof(name));
+    snprintf(stack + start, size - start, "%s%s", start ? ";" : "", name);
+
+    if (node->samples)
+        fprintf(out, "%s %lu\n", stack, node->samples);
+    for (const ProfileNode *child = node->child; child; child = child->sibling)
+        PROF_WriteStacks(profile, out, child, stack, size);
+    stack[start] = '\0';
+}
+
+static int PROF_CompareCounts(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+    return (x[0] < y[0]) - (x[0] > y[0]);
+}
+
+static int PROF_CompareKeys(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+    return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+// Whether the next instruction in memory always runs right after this one
+static bool PROF_FallsThrough(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_JMP:
+    case OP_JEQ:
+    case OP_CALL:
+    case OP_RET:
+    case OP_IRET:
+    case OP_RST:
+    case OP_HLT:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Write the most executed sequences of `length` adjacent instructions.
+// Every execution of an instruction that falls through is followed by the
+// next one, so a sequence runs as often as its first instruction.
+static void PROF_WriteSequences(const Profile *profile, FILE *out, int length, uint64_t total)
+{
+    size_t executed = 0;
+    for (uint64_t pc = 0; pc < profile->pcLimit; pc++)
+        executed += profile->pcCounts[pc] != 0;
+
+    // {count, opcodes} pairs, one per instruction that starts the sequence
+    uint64_t (*sequences)[2] = malloc((executed + 1) * sizeof(*sequences));
+    if (!sequences)
+        return;
+
+    size_t count = 0;
+    for (uint64_t pc = 0; pc < profile->pcLimit; pc++)
+    {
+        if (!profile->pcCounts[pc])
+            continue;
+
+        uint64_t key = 0;
+        uint64_t next = pc;
+        int i = 0;
+        for (; i < length && next + INSTRUCTION_WIDTH <= profile->pcLimit; i++)
+        {
+            Instruction in;
+            next += ISA_Decode(&machine->ram[next], CPU_GetEncoding(), &in);
+            if (i < length - 1 && !PROF_FallsThrough(in.opcode))
+                break;
+            key = key << 8 | in.opcode;
+        }
+        if (i < length)
+            continue;
+
+        sequences[count][0] = profile->pcCounts[pc];
+        sequences[count][1] = key;
+        count++;
+    }
+
+    // Add up the counts of equal sequences, then put the hottest first
+    qsort(sequences, count, sizeof(sequences[0]), &PROF_CompareKeys);
+    size_t merged = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (merged && sequences[merged - 1][1] == sequences[i][1])
+            sequences[merged - 1][0] += sequences[i][0];
+        else
+        {
+            sequences[merged][0] = sequences[i][0];
+            sequences[merged][1] = sequences[i][1];
+            merged++;
+        }
+    }
+    count = merged;
+    qsort(sequences, count, sizeof(sequences[0]), &PROF_CompareCounts);
+
+    fprintf(out, "\nhottest %s:\n", length == 2 ? "pairs" : "triples");
+    for (size_t i = 0; i < count && i < PROF_HOT_SEQUENCES; i++)
+    {
+        fprintf(out, "%14lu %6.2f%% ", sequences[i][0], 100.0 * sequences[i][0] / total);
+        for (int j = length - 1; j >= 0; j--)
+        {
+            const char *name = opcodeNames[sequences[i][1] >> (8 * j) & 0xff];
+            fprintf(out, " %s", name ? name : "?");
+        }
+        fprintf(out, "\n");
+    }
+    free(sequences);
+}
+
+static void PROF_WriteReport(const Profile *profile, FILE *out)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++)
+        total += profile->opcodeCounts[i];
+    fprintf(out, "instructions: %lu\n", total);
+    if (total == 0)
+        return;
+
+    // {count, opcode} pairs, hottest first
+    uint64_t opcodes[256][2];
+    for (int i = 0; i < 256; i++)
+    {
+        opcodes[i][0] = profile->opcodeCounts[i];
+        opcodes[i][1] = i;
+    }
+    qsort(opcodes, 256, sizeof(opcodes[0]), &PROF_CompareCounts);
+
+    fprintf(out, "\nper opcode:\n");
+    for (int i = 0; i < 256 && opcodes[i][0]; i++)
+    {
+        const char *name = opcodeNames[opcodes[i][1]];
+        fprintf(out, "%14lu %6.2f%%  ", opcodes[i][0], 100.0 * opcodes[i][0] / total);
+        if (name)
+            fprintf(out, "%s\n", name);
+        else
+            fprintf(out, "? (0x%02lx)\n", opcodes[i][1]);
+    }
+
+    // Keep the hottest PROF_HOT_INSTRUCTIONS {count, pc} pairs by insertion
+    uint64_t hot[PROF_HOT_INSTRUCTIONS][2] = {{0}};
+    for (uint64_t pc = 0; pc < profile->pcLimit; pc++)
+    {
+        uint64_t count = profile->pcCounts[pc];
+        if (count <= hot[PROF_HOT_INSTRUCTIONS - 1][0])
+            continue;
+        int i = PROF_HOT_INSTRUCTIONS - 1;
+        for (; i > 0 && hot[i - 1][0] < count; i--)
+        {
+            hot[i][0] = hot[i - 1][0];
+            hot[i][1] = hot[i - 1][1];
+        }
+        hot[i][0] = count;
+        hot[i][1] = pc;
+    }
+
+    fprintf(out, "\nhottest instructions:\n");
+    for (int i = 0; i < PROF_HOT_INSTRUCTIONS && hot[i][0]; i++)
+    {
+        char name[256];
+        uint64_t pc = hot[i][1];
+        const char *mnemonic = opcodeNames[machine->ram[pc]]; // the first byte in either encoding
+        PROF_Symbolize(profile, pc, name, sizeof(name));
+        fprintf(out, "%14lu %6.2f%%  0x%08lx  %-24s %s\n", hot[i][0], 100.0 * hot[i][0] / total, pc, name, mnemonic ? mnemonic : "?");
+    }
+    if (profile->otherCount)
+        fprintf(out, "%14lu %6.2f%%  outside low RAM\n", profile->otherCount, 100.0 * profile->otherCount / total);
+
+    PROF_WriteSequences(profile, out, 2, total);
+    PROF_WriteSequences(profile, out, 3, total);
+
+    fprintf(out, "\nbus accesses:\n");
+    BUS_WriteProfile(out);
+}
+
+static void PROF_WriteFile(const Profile *profile, const char *suffix, bool stacks)
+{
+    const char *prefix = profile->output ? profile->output : PROF_DEFAULT_OUTPUT;
+    size_t size = strlen(prefix) + strlen(suffix) + 1;
+    char *path = malloc(size);
+    if (!path)
+        return;
+    snprintf(path, size, "%s%s", prefix, suffix);
+
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        print_error("Can't write %s\n", path);
+        free(path);
+        return;
+    }
+
+    if (stacks)
+    {
+        char stack[8192] = "";
+        PROF_WriteStacks(profile, out, &profile->root, stack, sizeof(stack));
+    }
+    else
+        PROF_WriteReport(profile, out);
+
+    fclose(out);
+    print_info("profile written to %s\n", path);
+    free(path);
+}
+
+static void PROF_FreeNodes(ProfileNode *node)
+{
+    while (node)
+    {
+        ProfileNode *sibling = node->sibling;
+        PROF_FreeNodes(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Writes the reports. Needs the machine's CPU, RAM and bus to still be
+// there.
+void PROF_Destroy(Profile *profile)
+{
+    CPU_FlushProfile();
+    PROF_WriteFile(profile, ".folded", true);
+    PROF_WriteFile(profile, ".prof", false);
+
+    PROF_FreeNodes(profile->root.child);
+    for (int i = 0; i < profile->symbolCount; i++)
+        free(profile->symbols[i].name);
+    free(profile->symbols);
+    free(profile->output);
+    free(profile->pcCounts);
+    free(profile);
+}
+
+#endif // PROFILE
@@ -0,0 +1,28 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Guest profiler, only built with -DPROFILE
+//
+// Instructions are counted exactly, per PC and per opcode, by the decode
+// cache entries that execute them. Call contexts form a trie that follows
+// call and ret, and the current context is sampled about every
+// PROF_SAMPLE_CYCLES cycles, so the samples can be written out as
+// collapsed stacks for flamegraph tools.
+
+#define PROF_SAMPLE_CYCLES 1000
+#define PROF_MAX_DEPTH 256 // deeper calls are sampled in the deepest context
+
+typedef struct Profile Profile;
+
+Profile *PROF_Create();
+void PROF_Destroy(Profile *profile);
+void PROF_SetImage(Profile *profile, const char *path);
+void PROF_AddSymbols(Profile *profile, FILE *file);
+void PROF_Count(Profile *profile, uint64_t pc, uint8_t opcode, uint64_t count);
+void PROF_Call(Profile *profile, uint64_t target);
+void PROF_Return(Profile *profile);
+
+#endif // PROFILE_H
@@ -0,0 +1,349 @@
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "bus.h"
+#include "clock.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "machine.h"
+#include "replay.h"
+#include "sched.h"
+
+// Record and replay
+//
+// Everything a machine with one CPU does follows from its image and its
+// cycle count, except for what comes in from the host: bytes arriving on
+// the PTY or the console FIFO, when the guest reads the device registers
+// that show them, and the interrupts the I/O thread raises for them.
+// Recording writes those to an append-only log; replaying feeds them back
+// from the log, with no PTY or FIFO attached and flat out, so that the
+// guest retires exactly the same instructions.
+//
+// Device reads are replayed in order: a guest that runs the same
+// instructions reads the same registers in the same order, so they need
+// no cycle count. Interrupts from the I/O thread are different, since
+// they could land on any instruction. While recording they are held back
+// until the end of the running quantum (the I/O thread cuts it short),
+// raised there and logged with that cycle count. Replaying, a scheduler
+// event ends a quantum at exactly that cycle and raises them again. When
+// to end a quantum is otherwise up to the host, but nothing the guest
+// sees depends on it.
+//
+// The log starts with REPLAY_MAGIC and holds records of a tag byte and
+// one or two LEB128 numbers:
+//   REPLAY_INPUT     value returned by a device read
+//   REPLAY_REPEAT    count: the last value was read that many more times
+//   REPLAY_INTERRUPT cycles since the previous interrupt, mask of lines
+//   REPLAY_END       cycles since the previous interrupt when recording
+//                    stopped
+// Polling a status register that doesn't change costs a few bytes per run
+// of reads, not per read. Cycle counts are those of the scheduler, so a
+// recording that starts from a snapshot replays from the same snapshot.
+
+#define REPLAY_MAGIC "TISCRPL1"
+#define REPLAY_MAGIC_WIDTH 8
+
+enum
+{
+    REPLAY_INPUT = 1,
+    REPLAY_REPEAT,
+    REPLAY_INTERRUPT,
+    REPLAY_END,
+};
+
+// Per machine state, reached through machine->replay
+struct Replay
+{
+    const char *path;
+    bool replaying;
+
+    // recording
+    FILE *file;
+    _Atomic uint64_t pending; // lines the I/O thread raised this quantum
+    uint64_t lastInput;
+    uint64_t repeats; // reads of lastInput not written out yet
+    bool haveInput;
+
+    // replaying
+    uint8_t *log;
+    size_t size;
+    size_t inputAt;     // next record to look at for device reads
+    size_t interruptAt; // and for interrupts
+    uint64_t inputRepeats;
+    int event;
+    bool started;
+    uint64_t nextLines; // raised at nextCycle, 0 for no more interrupts
+    uint64_t endCycle;  // valid if ended
+    bool ended;
+
+    uint64_t cycle; // of the last interrupt record written or read
+};
+
+static void REPLAY_Service(void *opaque);
+
+static void REPLAY_PutNumber(FILE *file, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        putc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    putc((int)value, file);
+}
+
+static bool REPLAY_GetNumber(const Replay *replay, size_t *at, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64 && *at < replay->size; shift += 7)
+    {
+        uint8_t byte = replay->log[(*at)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Read the record at `at` and move past it. False at the end of the log,
+// or of what a recording that didn't finish wrote of it.
+static bool REPLAY_Get(const Replay *replay, size_t *at, uint8_t *tag, uint64_t *first, uint64_t *second)
+{
+    if (*at >= replay->size)
+        return false;
+    *tag = replay->log[(*at)++];
+    *second = 0;
+    if (!REPLAY_GetNumber(replay, at, first))
+        return false;
+    return *tag != REPLAY_INTERRUPT || REPLAY_GetNumber(replay, at, second);
+}
+
+static bool REPLAY_ReadLog(Replay *replay)
+{
+    FILE *file = fopen(replay->path, "rb");
+    if (!file)
+        return false;
+    char magic[REPLAY_MAGIC_WIDTH];
+    bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, REPLAY_MAGIC, sizeof(magic)) == 0 &&
+              fseek(file, 0, SEEK_END) == 0;
+    long size = ok ? ftell(file) : -1;
+    if (size > 0)
+    {
+        replay->size = size - REPLAY_MAGIC_WIDTH;
+        replay->log = malloc(replay->size + 1);
+        if (!replay->log)
+        {
+            print_error("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        ok = fseek(file, REPLAY_MAGIC_WIDTH, SEEK_SET) == 0 && fread(replay->log, 1, replay->size, file) == replay->size;
+    }
+    fclose(file);
+    return ok && size > 0;
+}
+
+// Record into the log at `path`, or replay it. The scheduler has to exist
+// already.
+Replay *REPLAY_Create(const char *path, bool replaying)
+{
+    Replay *replay = calloc(1, sizeof(Replay));
+    if (!replay)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    replay->path = path;
+    replay->replaying = replaying;
+    atomic_init(&replay->pending, 0);
+
+    if (replaying)
+    {
+        if (!REPLAY_ReadLog(replay))
+        {
+            print_error("Can't read replay log %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        replay->event = SCHED_Register("replay", &REPLAY_Service, replay);
+        return replay;
+    }
+
+    replay->file = fopen(path, "wb");
+    if (!replay->file)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(REPLAY_MAGIC, 1, REPLAY_MAGIC_WIDTH, replay->file);
+    return replay;
+}
+
+static void REPLAY_FlushRepeats(Replay *replay)
+{
+    if (replay->repeats == 0)
+        return;
+    putc(REPLAY_REPEAT, replay->file);
+    REPLAY_PutNumber(replay->file, replay->repeats);
+    replay->repeats = 0;
+}
+
+// Finish the log, or check that the replay ended where the recording did
+void REPLAY_Destroy(Replay *replay)
+{
+    uint64_t now = SCHED_Now();
+    if (replay->replaying)
+    {
+        if (!replay->ended)
+            print_info("Replay log %s stops early, at cycle %lu, the recording didn't finish\n", replay->path, now);
+        else if (now != replay->endCycle)
+            print_error("Replay diverged: stopped at cycle %lu, the recording at cycle %lu\n", now, replay->endCycle);
+        free(replay->log);
+    }
+    else
+    {
+        REPLAY_FlushRepeats(replay);
+        putc(REPLAY_END, replay->file);
+        REPLAY_PutNumber(replay->file, now - replay->cycle);
+        if (fclose(replay->file) != 0)
+            print_error("Failed to write replay log %s\n", replay->path);
+    }
+    free(replay);
+}
+
+// Find the next interrupt record, or the end of the log
+static void REPLAY_NextInterrupt(Replay *replay)
+{
+    uint8_t tag;
+    uint64_t first, second;
+
+    replay->nextLines = 0;
+    while (REPLAY_Get(replay, &replay->interruptAt, &tag, &first, &second))
+    {
+        if (tag == REPLAY_INTERRUPT)
+        {
+            replay->cycle += first;
+            replay->nextLines = second;
+            SCHED_Schedule(replay->event, replay->cycle);
+            return;
+        }
+        if (tag == REPLAY_END)
+        {
+            replay->endCycle = replay->cycle + first;
+            replay->ended = true;
+            return;
+        }
+    }
+}
+
+// Replaying: the cycle of the next interrupt record came
+static void REPLAY_Service(void *opaque)
+{
+    Replay *replay = opaque;
+    while (replay->nextLines && replay->cycle <= SCHED_Now())
+    {
+        for (uint64_t lines = replay->nextLines; lines; lines &= lines - 1)
+            INT_Raise(__builtin_ctzll(lines));
+        REPLAY_NextInterrupt(replay);
+    }
+}
+
+// Schedule the first replayed interrupt, once a snapshot, if any, has set
+// the scheduler's state. Does nothing after the first time.
+void REPLAY_Start()
+{
+    Replay *replay = machine->replay;
+    if (!replay || !replay->replaying || replay->started)
+        return;
+    replay->started = true;
+    REPLAY_NextInterrupt(replay);
+}
+
+// Recording, at the end of each quantum: raise and log the interrupts the
+// I/O thread held back
+void REPLAY_Poll()
+{
+    Replay *replay = machine->replay;
+    if (replay->replaying || !atomic_load_explicit(&replay->pending, memory_order_relaxed))
+        return;
+
+    uint64_t lines = atomic_exchange(&replay->pending, 0);
+    uint64_t now = SCHED_Now();
+    REPLAY_FlushRepeats(replay);
+    putc(REPLAY_INTERRUPT, replay->file);
+    REPLAY_PutNumber(replay->file, now - replay->cycle);
+    REPLAY_PutNumber(replay->file, lines);
+    fflush(replay->file); // rare enough, and most of the log survives a crash
+    replay->cycle = now;
+
+    for (; lines; lines &= lines - 1)
+        INT_Raise(__builtin_ctzll(lines));
+}
+
+// A device register read that depends on the host returned `value`:
+// recording, log it; replaying, return the value read at this point of
+// the recording instead
+uint64_t REPLAY_Input(uint64_t value)
+{
+    Replay *replay = machine->replay;
+    if (!replay->replaying)
+    {
+        if (replay->haveInput && value == replay->lastInput)
+        {
+            replay->repeats++;
+            return value;
+        }
+        REPLAY_FlushRepeats(replay);
+        putc(REPLAY_INPUT, replay->file);
+        REPLAY_PutNumber(replay->file, value);
+        replay->lastInput = value;
+        replay->haveInput = true;
+        return value;
+    }
+
+    if (replay->inputRepeats)
+    {
+        replay->inputRepeats--;
+        return replay->lastInput;
+    }
+
+    uint8_t tag;
+    uint64_t first, second;
+    while (REPLAY_Get(replay, &replay->inputAt, &tag, &first, &second) && tag != REPLAY_END)
+    {
+        if (tag == REPLAY_INPUT)
+        {
+            replay->lastInput = first;
+            return first;
+        }
+        if (tag == REPLAY_REPEAT && first)
+        {
+            replay->inputRepeats = first - 1;
+            return replay->lastInput;
+        }
+    }
+    print_error("Replay diverged: device read at cycle %lu after the last one recorded\n", SCHED_Now());
+    MACHINE_Abort();
+}
+
+// Raise a device line from the I/O thread. Recording, the line is held
+// back until the end of the running quantum, see REPLAY_Poll; replaying,
+// nothing is attached that would raise one.
+void REPLAY_SendInterrupt(uint8_t interrupt)
+{
+    Replay *replay = machine->replay;
+    if (!replay)
+    {
+        BUS_SendInterrupt(interrupt);
+        return;
+    }
+    if (replay->replaying)
+        return;
+
+    atomic_fetch_or(&replay->pending, (uint64_t)1 << interrupt);
+    CPU_Kick(0);
+    CL_Wake(); // if idling in wfi
+}
@@ -0,0 +1,16 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Replay Replay;
+
+Replay *REPLAY_Create(const char *path, bool replaying);
+void REPLAY_Destroy(Replay *replay);
+void REPLAY_Start();
+void REPLAY_Poll();
+uint64_t REPLAY_Input(uint64_t value);
+void REPLAY_SendInterrupt(uint8_t interrupt);
+
+#endif // REPLAY_H
@@ -0,0 +1,191 @@
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "clock.h"
+#include "cpu.h"
+#include "machine.h"
+#include "replay.h"
+#include "sched.h"
+#include "smp.h"
+
+// Cycle-budgeted run loop
+//
+// The CPU runs for a quantum of cycles at a time. Devices don't get ticked
+// after every instruction; instead they register an event and ask to be
+// serviced at a given cycle. A quantum ends at the earliest pending
+// deadline, and a device that schedules an event inside the running
+// quantum (e.g. from an MMIO write) cuts it short through
+// CPU_RequestExit. The clock is synchronized once per quantum.
+//
+// A CPU waiting in wfi doesn't run at all: its quanta pass idle up to the
+// next deadline, instantly for machines that run flat out, and asleep on
+// the clock until then or until an interrupt for machines that run in
+// real time.
+//
+// On machines with several CPUs, CPU 0 runs the scheduler and its cycles
+// are the ones counted. Services and the bookkeeping around a quantum
+// hold the machine's lock, so devices accessed from other CPUs (see
+// smp.c) can schedule events, which cut CPU 0's quantum short as above.
+
+typedef struct
+{
+    const char *name;
+    SchedCallback callback;
+    void *opaque;
+    uint64_t deadline;
+} SchedEvent;
+
+// Per machine scheduler state, reached through machine->sched
+struct Sched
+{
+    SchedEvent events[SCHED_MAX_EVENTS];
+    int eventCount;
+    uint64_t quantum;
+    uint64_t now;        // cycles retired by the CPU
+    uint64_t quantumEnd; // cycle the running quantum stops at
+};
+
+Sched *SCHED_Create(uint64_t quantum)
+{
+    Sched *sched = calloc(1, sizeof(Sched));
+    if (!sched)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    sched->quantum = quantum ? quantum : SCHED_DEFAULT_QUANTUM;
+    return sched;
+}
+
+void SCHED_Destroy(Sched *sched)
+{
+    free(sched);
+}
+
+int SCHED_Register(const char *name, SchedCallback callback, void *opaque)
+{
+    Sched *sched = machine->sched;
+    if (sched->eventCount == SCHED_MAX_EVENTS)
+    {
+        print_error("Too many scheduler events\n");
+        exit(EXIT_FAILURE);
+    }
+    sched->events[sched->eventCount] = (SchedEvent){.name = name, .callback = callback, .opaque = opaque, .deadline = SCHED_NEVER};
+    return sched->eventCount++;
+}
+
+// Ask for the event's callback to run once the CPU has retired `cycle`
+// cycles. SCHED_NEVER cancels it.
+void SCHED_Schedule(int event, uint64_t cycle)
+{
+    Sched *sched = machine->sched;
+    sched->events[event].deadline = cycle;
+    if (cycle < sched->quantumEnd)
+        CPU_Kick(0);
+}
+
+void SCHED_ScheduleIn(int event, uint64_t cycles)
+{
+    Sched *sched = machine->sched;
+    SCHED_Schedule(event, sched->now + cycles);
+}
+
+// Current cycle count. Inside a quantum this is the cycle it started at.
+uint64_t SCHED_Now()
+{
+    Sched *sched = machine->sched;
+    return sched->now;
+}
+
+static void SCHED_Service()
+{
+    Sched *sched = machine->sched;
+    for (int i = 0; i < sched->eventCount; i++)
+    {
+        if (sched->events[i].deadline <= sched->now)
+        {
+            print_debug("servicing %s at cycle %lu\n", sched->events[i].name, sched->now);
+            sched->events[i].deadline = SCHED_NEVER;
+            sched->events[i].callback(sched->events[i].opaque);
+        }
+    }
+}
+
+// Run a quantum, cut short after `limit` cycles. A step retires a single
+// instruction, but a CPU waiting in wfi idles up to the next deadline as
+// in any other quantum.
+static uint64_t SCHED_Run(uint64_t limit, bool step)
+{
+    Sched *sched = machine->sched;
+    SMP_Lock();
+    SCHED_Service();
+
+    uint64_t end = sched->now + sched->quantum;
+    for (int i = 0; i < sched->eventCount; i++)
+    {
+        if (sched->events[i].deadline < end)
+            end = sched->events[i].deadline > sched->now ? sched->events[i].deadline : sched->now + 1;
+    }
+    if (!step && end - sched->now > limit)
+        end = sched->now + limit;
+
+    sched->quantumEnd = end;
+    uint64_t now = sched->now;
+    SMP_Unlock();
+
+    uint64_t executed = CPU_Waiting() ? CL_Idle(now, end) : CPU_Run(step ? 1 : end - now);
+
+    SMP_Lock();
+    sched->now += executed;
+    sched->quantumEnd = 0;
+    if (machine->replay)
+        REPLAY_Poll();
+    SCHED_Service();
+    SMP_Unlock();
+    CL_Sync(sched->now);
+    return executed;
+}
+
+// A guest fault unwound the running quantum after the CPU retired
+// `executed` instructions: count them, as SCHED_Run would have
+void SCHED_Unwind(uint64_t executed)
+{
+    Sched *sched = machine->sched;
+    SMP_Lock();
+    sched->now += executed;
+    sched->quantumEnd = 0;
+    SMP_Unlock();
+}
+
+// Run a quantum of at most `limit` cycles
+uint64_t SCHED_RunQuantum(uint64_t limit)
+{
+    return SCHED_Run(limit, false);
+}
+
+// A quantum of a single instruction, for debuggers. A CPU waiting in wfi
+// still idles up to the next deadline.
+uint64_t SCHED_Step()
+{
+    return SCHED_Run(1, true);
+}
+
+void SCHED_GetState(SchedState *state)
+{
+    Sched *sched = machine->sched;
+    state->now = sched->now;
+    for (int i = 0; i < SCHED_MAX_EVENTS; i++)
+        state->deadlines[i] = i < sched->eventCount ? sched->events[i].deadline : SCHED_NEVER;
+}
+
+void SCHED_SetState(const SchedState *state)
+{
+    Sched *sched = machine->sched;
+    sched->now = state->now;
+    for (int i = 0; i < sched->eventCount; i++)
+        sched->events[i].deadline = state->deadlines[i];
+}
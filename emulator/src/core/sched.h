@@ -0,0 +1,34 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+#define SCHED_DEFAULT_QUANTUM 10000 // cycles the CPU runs between device services
+#define SCHED_NEVER UINT64_MAX
+#define SCHED_MAX_EVENTS 16
+
+// Cycle count and event deadlines, as saved in snapshots. Events are
+// identified by registration order.
+typedef struct
+{
+    uint64_t now;
+    uint64_t deadlines[SCHED_MAX_EVENTS];
+} SchedState;
+
+typedef void (*SchedCallback)(void *opaque);
+
+typedef struct Sched Sched;
+
+Sched *SCHED_Create(uint64_t quantum);
+void SCHED_Destroy(Sched *sched);
+int SCHED_Register(const char *name, SchedCallback callback, void *opaque);
+void SCHED_Schedule(int event, uint64_t cycle);
+void SCHED_ScheduleIn(int event, uint64_t cycles);
+uint64_t SCHED_Now();
+uint64_t SCHED_RunQuantum(uint64_t limit);
+uint64_t SCHED_Step();
+void SCHED_Unwind(uint64_t executed);
+void SCHED_GetState(SchedState *state);
+void SCHED_SetState(const SchedState *state);
+
+#endif // SCHED_H
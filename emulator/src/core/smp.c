@@ -0,0 +1,178 @@
+#define _XOPEN_SOURCE 700
+#define LOG_CATEGORY LOG_GENERAL
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../common/common.h"
+#include "machine.h"
+#include "smp.h"
+
+// Multiprocessing
+//
+// Machines with more than one CPU run CPU 0 on the thread that calls
+// MACHINE_Run, as usual, and every other CPU on a host thread of its own,
+// started by the first MACHINE_Run and stopped by MACHINE_Destroy. All
+// CPUs start at the image's entry and share the bus and guest memory.
+// CPU 0 also runs the scheduler and the devices; the other CPUs reach
+// devices over MMIO like it does, and each has its own interrupt
+// controller (see interrupts.c).
+//
+// Device state isn't thread safe, so MMIO accesses and scheduler services
+// run under one recursive lock per machine. Memory accesses don't take it.
+// A machine with one CPU has no Smp and no lock to take.
+//
+// A secondary CPU waiting in wfi sleeps on the machine's wake condition
+// until an interrupt is raised for it.
+
+typedef struct
+{
+    Machine *machine;
+    int cpu;
+    pthread_t thread;
+} SmpThread;
+
+// Per machine state, reached through machine->smp
+struct Smp
+{
+    int cpus;
+    bool started;
+    _Atomic bool stopping; // MACHINE_Destroy is waiting for the threads
+    SmpThread threads[MACHINE_MAX_CPUS];
+
+    pthread_mutex_t lock; // devices and the scheduler
+
+    pthread_mutex_t wakeLock;
+    pthread_cond_t wake;
+    bool woken[MACHINE_MAX_CPUS]; // an interrupt was raised since the last SMP_Sleep
+};
+
+// Times the calling thread holds its machine's lock, see SMP_Abandon
+static _Thread_local int lockDepth;
+
+Smp *SMP_Create(int cpus)
+{
+    Smp *smp = calloc(1, sizeof(Smp));
+    if (!smp)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    smp->cpus = cpus;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&smp->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&smp->wakeLock, NULL);
+    pthread_cond_init(&smp->wake, NULL);
+    return smp;
+}
+
+// Stops and joins the secondary CPUs, wherever they are
+void SMP_Destroy(Smp *smp)
+{
+    atomic_store(&smp->stopping, true);
+    pthread_mutex_lock(&smp->wakeLock);
+    pthread_cond_broadcast(&smp->wake);
+    pthread_mutex_unlock(&smp->wakeLock);
+
+    if (smp->started)
+    {
+        for (int i = 1; i < smp->cpus; i++)
+            pthread_join(smp->threads[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&smp->wake);
+    pthread_mutex_destroy(&smp->wakeLock);
+    pthread_mutex_destroy(&smp->lock);
+    free(smp);
+}
+
+static void *SMP_Thread(void *arg)
+{
+    SmpThread *thread = arg;
+    MACHINE_RunSecondary(thread->machine, thread->cpu);
+    return NULL;
+}
+
+// Start the secondary CPUs of the calling thread's machine, once its image
+// is loaded. Does nothing if they already run.
+void SMP_Start()
+{
+    Smp *smp = machine->smp;
+    if (!smp || smp->started)
+        return;
+
+    for (int i = 1; i < smp->cpus; i++)
+    {
+        smp->threads[i] = (SmpThread){.machine = machine, .cpu = i};
+        if (pthread_create(&smp->threads[i].thread, NULL, &SMP_Thread, &smp->threads[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    smp->started = true;
+}
+
+bool SMP_Stopping()
+{
+    return atomic_load(&machine->smp->stopping);
+}
+
+// Serialize device accesses between the CPUs. Nests.
+void SMP_Lock()
+{
+    Smp *smp = machine->smp;
+    if (!smp)
+        return;
+    pthread_mutex_lock(&smp->lock);
+    lockDepth++;
+}
+
+void SMP_Unlock()
+{
+    Smp *smp = machine->smp;
+    if (!smp)
+        return;
+    lockDepth--;
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// Release the lock as often as the calling thread took it, for guest
+// faults that unwind out of a device access, see MACHINE_Abort
+void SMP_Abandon()
+{
+    while (lockDepth > 0)
+        SMP_Unlock();
+}
+
+// Block the calling secondary CPU until an interrupt is raised for it or
+// the machine stops. May return early; callers check again.
+void SMP_Sleep()
+{
+    Smp *smp = machine->smp;
+    pthread_mutex_lock(&smp->wakeLock);
+    while (!smp->woken[cpuId] && !atomic_load(&smp->stopping) && machine->status == MACHINE_RUNNING)
+        pthread_cond_wait(&smp->wake, &smp->wakeLock);
+    smp->woken[cpuId] = false;
+    pthread_mutex_unlock(&smp->wakeLock);
+}
+
+// Safe to call from any thread
+void SMP_Wake(int cpu)
+{
+    Smp *smp = machine->smp;
+    if (!smp)
+        return;
+
+    pthread_mutex_lock(&smp->wakeLock);
+    smp->woken[cpu] = true;
+    pthread_cond_broadcast(&smp->wake);
+    pthread_mutex_unlock(&smp->wakeLock);
+}
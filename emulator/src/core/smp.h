@@ -0,0 +1,18 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdbool.h>
+
+typedef struct Smp Smp;
+
+Smp *SMP_Create(int cpus);
+void SMP_Destroy(Smp *smp);
+void SMP_Start();
+bool SMP_Stopping();
+void SMP_Lock();
+void SMP_Unlock();
+void SMP_Abandon();
+void SMP_Sleep();
+void SMP_Wake(int cpu);
+
+#endif // SMP_H
@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_GENERAL
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../common/common.h"
+#include "../devices/console.h"
+#include "../devices/dma.h"
+#include "../devices/fileout.h"
+#include "../devices/pit.h"
+#include "../devices/pty.h"
+#include "../memory/ram.h"
+#include "../memory/rom.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "machine.h"
+#include "sched.h"
+#include "snapshot.h"
+
+// Machine snapshots
+//
+// A snapshot is a header holding the CPU, scheduler and device state,
+// followed by the contents of RAM and of ROM at page aligned offsets.
+// Restoring maps those blobs MAP_PRIVATE over guest memory, so they are
+// not read until the guest touches them, and pages the guest never
+// writes stay shared with the page cache and every other instance
+// started from the same file. Write protection of image segments is not
+// saved; a restored machine can write all of RAM. Machines with several
+// CPUs can't be saved or restored: the others run on their own threads,
+// not between CPU 0's quanta.
+//
+// The header is versioned; bump SNAP_VERSION whenever one of the state
+// structs changes.
+
+#define SNAP_MAGIC "TISCSNAP"
+#define SNAP_VERSION 6
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize; // sizeof(SnapshotHeader) of the writer
+    uint64_t ramOffset;  // file offset of the RAM blob, page aligned
+    uint64_t ramSize;
+    uint64_t romOffset;  // file offset of the ROM blob, page aligned
+    uint64_t romSize;
+    CpuState cpu;
+    SchedState sched;
+    IntcState intc;
+    FileOutState fileout;
+    PtyState pty;
+    ConsoleState console;
+    PitState pit;
+    DmaState dma;
+} SnapshotHeader;
+
+static bool SNAP_WriteAll(int fd, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Write `size` bytes of memory at `offset`. Pages that are all zero are
+// left as holes, which read back as zero.
+static bool SNAP_WriteMemory(int fd, const uint8_t *memory, uint64_t size, uint64_t offset)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    for (uint64_t done = 0; done < size; done += pageSize)
+    {
+        const uint8_t *page = memory + done;
+        if (page[0] == 0 && memcmp(page, page + 1, pageSize - 1) == 0)
+            continue;
+        if (lseek(fd, offset + done, SEEK_SET) == -1 || !SNAP_WriteAll(fd, page, pageSize))
+            return false;
+    }
+    return true;
+}
+
+// Take the snapshot between quanta, never from inside CPU_Run. The file
+// is written next to the target and renamed over it, so an instance that
+// has the old snapshot mapped keeps seeing the old contents.
+bool SNAP_Save(const char *path)
+{
+    if (machine->cpuCount > 1)
+    {
+        print_error("Snapshots of machines with several CPUs aren't supported\n");
+        return false;
+    }
+    if (machine->video)
+    {
+        // the framebuffer isn't guest RAM, and isn't saved
+        print_error("Snapshots of machines with a framebuffer aren't supported\n");
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    header.version = SNAP_VERSION;
+    header.headerSize = sizeof(header);
+    header.ramSize = machine->ramSize;
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    header.ramOffset = (sizeof(header) + pageSize - 1) & ~(uint64_t)(pageSize - 1);
+    header.romSize = ROM_SIZE;
+    header.romOffset = header.ramOffset + machine->ramSize;
+
+    CPU_GetState(&header.cpu);
+    SCHED_GetState(&header.sched);
+    INT_GetState(&header.intc);
+    FO_GetState(&header.fileout);
+    PTY_GetState(&header.pty);
+    CON_GetState(&header.console);
+    PIT_GetState(&header.pit);
+    DMA_GetState(&header.dma);
+
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+    {
+        print_error("Snapshot path too long: %s\n", path);
+        return false;
+    }
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(temp);
+        return false;
+    }
+
+    bool ok = SNAP_WriteAll(fd, &header, sizeof(header)) &&
+              SNAP_WriteMemory(fd, machine->ram, machine->ramSize, header.ramOffset) &&
+              SNAP_WriteMemory(fd, machine->rom, ROM_SIZE, header.romOffset) &&
+              ftruncate(fd, header.romOffset + ROM_SIZE) == 0;
+    if (!ok)
+        perror(temp);
+    if (close(fd) == -1)
+        ok = false;
+    if (ok && rename(temp, path) == -1)
+    {
+        perror(path);
+        ok = false;
+    }
+    if (!ok)
+    {
+        unlink(temp);
+        return false;
+    }
+
+    print_info("saved snapshot %s at cycle %lu\n", path, header.sched.now);
+    return true;
+}
+
+// Restore a snapshot in place of loading a binary. Must run after the
+// devices have been initialized and before the first CPU_Run.
+bool SNAP_Restore(const char *path)
+{
+    if (machine->cpuCount > 1)
+    {
+        print_error("Snapshots of machines with several CPUs aren't supported\n");
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror(path);
+        return false;
+    }
+
+    SnapshotHeader header;
+    ssize_t count = read(fd, &header, sizeof(header));
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (count != sizeof(header) || memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0)
+    {
+        print_error("%s is not a snapshot\n", path);
+        close(fd);
+        return false;
+    }
+    if (header.version != SNAP_VERSION || header.headerSize != sizeof(header) ||
+        header.ramOffset % pageSize || header.romSize != ROM_SIZE || header.romOffset % pageSize)
+    {
+        print_error("%s: unsupported snapshot version %u\n", path, header.version);
+        close(fd);
+        return false;
+    }
+    if (header.ramSize != machine->ramSize)
+    {
+        print_error("%s has %lu bytes of RAM, the machine %lu\n", path, header.ramSize, machine->ramSize);
+        close(fd);
+        return false;
+    }
+
+    RAM_MapFile(machine->ram, machine->ramSize, fd, header.ramOffset);
+    ROM_MapFile(machine->rom, fd, header.romOffset);
+    close(fd); // the mappings keep the file alive
+
+    CPU_SetState(&header.cpu);
+    SCHED_SetState(&header.sched);
+    INT_SetState(&header.intc);
+    FO_SetState(&header.fileout);
+    PTY_SetState(&header.pty);
+    CON_SetState(&header.console);
+    PIT_SetState(&header.pit);
+    DMA_SetState(&header.dma);
+
+    print_info("restored snapshot %s at cycle %lu\n", path, header.sched.now);
+    return true;
+}
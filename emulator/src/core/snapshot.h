@@ -0,0 +1,9 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+
+bool SNAP_Save(const char *path);
+bool SNAP_Restore(const char *path);
+
+#endif // SNAPSHOT_H
@@ -1,4 +1,5 @@
 #define _XOPEN_SOURCE 700
+#define LOG_CATEGORY LOG_DEVICE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -6,14 +7,24 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
 
-#include "../core/bus.h"
+#include "../core/interrupts.h"
+#include "../core/machine.h"
+#include "../core/replay.h"
 #include "../common/common.h"
+#include "../common/ring.h"
+#include "console.h"
+#include "io.h"
 
-static char buffer[1024];
+// The FIFOs belong to the I/O thread: bytes written by the guest are
+// queued in tx and written to the output FIFO once a reader has opened it,
+// bytes arriving on the input FIFO are queued in rx and raise an interrupt.
 
 // console control register
-static struct flags
+struct flags
 {
     uint8_t reserved : 3;
     uint8_t ENABLED : 1;
@@ -21,125 +32,197 @@ static struct flags
     uint8_t OVERRUN : 1;
     uint8_t RXRDY : 1;
     uint8_t TXRDY : 1;
-} ccr = {.TXRDY = 0, .RXRDY = 0, .OVERRUN = 0, .PARITY_ERR = 0, .ENABLED = 0};
+};
 
-// console data register
-static uint8_t cdr[8];
+// Per machine device state, passed to the callbacks as opaque
+struct Console
+{
+    struct flags ccr;
+    uint8_t cdr[8]; // console data register
 
+    Ring rx;
+    Ring tx;
+    atomic_bool overrun; // set by either side when a ring is full
+    uint64_t bytesIn, bytesOut; // bytes the guest received, and asked to send
+    int out_fd;
+    int in_fd;
+};
 
 const char *input_file = "/tmp/tisc64-in";
 const char *output_file = "/tmp/tisc64-out";
 
-//const char *tmp_output_file = "tisc64-fileout";
-//static FILE *tmp_output_fd;
-
-static int out_fd;
-static int in_fd;
+static void CON_In(void *opaque, uint32_t events);
+static bool CON_Out(void *opaque);
 
-void CON_Init()
+// Without the host FIFOs the device reads as disabled and drops what the
+// guest sends
+Console *CON_Create(bool host)
 {
-
-    ccr.TXRDY = 0;
-    ccr.RXRDY = 0;
-    ccr.OVERRUN = 0;
-    ccr.PARITY_ERR = 0;
-    ccr.ENABLED = 0;
-
-    memset(buffer, 0, sizeof(buffer));
-    memset(cdr, 0, sizeof(cdr));
-
+    Console *console = calloc(1, sizeof(Console));
+    if (!console)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    RING_Init(&console->rx);
+    RING_Init(&console->tx);
+    atomic_init(&console->overrun, false);
+    console->in_fd = console->out_fd = -1;
+    if (!host)
+        return console;
 
     mkfifo(output_file, 0666);
+    mkfifo(input_file, 0666);
 
+    // Opening the input FIFO read-write keeps a writer around, so it
+    // doesn't report a hangup every time a host writer goes away
+    console->in_fd = open(input_file, O_RDWR | O_NONBLOCK);
+    if (console->in_fd == -1)
+    {
+        perror("Failed to open input file");
+        exit(EXIT_FAILURE);
+    }
+    IO_Watch(console->in_fd, EPOLLIN, &CON_In, console);
+    IO_AddPoller(&CON_Out, console);
 
-    // Open the input pipe
-    /* mkfifo(input_file, 0666); */
-
-    /*
-        tmp_output_fd = fopen(tmp_output_file, "a");
-        if (tmp_output_fd == NULL)
-        {
-            perror("Failed to open file");
-            fclose(tmp_output_fd);
-            exit(EXIT_FAILURE);
-        }*/
-
-    ccr.ENABLED = 1;
+    console->ccr.ENABLED = 1;
+    return console;
 }
 
-void CON_Write(uint64_t address, uint64_t data)
+void CON_Write(void *opaque, uint64_t address, uint64_t data)
 {
+    Console *console = opaque;
     // If write address is 0, this is the ccr
     // If write address is 8, this is the cdr
     print_debug("address: %lu, data: %lu\n", address, data);
     if (address == 8)
-        *((uint64_t *)&cdr[0]) = data;
+        *((uint64_t *)&console->cdr[0]) = data;
 
+    // transmit the low byte of the data register
     if (address == 0 && data == 1)
-        ccr.TXRDY = 1;
+    {
+        console->bytesOut++;
+        bool first;
+        if (!RING_PushFirst(&console->tx, console->cdr[0], &first))
+            atomic_store(&console->overrun, true);
+        else if (first && console->in_fd != -1)
+            IO_Notify();
+    }
 }
 
-uint64_t CON_Read(uint64_t address)
+uint64_t CON_Read(void *opaque, uint64_t address)
 {
+    Console *console = opaque;
     print_debug("\n");
     if (address == 8)
-        return *((uint64_t *)&cdr[0]);
+    {
+        // receive the next byte, if there is one
+        uint8_t byte;
+        if (RING_Pop(&console->rx, &byte))
+        {
+            *((uint64_t *)&console->cdr[0]) = byte;
+            console->bytesIn++;
+        }
+        if (machine->replay)
+            *((uint64_t *)&console->cdr[0]) = REPLAY_Input(*((uint64_t *)&console->cdr[0]));
+        return *((uint64_t *)&console->cdr[0]);
+    }
+    if (address == 0)
+    {
+        uint8_t status;
+        console->ccr.RXRDY = !RING_Empty(&console->rx);
+        console->ccr.OVERRUN = atomic_load(&console->overrun);
+        memcpy(&status, &console->ccr, sizeof(status));
+        return machine->replay ? REPLAY_Input(status) : status;
+    }
     return 0;
 }
 
-void CON_Out()
+// I/O thread: write out what the guest queued, until the ring is empty
+// or the FIFO is full
+static bool CON_Out(void *opaque)
 {
-    print_debug("\n");
+    Console *console = opaque;
+    uint8_t buffer[256];
 
-    out_fd = open(output_file, O_WRONLY | O_SYNC | O_NONBLOCK);
-    if (out_fd != -1)
+    while (!RING_Empty(&console->tx))
     {
-        //fprintf(tmp_output_fd, "Console stuff received %lu", cdr);
-        write(out_fd, &cdr, sizeof(cdr));
-        close(out_fd);
-        ccr.TXRDY = false;
+        // Nobody is reading the FIFO yet, keep the bytes until someone does
+        if (console->out_fd == -1)
+        {
+            console->out_fd = open(output_file, O_WRONLY | O_NONBLOCK);
+            if (console->out_fd == -1)
+                return true;
+        }
+
+        size_t count = RING_Peek(&console->tx, buffer, sizeof(buffer));
+        ssize_t written = write(console->out_fd, buffer, count);
+        if (written == -1)
+        {
+            if (errno == EPIPE)
+            {
+                // The reader went away, reopen once there is a new one
+                close(console->out_fd);
+                console->out_fd = -1;
+            }
+            return true;
+        }
+        RING_Consume(&console->tx, written);
     }
+    return false;
 }
 
-void CON_In()
+// I/O thread: a host process wrote to the input FIFO
+static void CON_In(void *opaque, uint32_t events)
 {
-    print_debug("\n");
+    Console *console = opaque;
+    uint8_t buffer[256];
 
-    printf("ready to receive stuff\n");
+    ssize_t count = read(console->in_fd, buffer, sizeof(buffer));
+    if (count <= 0)
+        return;
 
-    // check if file /tmp/interrupt exists, if yes print "foo"
-    int interrupt_file = open("/tmp/interrupt", O_RDONLY | O_SYNC | O_NONBLOCK);
-    if (interrupt_file != -1)
+    for (ssize_t i = 0; i < count; i++)
     {
-        printf("foo\n");
-        BUS_SendInterrupt(1);
-        close(interrupt_file);
+        if (!RING_Push(&console->rx, buffer[i]))
+            atomic_store(&console->overrun, true);
     }
+    print_debug("received %ld bytes\n", (long)count);
+    REPLAY_SendInterrupt(INT_CON); // so that an interrupt handler can read the characters
+}
 
-
-    /*in_fd = open(input_file, O_RDONLY | O_SYNC);
-    if (in_fd == -1)
+void CON_Destroy(Console *console)
+{
+    print_debug("\n");
+    if (console->in_fd != -1)
     {
-        perror("Failed to open output file");
-        exit(EXIT_FAILURE);
-    }*/
-
-    // BUS_SendInterrupt(); // send an interrupt so that an interrupt handler can read the character
+        IO_Unwatch(console->in_fd);
+        IO_RemovePoller(&CON_Out, console);
+        CON_Out(console); // last chance to flush the output
+        close(console->in_fd);
+    }
+    if (console->out_fd != -1)
+        close(console->out_fd);
+    free(console);
+}
 
+void CON_GetTraffic(uint64_t *in, uint64_t *out)
+{
+    Console *console = machine->console;
+    *in = console->bytesIn;
+    *out = console->bytesOut;
 }
 
-void CON_Close()
+void CON_GetState(ConsoleState *state)
 {
-    print_debug("\n");
-    close(in_fd);
-    close(out_fd);
+    Console *console = machine->console;
+    memcpy(&state->ccr, &console->ccr, sizeof(console->ccr));
+    memcpy(state->cdr, console->cdr, sizeof(console->cdr));
 }
 
-void CON_Tick()
+void CON_SetState(const ConsoleState *state)
 {
-    print_debug("\n");
-    if (ccr.RXRDY == true)
-        CON_In();
-    if (ccr.TXRDY == true)
-        CON_Out();
-}
\ No newline at end of file
+    Console *console = machine->console;
+    memcpy(&console->ccr, &state->ccr, sizeof(console->ccr));
+    memcpy(console->cdr, state->cdr, sizeof(console->cdr));
+}
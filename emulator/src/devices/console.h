@@ -1,11 +1,26 @@
 #ifndef CONSOLE_H
 #define CONSOLE_H
 
-void CON_Init();
-void CON_Close();
-void CON_Tick();
-uint64_t CON_Read(uint64_t address);
-void CON_Write(uint64_t address, uint64_t data);
+#include <stdint.h>
+#include <stdbool.h>
+
+// Device registers, as saved in snapshots. Bytes still in flight between
+// the device and the I/O thread are not part of it.
+typedef struct
+{
+    uint8_t ccr;
+    uint8_t cdr[8];
+} ConsoleState;
+
+typedef struct Console Console;
+
+Console *CON_Create(bool host);
+void CON_Destroy(Console *console);
+void CON_GetTraffic(uint64_t *in, uint64_t *out);
+void CON_GetState(ConsoleState *state);
+void CON_SetState(const ConsoleState *state);
+uint64_t CON_Read(void *opaque, uint64_t address);
+void CON_Write(void *opaque, uint64_t address, uint64_t data);
 
 
 #endif // CONSOLE_H
\ No newline at end of file
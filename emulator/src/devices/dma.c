@@ -0,0 +1,178 @@
+#define LOG_CATEGORY LOG_DEVICE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/common.h"
+#include "../core/bus.h"
+#include "../core/cpu.h"
+#include "../core/machine.h"
+#include "dma.h"
+
+// DMA controller
+//
+// source register:  0x01100700     | destination register: 0x01100708,
+// mapped to         0              |                       8
+// length register:  0x01100710     | fill register:        0x01100718,
+// mapped to         16             |                       24
+// control register: 0x01100720,
+// mapped to         32
+//
+// Writing DMA_CONTROL_COPY or DMA_CONTROL_FILL to the control register
+// runs the whole transfer within the writing instruction, which is all
+// the guest time it takes, and then clears the length register. If both
+// ranges are plain host memory (RAM or ROM to read, RAM that isn't write
+// protected to write), the transfer is one memmove or memset on the host.
+// Anything else, e.g. MMIO or a range spanning several devices, goes
+// through the bus a word at a time and byte by byte for the rest, so
+// devices, write protection and faults see what a guest loop would do.
+
+// Per machine device state, passed to the callbacks as opaque
+struct Dma
+{
+    uint64_t source;
+    uint64_t destination;
+    uint64_t length;
+    uint64_t fill;
+};
+
+Dma *DMA_Create()
+{
+    Dma *dma = calloc(1, sizeof(Dma));
+    if (!dma)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return dma;
+}
+
+void DMA_Destroy(Dma *dma)
+{
+    free(dma);
+}
+
+static void DMA_Copy(Dma *dma)
+{
+    uint64_t source = dma->source;
+    uint64_t destination = dma->destination;
+    uint64_t length = dma->length;
+
+    uint8_t *from = BUS_HostRange(source, length);
+    uint8_t *to = BUS_HostWritableRange(destination, length);
+    if (from && to)
+    {
+        memmove(to, from, length);
+        CPU_InvalidateCode(destination, length);
+        return;
+    }
+
+    print_debug("copy 0x%lx+%lu to 0x%lx over the bus\n", source, length, destination);
+    uint64_t done;
+    if (destination > source && destination - source < length)
+    {
+        // the destination overlaps the end of the source, go backwards
+        for (done = length; done >= sizeof(uint64_t); done -= sizeof(uint64_t))
+            BUS_Write(destination + done - sizeof(uint64_t), BUS_Read(source + done - sizeof(uint64_t)));
+        for (; done > 0; done--)
+            BUS_Write8(destination + done - 1, BUS_Read8(source + done - 1));
+    }
+    else
+    {
+        for (done = 0; length - done >= sizeof(uint64_t); done += sizeof(uint64_t))
+            BUS_Write(destination + done, BUS_Read(source + done));
+        for (; done < length; done++)
+            BUS_Write8(destination + done, BUS_Read8(source + done));
+    }
+}
+
+static void DMA_Fill(Dma *dma)
+{
+    uint64_t destination = dma->destination;
+    uint64_t length = dma->length;
+    uint8_t byte = (uint8_t)dma->fill;
+
+    uint8_t *to = BUS_HostWritableRange(destination, length);
+    if (to)
+    {
+        memset(to, byte, length);
+        CPU_InvalidateCode(destination, length);
+        return;
+    }
+
+    print_debug("fill 0x%lx+%lu over the bus\n", destination, length);
+    uint64_t word = byte * 0x0101010101010101;
+    uint64_t done;
+    for (done = 0; length - done >= sizeof(uint64_t); done += sizeof(uint64_t))
+        BUS_Write(destination + done, word);
+    for (; done < length; done++)
+        BUS_Write8(destination + done, byte);
+}
+
+void DMA_Write(void *opaque, uint64_t address, uint64_t data)
+{
+    Dma *dma = opaque;
+    print_debug("address: %lu, data: %lu\n", address, data);
+    switch (address)
+    {
+    case 0:
+        dma->source = data;
+        break;
+    case 8:
+        dma->destination = data;
+        break;
+    case 16:
+        dma->length = data;
+        break;
+    case 24:
+        dma->fill = data;
+        break;
+    case 32:
+        if (dma->length == 0 || (data != DMA_CONTROL_COPY && data != DMA_CONTROL_FILL))
+            break;
+        if (data == DMA_CONTROL_COPY)
+            DMA_Copy(dma);
+        else
+            DMA_Fill(dma);
+        dma->length = 0;
+        break;
+    }
+}
+
+uint64_t DMA_Read(void *opaque, uint64_t address)
+{
+    Dma *dma = opaque;
+    print_debug("\n");
+    switch (address)
+    {
+    case 0:
+        return dma->source;
+    case 8:
+        return dma->destination;
+    case 16:
+        return dma->length;
+    case 24:
+        return dma->fill;
+    default:
+        return 0;
+    }
+}
+
+void DMA_GetState(DmaState *state)
+{
+    Dma *dma = machine->dma;
+    state->source = dma->source;
+    state->destination = dma->destination;
+    state->length = dma->length;
+    state->fill = dma->fill;
+}
+
+void DMA_SetState(const DmaState *state)
+{
+    Dma *dma = machine->dma;
+    dma->source = state->source;
+    dma->destination = state->destination;
+    dma->length = state->length;
+    dma->fill = state->fill;
+}
@@ -0,0 +1,30 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+
+// values written to the control register
+#define DMA_CONTROL_COPY 1 // copy length bytes from source to destination, the ranges may overlap
+#define DMA_CONTROL_FILL 2 // set length bytes at destination to the low byte of the fill register
+
+// Device registers, as saved in snapshots. Transfers finish within the
+// write that starts them, so there is nothing in flight.
+typedef struct
+{
+    uint64_t source;
+    uint64_t destination;
+    uint64_t length;
+    uint64_t fill;
+} DmaState;
+
+typedef struct Dma Dma;
+
+Dma *DMA_Create();
+void DMA_Destroy(Dma *dma);
+void DMA_GetState(DmaState *state);
+void DMA_SetState(const DmaState *state);
+uint64_t DMA_Read(void *opaque, uint64_t address);
+void DMA_Write(void *opaque, uint64_t address, uint64_t data);
+
+
+#endif // DMA_H
@@ -1,65 +1,231 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_DEVICE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "../common/common.h"
 #include "../core/bus.h"
+#include "../core/machine.h"
+#include "../core/sched.h"
 #include "fileout.h"
 
+#define FO_FILE "fileout.txt"          // default output file
+#define FO_BUFFER_SIZE 65536       // bytes, must be a power of two
+#define FO_FLUSH_CYCLES 100000     // flush queued bytes at the latest this many cycles later
+
+
+// control register: 0x01100000     | data register: 0x01100008,
+// mapped to         0              |                8
+// dma address:      0x01100010     | dma length:    0x01100018,
+// mapped to         16             |                24
+//
+// Bytes written one at a time are queued in a ring and written to the
+// file in batches: when the ring is full, when the guest asks for a
+// flush, shortly after the first byte was queued, and when the machine
+// is destroyed. A DMA request writes the queued bytes and the guest
+// buffer with one writev. The dma length register reads back as 0 once
+// the transfer is done.
+
+// Per machine device state, passed to the callbacks as opaque
+struct FileOut
+{
+    uint8_t registers[32];
+    int event; // scheduler event that flushes the ring
+    int fd;
+    char *path;
+
+    uint8_t buffer[FO_BUFFER_SIZE];
+    uint64_t head; // next byte queued
+    uint64_t tail; // next byte written to the file
+    uint64_t bytesOut; // sent by the guest, one at a time or by DMA
+};
+
+static bool FO_Open(FileOut *fo)
+{
+    if (fo->fd != -1)
+        return true;
 
-// enable register: 0x01100000 | output register: 0x01100008,
-// mapped to        0          |                  8
+    fo->fd = open(fo->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fo->fd == -1)
+    {
+        print_error("Error opening %s: %s\n", fo->path, strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-static uint8_t registers[16];
+// Write the queued bytes, followed by an optional extra buffer, with a
+// single writev (more only if the kernel takes less than everything)
+static void FO_WriteOut(FileOut *fo, const uint8_t *extra, uint64_t extraSize)
+{
+    if ((fo->head == fo->tail && extraSize == 0) || !FO_Open(fo))
+        return;
 
+    while (fo->head != fo->tail || extraSize)
+    {
+        struct iovec iov[3];
+        int count = 0;
+        uint64_t start = fo->tail & (FO_BUFFER_SIZE - 1);
+        uint64_t queued = fo->head - fo->tail;
 
+        // the queued bytes may wrap around the end of the ring
+        if (queued)
+        {
+            uint64_t first = queued < FO_BUFFER_SIZE - start ? queued : FO_BUFFER_SIZE - start;
+            iov[count++] = (struct iovec){.iov_base = &fo->buffer[start], .iov_len = first};
+            if (first < queued)
+                iov[count++] = (struct iovec){.iov_base = fo->buffer, .iov_len = queued - first};
+        }
+        if (extraSize)
+            iov[count++] = (struct iovec){.iov_base = (void *)extra, .iov_len = extraSize};
+
+        ssize_t written = writev(fo->fd, iov, count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            print_error("Error writing %s: %s\n", fo->path, strerror(errno));
+            fo->head = fo->tail; // drop the output rather than retry forever
+            return;
+        }
+
+        uint64_t fromRing = (uint64_t)written < queued ? (uint64_t)written : queued;
+        fo->tail += fromRing;
+        extra += written - fromRing;
+        extraSize -= written - fromRing;
+    }
+}
 
-void FO_Write(uint64_t address, uint64_t data)
+static void FO_FlushBuffer(FileOut *fo)
 {
-    // If write address is 0, this is the ccr
-    // If write address is 8, this is the cdr
-    print_debug("address: %lu, data: %lu\n", address, data);
-    if (address == 8)
-        *((uint64_t *)&registers[8]) = data;
+    print_debug("flushing %lu bytes\n", fo->head - fo->tail);
+    FO_WriteOut(fo, NULL, 0);
+}
 
-    // if the enable register is written to, set the enable bit
-    if (address == 0 && data == 1)
-        registers[0] = 1;
+void FO_Flush()
+{
+    FO_FlushBuffer(machine->fileout);
 }
 
-// device can not be read from
-uint64_t FO_Read(uint64_t address)
+static void FO_Service(void *opaque)
 {
-    print_debug("\n");
-    return 0;
+    FO_FlushBuffer(opaque);
 }
 
+// Output goes to path, which is opened on the first write. The scheduler
+// has to exist already.
+FileOut *FO_Create(const char *path)
+{
+    FileOut *fo = calloc(1, sizeof(FileOut));
+    if (!fo || !(fo->path = strdup(path ? path : FO_FILE)))
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    fo->fd = -1;
+    fo->event = SCHED_Register("fileout", &FO_Service, fo);
+    return fo;
+}
 
+// Writes out whatever is still queued
+void FO_Destroy(FileOut *fo)
+{
+    FO_FlushBuffer(fo);
+    if (fo->fd != -1)
+        close(fo->fd);
+    free(fo->path);
+    free(fo);
+}
 
-// simulate a device that can write into a file
-void FO_Tick()
+static void FO_Queue(FileOut *fo, uint8_t byte)
 {
-    print_debug("\n");
-    // print_debug("current MMIO state: mmio[0]: %u, mmio[1]: %u\n ", mmio[0], mmio[8]);
-    if (registers[0] == 1)
+    if (fo->head - fo->tail == FO_BUFFER_SIZE)
+        FO_FlushBuffer(fo);
+    if (fo->head == fo->tail)
+        SCHED_ScheduleIn(fo->event, FO_FLUSH_CYCLES);
+    fo->buffer[fo->head++ & (FO_BUFFER_SIZE - 1)] = byte;
+    fo->bytesOut++;
+}
+
+static void FO_Dma(FileOut *fo)
+{
+    uint64_t address = *((uint64_t *)&fo->registers[16]);
+    uint64_t length = *((uint64_t *)&fo->registers[24]);
+    if (length == 0)
+        return;
+
+    uint8_t *source = BUS_HostRange(address, length);
+    if (!source)
     {
-        print_debug("mmio[8] was written to: %u\n", registers[8]);
-        printf("\a");
+        // leave the length register as it is so the guest can tell
+        print_error("DMA from unmapped range 0x%lx+%lu\n", address, length);
+        return;
+    }
 
-        FILE *file;
+    print_debug("dma 0x%lx+%lu\n", address, length);
+    FO_WriteOut(fo, source, length);
+    fo->bytesOut += length;
+    *((uint64_t *)&fo->registers[24]) = 0;
+}
 
-        file = fopen("fileout.txt", "ab");
+void FO_Write(void *opaque, uint64_t address, uint64_t data)
+{
+    FileOut *fo = opaque;
+    // If write address is 0, this is the ccr
+    // If write address is 8, this is the cdr
+    // If write address is 16 or 24, this is the dma address or length
+    print_debug("address: %lu, data: %lu\n", address, data);
+    if (address == 8 || address == 16 || address == 24)
+        *((uint64_t *)&fo->registers[address]) = data;
 
-        if (file == NULL)
-        {
-            printf("Error opening file!\n");
-            return;
-        }
-        fprintf(file, "%c", registers[8]);
-        fflush(file);
+    if (address != 0)
+        return;
 
-        fclose(file);
+    switch (data)
+    {
+    case FO_CONTROL_WRITE:
+        FO_Queue(fo, fo->registers[8]);
+        break;
+    case FO_CONTROL_FLUSH:
+        FO_FlushBuffer(fo);
+        break;
+    case FO_CONTROL_DMA:
+        FO_Dma(fo);
+        break;
     }
-    // disable the device
-    registers[0] = 0;
-    return;
-}
\ No newline at end of file
+}
+
+// only the dma registers can be read back
+uint64_t FO_Read(void *opaque, uint64_t address)
+{
+    FileOut *fo = opaque;
+    print_debug("\n");
+    if (address == 16 || address == 24)
+        return *((uint64_t *)&fo->registers[address]);
+    return 0;
+}
+
+uint64_t FO_BytesOut()
+{
+    return machine->fileout->bytesOut;
+}
+
+// Queued bytes are written out rather than saved
+void FO_GetState(FileOutState *state)
+{
+    FileOut *fo = machine->fileout;
+    FO_FlushBuffer(fo);
+    memcpy(state->registers, fo->registers, sizeof(fo->registers));
+}
+
+void FO_SetState(const FileOutState *state)
+{
+    FileOut *fo = machine->fileout;
+    memcpy(fo->registers, state->registers, sizeof(fo->registers));
+}
@@ -1,13 +1,29 @@
-
-
 #ifndef FILEOUT_H
 #define FILEOUT_H
 
 #include <stdint.h>
 
-void FO_Tick();
-uint64_t FO_Read(uint64_t address);
-void FO_Write(uint64_t address, uint64_t data);
+// values written to the control register
+#define FO_CONTROL_WRITE 1 // queue the low byte of the data register
+#define FO_CONTROL_FLUSH 2 // write everything queued so far to the file
+#define FO_CONTROL_DMA 3   // write dma length bytes starting at dma address
+
+// Device registers, as saved in snapshots
+typedef struct
+{
+    uint8_t registers[32];
+} FileOutState;
+
+typedef struct FileOut FileOut;
+
+FileOut *FO_Create(const char *path);
+void FO_Destroy(FileOut *fo);
+void FO_Flush();
+uint64_t FO_BytesOut();
+void FO_GetState(FileOutState *state);
+void FO_SetState(const FileOutState *state);
+uint64_t FO_Read(void *opaque, uint64_t address);
+void FO_Write(void *opaque, uint64_t address, uint64_t data);
 
 
-#endif // FILEOUT_H
\ No newline at end of file
+#endif // FILEOUT_H
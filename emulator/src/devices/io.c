@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_DEVICE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "../common/common.h"
+#include "../core/machine.h"
+#include "io.h"
+
+// Host I/O thread
+//
+// Devices that talk to the host (PTY, console FIFOs) don't touch their
+// file descriptors from the CPU thread. They hand them to this thread,
+// which waits on them with epoll and runs the device's handler when data
+// arrives. Bytes travel between the two threads through SPSC rings
+// (common/ring.h), so the CPU thread never makes a syscall for device I/O.
+//
+// Output is signalled through an eventfd, but only when a device queues a
+// byte into an empty tx ring (IO_Notify), so the CPU side makes one
+// syscall per burst rather than per byte. Every wakeup runs the registered
+// pollers, which drain their tx rings. While a poller has output the host
+// won't take yet, epoll_wait times out every IO_RETRY_MS to try again;
+// otherwise the thread sleeps until something happens.
+//
+// One thread serves every machine in the process. Watches and pollers
+// remember the machine that registered them, and handlers run with
+// `machine` pointing at it. Registration is allowed at any time; the
+// table lock also keeps a handler from running once IO_Unwatch or
+// IO_RemovePoller has returned.
+
+#define IO_MAX_WATCHES 256
+#define IO_MAX_POLLERS 256
+#define IO_MAX_EVENTS 64
+#define IO_RETRY_MS 10
+
+typedef struct
+{
+    int fd;
+    IoHandler handler;
+    void *opaque;
+    Machine *machine;
+} IoWatch;
+
+typedef struct
+{
+    IoPollFn poll;
+    void *opaque;
+    Machine *machine;
+} IoPoller;
+
+static int epollFd = -1;
+static int notifyFd = -1; // eventfd, see IO_Notify
+static IoWatch watches[IO_MAX_WATCHES];
+static IoPoller pollers[IO_MAX_POLLERS];
+static int pollerCount;
+static atomic_bool running;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void IO_Init()
+{
+    memset(watches, 0, sizeof(watches));
+    for (int i = 0; i < IO_MAX_WATCHES; i++)
+        watches[i].fd = -1;
+    pollerCount = 0;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // Registered with a NULL watch, only to wake the thread up
+    notifyFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (notifyFd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, notifyFd, &event) == -1)
+    {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // Writes to a FIFO whose reader went away fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+}
+
+void IO_Watch(int fd, uint32_t events, IoHandler handler, void *opaque)
+{
+    pthread_mutex_lock(&lock);
+    IoWatch *watch = NULL;
+    for (int i = 0; i < IO_MAX_WATCHES && !watch; i++)
+    {
+        if (watches[i].fd == -1)
+            watch = &watches[i];
+    }
+    if (!watch)
+    {
+        print_error("Too many watched file descriptors\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *watch = (IoWatch){.fd = fd, .handler = handler, .opaque = opaque, .machine = machine};
+    struct epoll_event event = {.events = events, .data.ptr = watch};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Must not be called from a handler or poller
+void IO_Unwatch(int fd)
+{
+    pthread_mutex_lock(&lock);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    for (int i = 0; i < IO_MAX_WATCHES; i++)
+    {
+        if (watches[i].fd == fd)
+            watches[i].fd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void IO_AddPoller(IoPollFn poll, void *opaque)
+{
+    pthread_mutex_lock(&lock);
+    if (pollerCount == IO_MAX_POLLERS)
+    {
+        print_error("Too many I/O pollers\n");
+        exit(EXIT_FAILURE);
+    }
+    pollers[pollerCount++] = (IoPoller){.poll = poll, .opaque = opaque, .machine = machine};
+    pthread_mutex_unlock(&lock);
+}
+
+// Must not be called from a handler or poller
+void IO_RemovePoller(IoPollFn poll, void *opaque)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < pollerCount; i++)
+    {
+        if (pollers[i].poll == poll && pollers[i].opaque == opaque)
+        {
+            pollers[i] = pollers[--pollerCount];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Wake the I/O thread so that the pollers run. Called by devices when
+// they queue output into an empty ring, and by IO_Shutdown.
+void IO_Notify()
+{
+    uint64_t one = 1;
+    if (write(notifyFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("write to eventfd");
+}
+
+// Returns true if some output is still pending
+static bool IO_RunPollers()
+{
+    bool pending = false;
+    for (int i = 0; i < pollerCount; i++)
+    {
+        machine = pollers[i].machine;
+        pending |= pollers[i].poll(pollers[i].opaque);
+    }
+    return pending;
+}
+
+static void *IO_Thread(void *arg)
+{
+    struct epoll_event events[IO_MAX_EVENTS];
+    bool pending = false;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed))
+    {
+        int count = epoll_wait(epollFd, events, IO_MAX_EVENTS, pending ? IO_RETRY_MS : -1);
+
+        pthread_mutex_lock(&lock);
+        for (int i = 0; i < count; i++)
+        {
+            IoWatch *watch = events[i].data.ptr;
+            if (!watch)
+            {
+                uint64_t value;
+                if (read(notifyFd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+                    perror("read from eventfd");
+                continue;
+            }
+            if (watch->fd == -1)
+                continue;
+            machine = watch->machine;
+            watch->handler(watch->opaque, events[i].events);
+        }
+        pending = IO_RunPollers();
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+void IO_Start()
+{
+    atomic_store(&running, true);
+    if (pthread_create(&thread, NULL, IO_Thread, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    atexit(IO_Shutdown);
+}
+
+void IO_Shutdown()
+{
+    if (!atomic_exchange(&running, false))
+        return;
+    IO_Notify();
+    pthread_join(thread, NULL);
+
+    // Give the devices a last chance to flush their output
+    pthread_mutex_lock(&lock);
+    IO_RunPollers();
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,22 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Called on the I/O thread when a watched fd is ready (epoll event mask)
+typedef void (*IoHandler)(void *opaque, uint32_t events);
+// Called on the I/O thread every time it wakes up, to drain tx rings.
+// Returns true if output is left that the host could not take yet.
+typedef bool (*IoPollFn)(void *opaque);
+
+void IO_Init();
+void IO_Watch(int fd, uint32_t events, IoHandler handler, void *opaque);
+void IO_Unwatch(int fd);
+void IO_AddPoller(IoPollFn poll, void *opaque);
+void IO_RemovePoller(IoPollFn poll, void *opaque);
+void IO_Notify();
+void IO_Start();
+void IO_Shutdown();
+
+#endif // IO_H
@@ -0,0 +1,147 @@
+#define LOG_CATEGORY LOG_DEVICE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../common/common.h"
+#include "../core/bus.h"
+#include "../core/interrupts.h"
+#include "../core/machine.h"
+#include "../core/sched.h"
+#include "pit.h"
+
+// Programmable interval timer
+//
+// control register: 0x01100300     | period register: 0x01100308,
+// mapped to         0              |                  8
+// expired counter:  0x01100310,
+// mapped to         16
+//
+// Time is counted in emulated cycles, not host time, so a guest sees the
+// same timer whether it runs in real time, flat out or from a snapshot.
+// Writing the control or period register (re)starts the countdown at the
+// cycle after the writing instruction: the write only asks for a
+// scheduler event at the current cycle, which ends the quantum there, and
+// the deadline is taken from the exact cycle count when the event is
+// serviced. Each time the period is up the expired counter goes up and
+// INT_PIT is raised; the guest clears the counter by writing it.
+
+// Per machine device state, passed to the callbacks as opaque
+struct Pit
+{
+    uint64_t control;
+    uint64_t period; // cycles
+    uint64_t expired;
+    int event;
+    bool arming; // the event starts the countdown rather than ending it
+};
+
+static void PIT_Service(void *opaque)
+{
+    Pit *pit = opaque;
+    if (!(pit->control & PIT_CONTROL_ENABLE) || pit->period == 0)
+        return;
+
+    if (pit->arming)
+    {
+        pit->arming = false;
+        SCHED_ScheduleIn(pit->event, pit->period);
+        return;
+    }
+
+    print_debug("expired at cycle %lu\n", SCHED_Now());
+    pit->expired++;
+    BUS_SendInterrupt(INT_PIT);
+    if (pit->control & PIT_CONTROL_PERIODIC)
+        SCHED_ScheduleIn(pit->event, pit->period);
+    else
+        pit->control &= ~(uint64_t)PIT_CONTROL_ENABLE;
+}
+
+// The scheduler has to exist already
+Pit *PIT_Create()
+{
+    Pit *pit = calloc(1, sizeof(Pit));
+    if (!pit)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pit->event = SCHED_Register("pit", &PIT_Service, pit);
+    return pit;
+}
+
+void PIT_Destroy(Pit *pit)
+{
+    free(pit);
+}
+
+static void PIT_Restart(Pit *pit)
+{
+    if ((pit->control & PIT_CONTROL_ENABLE) && pit->period != 0)
+    {
+        pit->arming = true;
+        SCHED_Schedule(pit->event, SCHED_Now());
+    }
+    else
+    {
+        pit->arming = false;
+        SCHED_Schedule(pit->event, SCHED_NEVER);
+    }
+}
+
+void PIT_Write(void *opaque, uint64_t address, uint64_t data)
+{
+    Pit *pit = opaque;
+    print_debug("address: %lu, data: %lu\n", address, data);
+    switch (address)
+    {
+    case 0:
+        pit->control = data;
+        PIT_Restart(pit);
+        break;
+    case 8:
+        pit->period = data;
+        PIT_Restart(pit);
+        break;
+    case 16:
+        pit->expired = data;
+        break;
+    }
+}
+
+uint64_t PIT_Read(void *opaque, uint64_t address)
+{
+    Pit *pit = opaque;
+    print_debug("\n");
+    switch (address)
+    {
+    case 0:
+        return pit->control;
+    case 8:
+        return pit->period;
+    case 16:
+        return pit->expired;
+    default:
+        return 0;
+    }
+}
+
+// Snapshots are taken between quanta, when no countdown is waiting to be
+// started
+void PIT_GetState(PitState *state)
+{
+    Pit *pit = machine->pit;
+    state->control = pit->control;
+    state->period = pit->period;
+    state->expired = pit->expired;
+}
+
+void PIT_SetState(const PitState *state)
+{
+    Pit *pit = machine->pit;
+    pit->control = state->control;
+    pit->period = state->period;
+    pit->expired = state->expired;
+    pit->arming = false;
+}
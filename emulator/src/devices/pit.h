@@ -0,0 +1,29 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+
+// bits of the control register
+#define PIT_CONTROL_ENABLE 1   // count down the period, then raise INT_PIT
+#define PIT_CONTROL_PERIODIC 2 // start over when the period is up instead of stopping
+
+// Device registers, as saved in snapshots. The deadline is part of the
+// scheduler state.
+typedef struct
+{
+    uint64_t control;
+    uint64_t period;
+    uint64_t expired;
+} PitState;
+
+typedef struct Pit Pit;
+
+Pit *PIT_Create();
+void PIT_Destroy(Pit *pit);
+void PIT_GetState(PitState *state);
+void PIT_SetState(const PitState *state);
+uint64_t PIT_Read(void *opaque, uint64_t address);
+void PIT_Write(void *opaque, uint64_t address, uint64_t data);
+
+
+#endif // PIT_H
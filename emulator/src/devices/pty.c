@@ -1,22 +1,31 @@
 #define _XOPEN_SOURCE 700
+#define LOG_CATEGORY LOG_DEVICE
 #include <stdint.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
 
 #include "pty.h"
+#include "io.h"
 #include "../common/common.h"
-#include "../core/bus.h"
+#include "../common/ring.h"
+#include "../core/interrupts.h"
+#include "../core/machine.h"
+#include "../core/replay.h"
 
 #define PTY_BUF_SIZE 256
 
-
-extern uint8_t itr;
+// The master side of the PTY belongs to the I/O thread. Received bytes
+// are queued in rx and raise an interrupt, bytes the guest sends are
+// queued in tx and written out by the I/O thread.
 
 // console control register
-static struct flags
+struct flags
 {
     uint8_t reserved : 3;
     uint8_t ENABLED : 1;
@@ -24,149 +33,225 @@ static struct flags
     uint8_t OVERRUN : 1;
     uint8_t RXRDY : 1;
     uint8_t TXRDY : 1;
-} ccr = {.TXRDY = 0, .RXRDY = 0, .OVERRUN = 0, .PARITY_ERR = 0, .ENABLED = 0};
-
-// console data register
-static uint8_t cdr[8];
-
-static int master_fd = 0;
-static char *slave_name;
-static char read_buf[PTY_BUF_SIZE];
+};
 
-
-void PTY_In();
-void PTY_Out();
-
-void PTY_Write(uint64_t address, uint64_t data)
+// Per machine device state, passed to the callbacks as opaque
+struct Pty
+{
+    struct flags ccr;
+    uint8_t cdr[8]; // console data register
+
+    int master_fd;
+    int slave_fd; // held open so the master never sees a hangup
+    char *slave_name;
+    Ring rx; // I/O thread -> guest
+    Ring tx; // guest -> I/O thread
+    atomic_bool overrun; // set by either side when a ring is full
+    uint64_t bytesIn, bytesOut; // bytes the guest received, and asked to send
+};
+
+static void PTY_In(void *opaque, uint32_t events);
+static bool PTY_Out(void *opaque);
+
+void PTY_Write(void *opaque, uint64_t address, uint64_t data)
 {
+    Pty *pty = opaque;
     // If write address is 0, this is the ccr
     // If write address is 8, this is the start of the buffer
     print_debug("address: %lu, data: %lu\n", address, data);
     if (address == 8)
-        *((uint64_t *)&cdr[0]) = data;
+        *((uint64_t *)&pty->cdr[0]) = data;
 
+    // transmit the low byte of the data register
     if (address == 0 && data == 1)
-        ccr.TXRDY = 1;
+    {
+        pty->bytesOut++;
+        bool first;
+        if (!RING_PushFirst(&pty->tx, pty->cdr[0], &first))
+            atomic_store(&pty->overrun, true);
+        else if (first && pty->master_fd != -1)
+            IO_Notify();
+    }
 }
 
-uint64_t PTY_Read(uint64_t address)
+uint64_t PTY_Read(void *opaque, uint64_t address)
 {
+    Pty *pty = opaque;
     print_debug("\n");
     if (address == 8)
-        return *((uint64_t *)&cdr[0]);
+    {
+        // receive the next byte, if there is one
+        uint8_t byte;
+        if (RING_Pop(&pty->rx, &byte))
+        {
+            *((uint64_t *)&pty->cdr[0]) = byte;
+            pty->bytesIn++;
+        }
+        if (machine->replay)
+            *((uint64_t *)&pty->cdr[0]) = REPLAY_Input(*((uint64_t *)&pty->cdr[0]));
+        return *((uint64_t *)&pty->cdr[0]);
+    }
+    if (address == 0)
+    {
+        uint8_t status;
+        pty->ccr.RXRDY = !RING_Empty(&pty->rx);
+        pty->ccr.OVERRUN = atomic_load(&pty->overrun);
+        memcpy(&status, &pty->ccr, sizeof(status));
+        return machine->replay ? REPLAY_Input(status) : status;
+    }
     return 0;
 }
 
 
-int PTY_Init()
+// Without a host side the device reads as disabled and drops what the
+// guest sends
+Pty *PTY_Create(bool host)
 {
-    ccr.TXRDY = 0;
-    ccr.RXRDY = 0;
-    ccr.OVERRUN = 0;
-    ccr.PARITY_ERR = 0;
-    ccr.ENABLED = 0;
-
-    memset(cdr, 0, sizeof(cdr));
-    memset (read_buf, 0, PTY_BUF_SIZE);
+    Pty *pty = calloc(1, sizeof(Pty));
+    if (!pty)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pty->master_fd = pty->slave_fd = -1;
+    RING_Init(&pty->rx);
+    RING_Init(&pty->tx);
+    atomic_init(&pty->overrun, false);
+    if (!host)
+        return pty;
 
     print_debug("\n");
     // Open a pseudoterminal device
-    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
-    if (master_fd == -1)
+    pty->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (pty->master_fd == -1)
     {
         perror("posix_openpt");
-        return EXIT_FAILURE;
+        return pty;
     }
 
     // Grant access to the slave pseudoterminal
-    if (grantpt(master_fd) == -1)
+    if (grantpt(pty->master_fd) == -1)
     {
         perror("grantpt");
-        close(master_fd);
-        return EXIT_FAILURE;
+        close(pty->master_fd);
+        pty->master_fd = -1;
+        return pty;
     }
 
     // Unlock the slave pseudoterminal
-    if (unlockpt(master_fd) == -1)
+    if (unlockpt(pty->master_fd) == -1)
     {
         perror("unlockpt");
-        close(master_fd);
-        return EXIT_FAILURE;
+        close(pty->master_fd);
+        pty->master_fd = -1;
+        return pty;
     }
 
     // Get the pathname of the slave pseudoterminal
-    slave_name = ptsname(master_fd);
-    if (slave_name == NULL)
+    pty->slave_name = ptsname(pty->master_fd);
+    if (pty->slave_name == NULL)
     {
         perror("ptsname");
-        close(master_fd);
-        return EXIT_FAILURE;
+        close(pty->master_fd);
+        pty->master_fd = -1;
+        return pty;
     }
 
-    print_debug("Pseudoterminal: %s\n", slave_name);
-    return 0;
-}
+    // Like the console's input FIFO: with a slave open of our own, a
+    // terminal that attaches and detaches again doesn't leave the master
+    // reporting a hangup, which would keep the I/O thread spinning
+    pty->slave_fd = open(pty->slave_name, O_RDWR | O_NOCTTY);
+    if (pty->slave_fd == -1)
+    {
+        perror("open slave pty");
+        close(pty->master_fd);
+        pty->master_fd = -1;
+        return pty;
+    }
 
-void PTY_Tick()
-{
-    print_debug("\n");
-    PTY_In();
-   // PTY_Out();
+    print_debug("Pseudoterminal: %s\n", pty->slave_name);
+    IO_Watch(pty->master_fd, EPOLLIN, &PTY_In, pty);
+    IO_AddPoller(&PTY_Out, pty);
+    pty->ccr.ENABLED = 1;
+
+    return pty;
 }
 
-void PTY_Out()
+// I/O thread: write out what the guest queued, until the ring is empty
+// or the terminal is full
+static bool PTY_Out(void *opaque)
 {
-    print_debug("\n");
-
-    //char write_buf[] = "Hello, PTY!\r\n";
+    Pty *pty = opaque;
+    uint8_t write_buf[PTY_BUF_SIZE];
 
-   // ssize_t num_written = write(master_fd, write_buf, sizeof(write_buf));
-    ssize_t num_written = write(master_fd, read_buf, sizeof(read_buf));
-    if (num_written == -1)
+    while (!RING_Empty(&pty->tx))
     {
-        perror("write to master pty");
-        return;
+        size_t count = RING_Peek(&pty->tx, write_buf, sizeof(write_buf));
+        ssize_t num_written = write(pty->master_fd, write_buf, count);
+        if (num_written == -1)
+        {
+            if (errno != EAGAIN)
+                perror("write to master pty");
+            return true;
+        }
+        RING_Consume(&pty->tx, num_written);
     }
+    return false;
 }
 
-void PTY_In()
+// I/O thread: the master side has data
+static void PTY_In(void *opaque, uint32_t events)
 {
-    print_debug("\n");
+    Pty *pty = opaque;
+    char read_buf[PTY_BUF_SIZE];
 
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(master_fd, &read_fds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-
-    int ready = select(master_fd + 1, &read_fds, NULL, NULL, &timeout);
-    if (ready == -1)
+    // Read from the master side of the PTY
+    ssize_t num_read = read(pty->master_fd, read_buf, sizeof(read_buf));
+    if (num_read <= 0)
     {
-        perror("select");
+        if (num_read == -1 && errno != EAGAIN && errno != EIO)
+            perror("read from master pty");
         return;
     }
 
-    if (FD_ISSET(master_fd, &read_fds))
+    for (ssize_t i = 0; i < num_read; i++)
     {
-        // Read from the master side of the PTY
-        ssize_t num_read = read(master_fd, read_buf, PTY_BUF_SIZE - 1);
-        if (num_read == -1)
-        {
-            perror("read from master pty");
-            return;
-        }
-
-        // Null-terminate the string read and print it
-        read_buf[num_read] = '\0';
-        print_debug("Read from PTY: %s\n", read_buf);
-        BUS_SendInterrupt(1);
-        PTY_Out(); // simple echo
+        if (!RING_Push(&pty->rx, read_buf[i]))
+            atomic_store(&pty->overrun, true);
+    }
+    REPLAY_SendInterrupt(INT_PTY);
+}
 
+void PTY_Destroy(Pty *pty)
+{
+    if (pty->master_fd != -1)
+    {
+        IO_Unwatch(pty->master_fd);
+        IO_RemovePoller(&PTY_Out, pty);
+        PTY_Out(pty); // last chance to flush the output
+        close(pty->master_fd);
+        close(pty->slave_fd);
     }
+    free(pty);
+}
+
+void PTY_GetTraffic(uint64_t *in, uint64_t *out)
+{
+    Pty *pty = machine->pty;
+    *in = pty->bytesIn;
+    *out = pty->bytesOut;
+}
+
+void PTY_GetState(PtyState *state)
+{
+    Pty *pty = machine->pty;
+    memcpy(&state->ccr, &pty->ccr, sizeof(pty->ccr));
+    memcpy(state->cdr, pty->cdr, sizeof(pty->cdr));
 }
 
-void PTY_Destroy()
+void PTY_SetState(const PtyState *state)
 {
-}
\ No newline at end of file
+    Pty *pty = machine->pty;
+    memcpy(&pty->ccr, &state->ccr, sizeof(pty->ccr));
+    memcpy(pty->cdr, state->cdr, sizeof(pty->cdr));
+}
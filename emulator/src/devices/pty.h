@@ -2,12 +2,25 @@
 #define PTY_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-int PTY_Init();
-void PTY_Tick();
-uint64_t PTY_Read(uint64_t address);
-void PTY_Write(uint64_t address, uint64_t data);
-void PTY_Destroy();
+// Device registers, as saved in snapshots. Bytes still in flight between
+// the device and the I/O thread are not part of it.
+typedef struct
+{
+    uint8_t ccr;
+    uint8_t cdr[8];
+} PtyState;
+
+typedef struct Pty Pty;
+
+Pty *PTY_Create(bool host);
+void PTY_Destroy(Pty *pty);
+void PTY_GetTraffic(uint64_t *in, uint64_t *out);
+void PTY_GetState(PtyState *state);
+void PTY_SetState(const PtyState *state);
+uint64_t PTY_Read(void *opaque, uint64_t address);
+void PTY_Write(void *opaque, uint64_t address, uint64_t data);
 
 
 #endif // PYT_H
\ No newline at end of file
@@ -1,7 +1,421 @@
+#define _POSIX_C_SOURCE 200809L
+#define LOG_CATEGORY LOG_DEVICE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
+#include "../common/common.h"
+#include "../core/bus.h"
+#include "../core/machine.h"
+#include "../core/sched.h"
+#include "../core/smp.h"
 #include "video.h"
 
-void VGA_Init() {
-    exit (0);
-}
\ No newline at end of file
+// Headless framebuffer
+//
+// control register: 0x01100800     | width register:   0x01100808,
+// mapped to         0              |                   8
+// height register:  0x01100810     | format register:  0x01100818,
+// mapped to         16             |                   24
+// stride register:  0x01100820     | address register: 0x01100828,
+// mapped to         32             |                   40
+// frames counter:   0x01100830,
+// mapped to         48
+//
+// A linear framebuffer of the configured resolution and format lives at
+// FRAMEBUFFER_START; everything but the control register is read-only.
+// Nothing is drawn on the host. Instead, what changed is exported every
+// interval cycles after the first change, or when the guest writes
+// VID_CONTROL_PRESENT, to a shared memory segment or as PPM files, one
+// per changed rectangle.
+//
+// Finding what changed costs time proportional to the change, not to the
+// frame: the framebuffer's pages trap writes, so the bus tells us about
+// the first write to each of them, and we mark the page dirty and let the
+// writes after it go straight to memory. An export compares only the rows
+// of dirty pages against a copy of the last frame, turns the changed spans
+// into rectangles, and traps the pages again. DMA transfers to the
+// framebuffer go through the bus too, see BUS_HostWritableRange. Code run
+// from the framebuffer isn't invalidated when the guest overwrites it
+// through a page that doesn't trap.
+
+// Per machine device state, passed to the callbacks as opaque
+struct Video
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t bytesPerPixel;
+    uint32_t stride; // bytes per row
+    uint64_t size;   // mapped bytes, whole pages
+    uint8_t *memory; // what the guest sees
+    uint8_t *shadow; // the frame as last exported
+    _Atomic uint64_t *dirty; // one bit per page written since the last export
+    uint8_t *rowDirty; // scratch for VID_Export: rows on dirty pages
+    uint64_t interval;
+    int event;
+    bool pending; // the event is scheduled
+    uint64_t frames;
+
+    VideoRect rects[VID_MAX_RECTS];
+    int rectCount;
+
+    // output, at most one of them
+    VideoShmHeader *shm;
+    uint64_t shmSize;
+    char *ppmPrefix;
+};
+
+static void *VID_Alloc(size_t size)
+{
+    void *memory = calloc(1, size);
+    if (!memory)
+    {
+        print_error("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static void VID_OpenShm(Video *video, const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        print_error("Error opening shared memory %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    video->shmSize = sizeof(VideoShmHeader) + (uint64_t)video->stride * video->height;
+    if (ftruncate(fd, video->shmSize) == -1)
+    {
+        print_error("Error sizing shared memory %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    video->shm = mmap(NULL, video->shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (video->shm == MAP_FAILED)
+    {
+        print_error("Error mapping shared memory %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // a segment left over from an earlier run starts out blank
+    memset(video->shm, 0, video->shmSize);
+    memcpy(video->shm->magic, VID_SHM_MAGIC, sizeof(VID_SHM_MAGIC));
+    video->shm->format = video->format;
+    video->shm->width = video->width;
+    video->shm->height = video->height;
+    video->shm->stride = video->stride;
+    video->shm->pixelOffset = sizeof(VideoShmHeader);
+}
+
+static void VID_Export(Video *video);
+
+static void VID_Service(void *opaque)
+{
+    Video *video = opaque;
+    video->pending = false;
+    VID_Export(video);
+}
+
+// The scheduler has to exist already; the bus maps the device later, see
+// VID_Init
+Video *VID_Create(const VideoConfig *config)
+{
+    Video *video = VID_Alloc(sizeof(Video));
+    video->width = config->width;
+    video->height = config->height;
+    video->format = config->format ? config->format : VID_FORMAT_XRGB8888;
+    if (video->format != VID_FORMAT_XRGB8888 && video->format != VID_FORMAT_RGB565)
+    {
+        print_error("Unknown pixel format %d\n", config->format);
+        exit(EXIT_FAILURE);
+    }
+    video->bytesPerPixel = video->format == VID_FORMAT_XRGB8888 ? 4 : 2;
+    // in 64 bits, a wide enough row would wrap the 32 bit stride; divided,
+    // so that stride * height can't wrap either
+    uint64_t stride = (uint64_t)video->width * video->bytesPerPixel;
+    if (!video->height || stride > FRAMEBUFFER_MAX_SIZE / video->height)
+    {
+        print_error("Resolution %ux%u doesn't fit the framebuffer\n", video->width, video->height);
+        exit(EXIT_FAILURE);
+    }
+    video->stride = stride;
+    video->size = (stride * video->height + BUS_PAGE_SIZE - 1) & ~(BUS_PAGE_SIZE - 1);
+    video->interval = config->interval ? config->interval : VID_DEFAULT_INTERVAL;
+
+    uint64_t pages = video->size >> BUS_PAGE_SHIFT;
+    video->memory = VID_Alloc(video->size);
+    video->shadow = VID_Alloc(video->size);
+    video->dirty = VID_Alloc((pages + 63) / 64 * sizeof(uint64_t));
+    video->rowDirty = VID_Alloc(video->height);
+
+    const char *output = config->output;
+    if (output && strncmp(output, "shm:", 4) == 0)
+    {
+        VID_OpenShm(video, output + 4);
+    }
+    else if (output && strncmp(output, "ppm:", 4) == 0)
+    {
+        if (!(video->ppmPrefix = strdup(output + 4)))
+        {
+            print_error("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (output)
+    {
+        print_error("Unknown video output %s, expected shm:/name or ppm:prefix\n", output);
+        exit(EXIT_FAILURE);
+    }
+
+    video->event = SCHED_Register("video", &VID_Service, video);
+    return video;
+}
+
+// Exports what changed since the last frame. The shared memory segment
+// stays behind for readers.
+void VID_Destroy(Video *video)
+{
+    VID_Export(video);
+    if (video->shm)
+        munmap(video->shm, video->shmSize);
+    free(video->ppmPrefix);
+    free(video->rowDirty);
+    free((void *)video->dirty);
+    free(video->shadow);
+    free(video->memory);
+    free(video);
+}
+
+void VID_Init()
+{
+    Video *video = machine->video;
+    uint64_t end = FRAMEBUFFER_START + video->size - 1;
+    BUS_RegisterDevice("video", VIDEO_START, VIDEO_END, &VID_Read, &VID_Write, video);
+    BUS_RegisterDevice("framebuffer", FRAMEBUFFER_START, end, NULL, NULL, video);
+    BUS_MapHost(FRAMEBUFFER_START, end, video->memory, true, &VID_Written);
+}
+
+// Add the changed span [x0, x1] of row y to the rectangle of the rows
+// above it if they overlap, and start a new one otherwise. Past
+// VID_MAX_RECTS, the last rectangle grows to cover the rest.
+static void VID_AddSpan(Video *video, uint32_t y, uint32_t x0, uint32_t x1)
+{
+    if (video->rectCount)
+    {
+        VideoRect *last = &video->rects[video->rectCount - 1];
+        bool below = last->y + last->height == y && x0 < last->x + last->width && x1 >= last->x;
+        if (below || video->rectCount == VID_MAX_RECTS)
+        {
+            uint32_t left = x0 < last->x ? x0 : last->x;
+            uint32_t right = x1 + 1 > last->x + last->width ? x1 + 1 : last->x + last->width;
+            last->x = left;
+            last->width = right - left;
+            last->height = y + 1 - last->y;
+            return;
+        }
+    }
+    video->rects[video->rectCount++] = (VideoRect){.x = x0, .y = y, .width = x1 + 1 - x0, .height = 1};
+}
+
+// Compare row y with the last frame and take over what changed
+static void VID_DiffRow(Video *video, uint32_t y)
+{
+    uint64_t offset = (uint64_t)y * video->stride;
+    uint8_t *now = video->memory + offset;
+    uint8_t *then = video->shadow + offset;
+    uint32_t first = 0;
+    uint32_t last = video->stride;
+
+    while (first < last && now[first] == then[first])
+        first++;
+    if (first == last)
+        return;
+    while (now[last - 1] == then[last - 1])
+        last--;
+
+    uint32_t x0 = first / video->bytesPerPixel;
+    uint32_t x1 = (last - 1) / video->bytesPerPixel;
+    memcpy(then + x0 * video->bytesPerPixel, now + x0 * video->bytesPerPixel, (x1 + 1 - x0) * video->bytesPerPixel);
+    VID_AddSpan(video, y, x0, x1);
+}
+
+static void VID_Rgb(const Video *video, const uint8_t *pixel, uint8_t *rgb)
+{
+    if (video->format == VID_FORMAT_XRGB8888)
+    {
+        rgb[0] = pixel[2];
+        rgb[1] = pixel[1];
+        rgb[2] = pixel[0];
+        return;
+    }
+    uint16_t value = pixel[0] | pixel[1] << 8;
+    uint8_t red = value >> 11, green = (value >> 5) & 0x3f, blue = value & 0x1f;
+    rgb[0] = red << 3 | red >> 2;
+    rgb[1] = green << 2 | green >> 4;
+    rgb[2] = blue << 3 | blue >> 2;
+}
+
+// <prefix><frame>-<x>-<y>.ppm for each rectangle
+static void VID_WritePpm(Video *video)
+{
+    uint8_t *row = VID_Alloc((size_t)video->width * 3);
+    for (int i = 0; i < video->rectCount; i++)
+    {
+        VideoRect *rect = &video->rects[i];
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s%06lu-%u-%u.ppm", video->ppmPrefix, video->frames, rect->x, rect->y) >=
+            (int)sizeof(path))
+            continue;
+
+        FILE *file = fopen(path, "wb");
+        if (!file)
+        {
+            print_error("Error opening %s: %s\n", path, strerror(errno));
+            break;
+        }
+        fprintf(file, "P6\n%u %u\n255\n", rect->width, rect->height);
+        for (uint32_t y = rect->y; y < rect->y + rect->height; y++)
+        {
+            const uint8_t *pixel = video->shadow + (uint64_t)y * video->stride + rect->x * video->bytesPerPixel;
+            for (uint32_t x = 0; x < rect->width; x++, pixel += video->bytesPerPixel)
+                VID_Rgb(video, pixel, &row[3 * x]);
+            fwrite(row, 3, rect->width, file);
+        }
+        if (fclose(file) == EOF)
+            print_error("Error writing %s: %s\n", path, strerror(errno));
+    }
+    free(row);
+}
+
+static void VID_WriteShm(Video *video)
+{
+    VideoShmHeader *shm = video->shm;
+    uint8_t *pixels = (uint8_t *)shm + shm->pixelOffset;
+
+    atomic_fetch_add(&shm->sequence, 1);
+    for (int i = 0; i < video->rectCount; i++)
+    {
+        VideoRect *rect = &video->rects[i];
+        for (uint32_t y = rect->y; y < rect->y + rect->height; y++)
+        {
+            uint64_t offset = (uint64_t)y * video->stride + rect->x * video->bytesPerPixel;
+            memcpy(pixels + offset, video->shadow + offset, rect->width * video->bytesPerPixel);
+        }
+    }
+    memcpy(shm->rects, video->rects, video->rectCount * sizeof(VideoRect));
+    shm->rectCount = video->rectCount;
+    shm->frame = video->frames;
+    atomic_fetch_add(&shm->sequence, 1);
+}
+
+static void VID_Export(Video *video)
+{
+    uint64_t pages = video->size >> BUS_PAGE_SHIFT;
+    uint32_t top = video->height;
+    uint32_t bottom = 0;
+
+    // Trap the dirty pages before looking at them, so writes from here on
+    // count towards the next frame
+    for (uint64_t word = 0; word < (pages + 63) / 64; word++)
+    {
+        uint64_t bits = atomic_exchange(&video->dirty[word], 0);
+        while (bits)
+        {
+            uint64_t page = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            BUS_TrapWrites(FRAMEBUFFER_START + (page << BUS_PAGE_SHIFT), BUS_PAGE_SIZE);
+
+            uint64_t first = (page << BUS_PAGE_SHIFT) / video->stride;
+            uint64_t last = (((page + 1) << BUS_PAGE_SHIFT) - 1) / video->stride;
+            if (last >= video->height)
+                last = video->height - 1;
+            for (uint64_t y = first; y <= last; y++)
+                video->rowDirty[y] = 1;
+            top = first < top ? first : top;
+            bottom = last + 1 > bottom ? last + 1 : bottom;
+        }
+    }
+
+    video->rectCount = 0;
+    for (uint32_t y = top; y < bottom; y++)
+    {
+        if (video->rowDirty[y])
+        {
+            video->rowDirty[y] = 0;
+            VID_DiffRow(video, y);
+        }
+    }
+    if (!video->rectCount)
+        return;
+
+    video->frames++;
+    print_debug("frame %lu: %d rectangles\n", video->frames, video->rectCount);
+    if (video->shm)
+        VID_WriteShm(video);
+    if (video->ppmPrefix)
+        VID_WritePpm(video);
+}
+
+uint64_t VID_Frames()
+{
+    return machine->video->frames;
+}
+
+// Called after the first write to a page since it was last exported, and
+// after writes that miss the page table (ones that cross into the next
+// page, DMA). Holds the machine's lock so that an export on CPU 0 can't
+// trap the page between marking it and letting writes through; the bytes
+// are already stored, so an export that got in first has seen them or
+// sees the page dirty next time.
+void VID_Written(void *opaque, uint64_t address, uint64_t size)
+{
+    Video *video = opaque;
+    SMP_Lock();
+    for (uint64_t page = address >> BUS_PAGE_SHIFT; page <= (address + size - 1) >> BUS_PAGE_SHIFT; page++)
+        atomic_fetch_or(&video->dirty[page / 64], (uint64_t)1 << (page % 64));
+    BUS_AllowWrites(FRAMEBUFFER_START + address, size);
+    if (!video->pending)
+    {
+        video->pending = true;
+        SCHED_ScheduleIn(video->event, video->interval);
+    }
+    SMP_Unlock();
+}
+
+void VID_Write(void *opaque, uint64_t address, uint64_t data)
+{
+    Video *video = opaque;
+    print_debug("address: %lu, data: %lu\n", address, data);
+    if (address == 0 && data == VID_CONTROL_PRESENT)
+        VID_Export(video);
+}
+
+uint64_t VID_Read(void *opaque, uint64_t address)
+{
+    Video *video = opaque;
+    switch (address)
+    {
+    case 8:
+        return video->width;
+    case 16:
+        return video->height;
+    case 24:
+        return video->format;
+    case 32:
+        return video->stride;
+    case 40:
+        return FRAMEBUFFER_START;
+    case 48:
+        return video->frames;
+    }
+    return 0;
+}
@@ -1,6 +1,64 @@
 #ifndef VIDEO_H
 #define VIDEO_H
 
-void VGA_Init();
+#include <stdbool.h>
+#include <stdint.h>
 
-#endif // VIDEO_H
\ No newline at end of file
+// pixel formats, as read from the format register
+#define VID_FORMAT_XRGB8888 1 // 32 bit little endian words, 0x00RRGGBB
+#define VID_FORMAT_RGB565 2   // 16 bit little endian words, rrrrrggggggbbbbb
+
+// values written to the control register
+#define VID_CONTROL_PRESENT 1 // export what changed now rather than at the next interval
+
+#define VID_MAX_RECTS 256 // changed rectangles per frame, more are merged
+#define VID_DEFAULT_INTERVAL 16667 // cycles, about 60 frames a second at CLOCK_FREQUENCY
+
+// Framebuffer settings, see MachineConfig. The resolution is fixed by the
+// host; the guest reads it back from the registers.
+typedef struct
+{
+    uint32_t width; // pixels, 0 for no framebuffer
+    uint32_t height;
+    int format; // VID_FORMAT_*, 0 for VID_FORMAT_XRGB8888
+    const char *output; // "shm:/name" or "ppm:prefix", NULL to only count frames
+    uint64_t interval; // cycles between exports, 0 for VID_DEFAULT_INTERVAL
+} VideoConfig;
+
+typedef struct
+{
+    uint32_t x, y, width, height;
+} VideoRect;
+
+// Layout of the shared memory segment, followed by the pixels at
+// pixelOffset in the framebuffer's format. Only the rectangles of the last
+// frame are copied in. sequence is odd while a frame is being written:
+// readers copy what they need and retry if it changed in the meantime.
+#define VID_SHM_MAGIC "TISCVID"
+typedef struct
+{
+    char magic[8];
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride; // bytes per row
+    uint64_t pixelOffset;
+    _Atomic uint64_t sequence;
+    uint64_t frame; // frames exported, this one included
+    uint32_t rectCount;
+    uint32_t reserved;
+    VideoRect rects[VID_MAX_RECTS];
+} VideoShmHeader;
+
+typedef struct Video Video;
+
+Video *VID_Create(const VideoConfig *config);
+void VID_Destroy(Video *video);
+void VID_Init();
+uint64_t VID_Frames();
+uint64_t VID_Read(void *opaque, uint64_t address);
+void VID_Write(void *opaque, uint64_t address, uint64_t data);
+void VID_Written(void *opaque, uint64_t address, uint64_t size);
+
+
+#endif // VIDEO_H
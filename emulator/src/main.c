@@ -1,75 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "common/common.h"
 #include "core/cpu.h"
-#include "core/bus.h"
-#include "core/clock.h"
-#include "devices/console.h"
-#include "devices/fileout.h"
-#include "devices/pty.h"
-#include "memory/ram.h"
+#include "core/machine.h"
+#include "core/pool.h"
+#include "core/snapshot.h"
+#include "devices/io.h"
 
 
 #define BINFILE "test.bin"
 
-// Global state
-static bool running = true;
-static bool quit = false;
-bool debug = true;
+static volatile sig_atomic_t snapshotRequested = 0;
 
-//uint8_t filebuf[1024];
+static void requestSnapshot(int signal)
+{
+    snapshotRequested = 1;
+}
+
+// Byte count with an optional K, M or G suffix
+static uint64_t parseSize(const char *text)
+{
+    char *end;
+    uint64_t size = strtoull(text, &end, 0);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10; // fall through
+    case 'M':
+    case 'm':
+        size <<= 10; // fall through
+    case 'K':
+    case 'k':
+        size <<= 10;
+    }
+    return size;
+}
+
+// Attach the host devices named in `list`, separated by commas: "pty",
+// "console", or "none" for neither
+static bool parseDevices(const char *list, MachineConfig *config)
+{
+    config->pty = config->console = false;
+    while (*list)
+    {
+        size_t length = strcspn(list, ",");
+        if (length == 3 && strncmp(list, "pty", 3) == 0)
+            config->pty = true;
+        else if (length == 7 && strncmp(list, "console", 7) == 0)
+            config->console = true;
+        else if (!(length == 4 && strncmp(list, "none", 4) == 0))
+        {
+            fprintf(stderr, "unknown device: %.*s\n", (int)length, list);
+            return false;
+        }
+        list += length + (list[length] == ',');
+    }
+    return true;
+}
+
+// Framebuffer resolution and format: "640x480", optionally followed by
+// ":xrgb8888" (the default) or ":rgb565"
+static bool parseVideo(const char *text, VideoConfig *video)
+{
+    char *end;
+    unsigned long long width = strtoull(text, &end, 10);
+    unsigned long long height = 0;
+    if (*end == 'x')
+        height = strtoull(end + 1, &end, 10);
+    if (*end == '\0' || strcmp(end, ":xrgb8888") == 0)
+        video->format = VID_FORMAT_XRGB8888;
+    else if (strcmp(end, ":rgb565") == 0)
+        video->format = VID_FORMAT_RGB565;
+    else
+        height = 0;
+
+    // out of range values come back as ULLONG_MAX
+    if (!width || !height || width > UINT32_MAX || height > UINT32_MAX)
+    {
+        fprintf(stderr, "bad video mode: %s, expected WIDTHxHEIGHT[:xrgb8888|:rgb565]\n", text);
+        return false;
+    }
+    video->width = width;
+    video->height = height;
+    return true;
+}
 
-void loadfile()
+static double secondsSince(const struct timespec *start)
 {
-    FILE *binfile;
-    binfile = fopen(BINFILE, "rb");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    fseek(binfile, 0, SEEK_END);
-    size_t filesize = ftell(binfile);
-    rewind(binfile);
+static const char *const statusNames[] = {
+    [MACHINE_RUNNING] = "out of cycles",
+    [MACHINE_HALTED] = "halted",
+    [MACHINE_FAULTED] = "faulted",
+};
 
-    size_t read = fread(ram, 1, filesize, binfile);
-    if (read != filesize)
+// One line of JSON for a run, for harnesses (-J)
+static void printSummary(const char *image, MachineStatus status, const MachineStats *stats, double seconds)
+{
+    printf("{\"image\": \"");
+    for (const char *c = image; *c; c++)
     {
-        if (feof(binfile))
+        if (*c == '"' || *c == '\\')
+            putchar('\\');
+        if ((unsigned char)*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    printf("\", \"status\": \"%s\", \"instructions\": %lu, \"cycles\": %lu, \"seconds\": %.6f, \"mips\": %.2f, "
+           "\"exit_value\": %lu, \"pty\": {\"in\": %lu, \"out\": %lu}, \"console\": {\"in\": %lu, \"out\": %lu}, "
+           "\"fileout\": {\"out\": %lu}, \"video\": {\"frames\": %lu}, \"ram_resident_kb\": %lu}\n",
+           statusNames[status], stats->instructions, stats->cycles, seconds,
+           seconds > 0 ? stats->instructions / seconds / 1e6 : 0.0, stats->exitValue, stats->ptyIn, stats->ptyOut,
+           stats->consoleIn, stats->consoleOut, stats->fileoutOut, stats->videoFrames,
+           stats->ram.resident >> 10);
+}
+
+// Run one machine until it halts or has run `maxCycles` cycles (0 for no
+// limit): an image or a snapshot, in real time with the PTY
+// attached unless told otherwise, or flat out replaying a log. With a
+// debugger, it runs when the debugger says so until that detaches.
+static int runSingle(const MachineConfig *config, const char *image, const char *restorePath, const char *snapshotPath,
+                     uint64_t maxCycles, bool json)
+{
+    Machine *m = MACHINE_Create(config);
+    if (restorePath ? !SNAP_Restore(restorePath) : !MACHINE_Load(m, image))
+        return EXIT_FAILURE;
+    if (snapshotPath)
+        signal(SIGUSR1, requestSnapshot);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t first = SCHED_Now();
+    if (m->gdb)
+        GDB_Serve();
+
+    // a quantum at a time, so snapshot requests are served promptly
+    uint64_t slice = config->quantum ? config->quantum : SCHED_DEFAULT_QUANTUM;
+    while (!maxCycles || SCHED_Now() - first < maxCycles)
+    {
+        uint64_t left = maxCycles ? maxCycles - (SCHED_Now() - first) : slice;
+        if (MACHINE_Run(m, left < slice ? left : slice) != MACHINE_RUNNING)
+            break;
+        if (snapshotRequested)
         {
-            fputs("Reading error: unexpected end of file", stderr);
+            snapshotRequested = 0;
+            SNAP_Save(snapshotPath);
         }
-        else if (ferror(binfile))
+    }
+
+    double seconds = secondsSince(&start);
+    MachineStatus status = m->status;
+    MachineStats stats;
+    MACHINE_GetStats(m, &stats);
+    if (json)
+        printSummary(restorePath ? restorePath : image, status, &stats, seconds);
+    else if (status == MACHINE_HALTED)
+        CPU_PrintRegisters();
+    print_info("RAM: %lu of %lu KB resident\n", stats.ram.resident >> 10, stats.ram.reserved >> 10);
+    MACHINE_Destroy(m);
+    return status == MACHINE_HALTED ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Run every image on its own machine, spread over a pool of threads.
+// Each machine's fileout goes to "<image>.out".
+static int runBatch(char **images, int count, int threads, uint64_t maxCycles, const MachineConfig *config, bool json)
+{
+    PoolJob *jobs = calloc(count, sizeof(PoolJob));
+    char **paths = calloc(count, sizeof(char *));
+    if (!jobs || !paths)
+    {
+        print_error("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        size_t size = strlen(images[i]) + sizeof(".out");
+        paths[i] = malloc(size);
+        if (!paths[i])
         {
-            perror("Reading error");
+            print_error("Out of memory\n");
+            return EXIT_FAILURE;
         }
-        exit(3);
+        snprintf(paths[i], size, "%s.out", images[i]);
+        jobs[i] = (PoolJob){.image = images[i], .fileout = paths[i], .maxCycles = maxCycles};
+    }
+
+    POOL_Run(jobs, count, threads, config);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (json)
+            printSummary(jobs[i].image, jobs[i].status, &jobs[i].stats, jobs[i].seconds);
+        else
+            printf("%s: %s after %lu cycles, %lu of %lu KB RAM resident\n", jobs[i].image, statusNames[jobs[i].status],
+                   jobs[i].stats.cycles, jobs[i].stats.ram.resident >> 10, jobs[i].stats.ram.reserved >> 10);
+        failed += jobs[i].status != MACHINE_HALTED;
+        free(paths[i]);
     }
-    fclose(binfile);
+    free(paths);
+    free(jobs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char *args[])
 {
+    const char *restorePath = NULL; // -r: start from a snapshot instead of test.bin
+    const char *snapshotPath = NULL; // -s: where SIGUSR1 saves a snapshot
+    long threads = sysconf(_SC_NPROCESSORS_ONLN); // -j: batch worker threads
+    const char *image = BINFILE; // -i: image to run on its own
+    uint64_t maxCycles = 0; // -c: cycle limit per machine
+    int64_t frequency = -1; // -f: clock speed in Hz, 0 for flat out, by default real time unless batch or replay
+    const char *devices = "pty"; // -d: host devices of a machine run on its own
+    bool json = false; // -J: JSON summaries
+    uint64_t ramSize = 0; // -m: guest RAM per machine
+    int cpus = 0; // -p: CPUs per machine
+    const char *recordPath = NULL; // -e: log host input for -E
+    const char *replayPath = NULL; // -E: replay host input from a log
+    const char *gdbAddress = NULL; // -g: port or socket path to wait for a debugger on
+    const char *videoMode = NULL; // -v: framebuffer resolution and format
+    const char *videoOutput = NULL; // -o: where changed framebuffer rectangles go
+    uint64_t videoInterval = 0; // -F: cycles between framebuffer exports
+    int option;
 
-    loadfile();
-    CPU_Init();
-   // CON_Init();
-    PTY_Init();
-
-    while (!quit)
+    while ((option = getopt(argc, args, "i:r:s:j:c:f:d:m:p:e:E:g:v:o:F:J")) != -1)
     {
-        if (running)
+        switch (option)
         {
-            CL_Tick(); // Clock tick
-            CPU_Tick(); // CPU tick
-            CPU_PrintRegisters(); // Print CPU registers
-            //MMIO_Writer();
-            //CON_Tick(); // Console tick
-            FO_Tick(); // Fileout device tick
-            PTY_Tick(); // PTY Tick
-            //BUS_SendInterrupt(1);
+        case 'i':
+            image = optarg;
+            break;
+        case 'r':
+            restorePath = optarg;
+            break;
+        case 's':
+            snapshotPath = optarg;
+            break;
+        case 'j':
+            threads = strtol(optarg, NULL, 0);
+            break;
+        case 'c':
+            maxCycles = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            frequency = strtoll(optarg, NULL, 0);
+            break;
+        case 'd':
+            devices = optarg;
+            break;
+        case 'J':
+            json = true;
+            break;
+        case 'm':
+            ramSize = parseSize(optarg);
+            break;
+        case 'p':
+            cpus = strtol(optarg, NULL, 0);
+            break;
+        case 'e':
+            recordPath = optarg;
+            break;
+        case 'E':
+            replayPath = optarg;
+            break;
+        case 'g':
+            gdbAddress = optarg;
+            break;
+        case 'v':
+            videoMode = optarg;
+            break;
+        case 'o':
+            videoOutput = optarg;
+            break;
+        case 'F':
+            videoInterval = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-J] [-i image | -r snapshot] [-m ram] [-p cpus] [-f hz] [-c cycles] [-d pty,console|none]\n"
+                            "          [-s snapshot] [-e log | -E log] [-g port|socket] [-v WxH[:format] [-o shm:/name|ppm:prefix] [-F cycles]]\n"
+                            "       %s [-J] [-m ram] [-p cpus] [-f hz] [-j threads] [-c cycles] image...\n", args[0], args[0]);
+            return EXIT_FAILURE;
         }
     }
 
-    return 0;
-}
\ No newline at end of file
+    LOG_Init();
+    IO_Init();
+    IO_Start();
+
+    const char *quantum = getenv("TISC_QUANTUM");
+    MachineConfig config = {.quantum = quantum ? strtoull(quantum, NULL, 0) : 0, .ramSize = ramSize, .cpus = cpus};
+
+    if (frequency < 0)
+        frequency = optind < argc || replayPath ? 0 : CLOCK_FREQUENCY;
+    config.frequency = frequency;
+    if (optind < argc)
+        return runBatch(&args[optind], argc - optind, threads, maxCycles, &config, json);
+
+    // A replay takes its input from the log and runs flat out
+    config.record = recordPath;
+    config.replay = replayPath;
+    config.gdb = gdbAddress;
+    config.video.output = videoOutput;
+    config.video.interval = videoInterval;
+    if (videoMode && !parseVideo(videoMode, &config.video))
+        return EXIT_FAILURE;
+    if (!replayPath && !parseDevices(devices, &config))
+        return EXIT_FAILURE;
+    return runSingle(&config, image, restorePath, snapshotPath, maxCycles, json);
+}
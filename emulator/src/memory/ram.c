@@ -1,19 +1,87 @@
+#define _DEFAULT_SOURCE
+#define LOG_CATEGORY LOG_RAM
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include "../common/common.h"
 #include "../core/bus.h"
+#include "../core/machine.h"
 #include "ram.h"
 
-uint8_t ram[8388608]; // 8 Megabytes
+// Guest RAM is a mapping rather than an array so that a snapshot can be
+// mapped over it copy-on-write, and so that a machine only pays for the
+// pages its guest touches: the whole size is reserved up front without
+// committing swap, and the kernel hands out zero pages on first touch. The
+// address never changes after RAM_Create; the bus and the JIT keep
+// pointers into it.
+//
+// The first RAM_LOW_SIZE bytes appear at RAM_START, anything beyond at
+// HIGH_RAM_START, above ROM and the devices.
+uint8_t *RAM_Create(uint64_t size)
+{
+    uint8_t *ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ram == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return ram;
+}
 
-uint64_t RAM_Read(uint64_t address)
+void RAM_Destroy(uint8_t *ram, uint64_t size)
 {
-    print_debug("\n");
-    uint64_t data = *((uint64_t *)&ram[address]);
-    return data;
+    munmap(ram, size);
 }
 
-uint64_t RAM_Write(uint64_t address, uint64_t data)
+// Replace the contents of RAM with `size` bytes of fd at offset (page
+// aligned). Pages are only read in when touched and are private to this
+// instance once written.
+void RAM_MapFile(uint8_t *ram, uint64_t size, int fd, off_t offset)
 {
+    if (mmap(ram, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Bytes of RAM at RAM_START, the part code can be translated from
+uint64_t RAM_LowSize()
+{
+    return machine->ramSize < RAM_LOW_SIZE ? machine->ramSize : RAM_LOW_SIZE;
+}
+
+// Resident pages as reported by mincore: pages the guest touched, and
+// pages of a mapped image or snapshot that are in the page cache
+void RAM_GetStats(RamStats *stats)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned char vector[4096];
+    stats->reserved = machine->ramSize;
+    stats->resident = 0;
+
+    for (uint64_t offset = 0; offset < machine->ramSize; offset += sizeof(vector) * pageSize)
+    {
+        uint64_t length = machine->ramSize - offset;
+        if (length > sizeof(vector) * pageSize)
+            length = sizeof(vector) * pageSize;
+        if (mincore(machine->ram + offset, length, vector) == -1)
+            return;
+        for (uint64_t i = 0; i < (length + pageSize - 1) / pageSize; i++)
+            stats->resident += (vector[i] & 1) * pageSize;
+    }
+}
+
+// Plain RAM pages are read and written straight through the bus page
+// table; these only run for pages that trap, such as pages holding code.
+
+uint64_t RAM_Read(void *opaque, uint64_t address)
+{
+    uint8_t *ram = opaque;
     print_debug("\n");
-    *((uint64_t *)&ram[address]) = data;
+    uint64_t data;
+    memcpy(&data, &ram[address], sizeof(data));
     return data;
-}
\ No newline at end of file
+}
@@ -2,9 +2,25 @@
 #define RAM_H
 
 #include <stdint.h>
-extern uint8_t ram[8388608];
+#include <sys/types.h>
 
-uint64_t RAM_Read(uint64_t address);
-uint64_t RAM_Write(uint64_t address, uint64_t data);
+#include "../core/bus.h"
 
-#endif // RAM_H
\ No newline at end of file
+#define RAM_DEFAULT_SIZE 8388608 // 8 Megabytes
+#define RAM_MAX_SIZE (RAM_LOW_SIZE + (HIGH_RAM_END - HIGH_RAM_START + 1))
+
+// Host memory use of a machine's RAM
+typedef struct
+{
+    uint64_t reserved; // bytes of guest RAM
+    uint64_t resident; // bytes of it in host memory
+} RamStats;
+
+uint8_t *RAM_Create(uint64_t size);
+void RAM_Destroy(uint8_t *ram, uint64_t size);
+void RAM_MapFile(uint8_t *ram, uint64_t size, int fd, off_t offset);
+uint64_t RAM_LowSize();
+void RAM_GetStats(RamStats *stats);
+uint64_t RAM_Read(void *opaque, uint64_t address);
+
+#endif // RAM_H
@@ -1,13 +1,47 @@
+#define _DEFAULT_SOURCE
+#define LOG_CATEGORY LOG_RAM
+#include <stdlib.h>
+#include <sys/mman.h>
+
 #include "../common/common.h"
 #include "../core/bus.h"
 #include "rom.h"
 
-static uint8_t rom[1048576]; // 1 Megabyte
+// ROM belongs to a machine like RAM does: the loader fills it from the
+// image (mapping the file where it can), after which the guest can only
+// read it. It is a mapping for the same reasons as RAM; see ram.c.
+uint8_t *ROM_Create()
+{
+    uint8_t *rom = mmap(NULL, ROM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (rom == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return rom;
+}
+
+void ROM_Destroy(uint8_t *rom)
+{
+    munmap(rom, ROM_SIZE);
+}
 
-uint64_t ROM_Read(uint64_t address) {
-    rom[0] = 69;
+// Replace the contents of ROM with ROM_SIZE bytes of fd at offset (page
+// aligned)
+void ROM_MapFile(uint8_t *rom, int fd, off_t offset)
+{
+    if (mmap(rom, ROM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    //uint64_t data =  *((uint64_t *)&rom[address]);
-    //return data;
-    return rom[0]; // always return 69
-}
\ No newline at end of file
+// ROM pages are normally read straight from host memory through the bus
+// page table, this is the callback for anything that can't take that path
+uint64_t ROM_Read(void *opaque, uint64_t address)
+{
+    uint8_t *rom = opaque;
+    print_debug("\n");
+    return *((uint64_t *)&rom[address]);
+}
@@ -2,7 +2,13 @@
 #define ROM_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
-uint64_t ROM_Read(uint64_t address);
+#define ROM_SIZE 1048576 // 1 Megabyte
 
-#endif // ROM_H
\ No newline at end of file
+uint8_t *ROM_Create();
+void ROM_Destroy(uint8_t *rom);
+void ROM_MapFile(uint8_t *rom, int fd, off_t offset);
+uint64_t ROM_Read(void *opaque, uint64_t address);
+
+#endif // ROM_H